@@ -16,6 +16,7 @@
 
 #include "erofs/print.h"
 #include "erofs/io.h"
+#include "erofs/dir.h"
 
 struct dumpcfg {
 	bool print_superblock;
@@ -177,11 +178,11 @@ static int z_erofs_get_last_cluster_size_from_disk(struct erofs_map_blocks *map,
 	char *decompress;
 	char raw[Z_EROFS_PCLUSTER_MAX_SIZE] = {0};
 
-	ret = dev_read(raw, map->m_pa, map->m_plen);
+	ret = dev_read(&g_sbi, raw, map->m_pa, map->m_plen);
 	if (ret < 0)
 		return -EIO;
 
-	if (erofs_sb_has_lz4_0padding()) {
+	if (erofs_sb_has_lz4_0padding(&g_sbi)) {
 		compressed_len = map->m_plen;
 	} else {
 		// lz4 maximum compression ratio is 255
@@ -220,7 +221,7 @@ static int z_erofs_get_compressed_size(struct erofs_inode *inode,
 		erofs_off_t *size)
 {
 	int err;
-	erofs_blk_t compressedlcs;
+	erofs_blk_t compressedblks;
 	erofs_off_t last_cluster_size;
 	erofs_off_t last_cluster_compressed_size;
 	struct erofs_map_blocks map = {
@@ -228,15 +229,20 @@ static int z_erofs_get_compressed_size(struct erofs_inode *inode,
 		.m_la = inode->i_size - 1,
 	};
 
-	err = z_erofs_map_blocks_iter(inode, &map);
+	err = z_erofs_map_blocks_iter(inode, &map, 0);
 	if (err) {
 		erofs_err("read nid %ld's last block failed\n", inode->nid);
 		return err;
 	}
-	compressedlcs = map.m_plen >> inode->z_logical_clusterbits;
-	*size = (inode->u.i_blocks - compressedlcs) * EROFS_BLKSIZ;
+	compressedblks = erofs_blknr(map.m_plen);
+	/* deduplicated pclusters aren't counted in i_blocks */
+	*size = (inode->u.i_blocks - min(inode->u.i_blocks, compressedblks)) *
+		EROFS_BLKSIZ;
 	last_cluster_size = inode->i_size - map.m_la;
 
+	/* the tail extent is accounted to the packed inode */
+	if (map.m_flags & EROFS_MAP_FRAGMENT)
+		return 0;
 	if (!(map.m_flags & EROFS_MAP_ZIPPED)) {
 		*size += last_cluster_size;
 	} else {
@@ -262,6 +268,7 @@ static int get_file_compressed_size(struct erofs_inode *inode,
 	switch (inode->datalayout) {
 	case EROFS_INODE_FLAT_INLINE:
 	case EROFS_INODE_FLAT_PLAIN:
+	case EROFS_INODE_CHUNK_BASED:
 		stats.uncompressed_files++;
 		*size = inode->i_size;
 		break;
@@ -279,47 +286,103 @@ static int get_file_compressed_size(struct erofs_inode *inode,
 
 static void dumpfs_print_superblock(void)
 {
-	time_t time = sbi.build_time;
+	time_t time = g_sbi.build_time;
 
 	fprintf(stderr, "Filesystem magic number:	0x%04X\n", EROFS_SUPER_MAGIC_V1);
-	fprintf(stderr, "Filesystem blocks: 		%lu\n", sbi.blocks);
-	fprintf(stderr, "Filesystem meta block:		%u\n", sbi.meta_blkaddr);
-	fprintf(stderr, "Filesystem xattr block:	%u\n", sbi.xattr_blkaddr);
-	fprintf(stderr, "Filesystem root nid:		%ld\n", sbi.root_nid);
-	fprintf(stderr, "Filesystem valid inos:		%lu\n", sbi.inos);
+	fprintf(stderr, "Filesystem block size:		%u\n", EROFS_BLKSIZ);
+	fprintf(stderr, "Filesystem blocks: 		%lu\n", g_sbi.blocks);
+	fprintf(stderr, "Filesystem meta block:		%u\n", g_sbi.meta_blkaddr);
+	fprintf(stderr, "Filesystem xattr block:	%u\n", g_sbi.xattr_blkaddr);
+	fprintf(stderr, "Filesystem root nid:		%ld\n", g_sbi.root_nid);
+	fprintf(stderr, "Filesystem valid inos:		%lu\n", g_sbi.inos);
 	fprintf(stderr, "Filesystem created:		%s", ctime(&time));
 	fprintf(stderr, "Filesystem uuid:		");
 	for (int i = 0; i < 16; i++)
-		fprintf(stderr, "%02x", sbi.uuid[i]);
+		fprintf(stderr, "%02x", g_sbi.uuid[i]);
 	fprintf(stderr, "\n");
 
-	if (erofs_sb_has_lz4_0padding())
+	if (erofs_sb_has_lz4_0padding(&g_sbi))
 		fprintf(stderr, "Filesystem support lz4 0padding\n");
 	else
 		fprintf(stderr, "Filesystem not support lz4 0padding\n");
 
-	if (erofs_sb_has_big_pcluster())
+	if (erofs_sb_has_big_pcluster(&g_sbi))
 		fprintf(stderr, "Filesystem support big pcluster\n");
 	else
 		fprintf(stderr, "Filesystem not support big pcluster\n");
 
-	if (erofs_sb_has_sb_chksum())
+	if (erofs_sb_has_chunked_file(&g_sbi))
+		fprintf(stderr, "Filesystem support chunk-based files\n");
+	else
+		fprintf(stderr, "Filesystem not support chunk-based files\n");
+
+	if (erofs_sb_has_ztailpacking(&g_sbi))
+		fprintf(stderr, "Filesystem support tail-packing inline pcluster\n");
+	else
+		fprintf(stderr, "Filesystem not support tail-packing inline pcluster\n");
+
+	if (erofs_sb_has_fragments(&g_sbi))
+		fprintf(stderr, "Filesystem support packed fragments\n");
+	else
+		fprintf(stderr, "Filesystem not support packed fragments\n");
+
+	if (erofs_sb_has_sb_chksum(&g_sbi))
 		fprintf(stderr, "Filesystem has super block checksum feature\n");
 	else
 		fprintf(stderr, "Filesystem has no superblock checksum feature\n");
 
 }
 
+struct dumpfs_path_context {
+	struct erofs_dir_context ctx;
+	erofs_nid_t nid, parent_nid, target;
+	char *path;
+	unsigned int pos;
+};
+
+static int get_path_by_nid(erofs_nid_t nid, erofs_nid_t parent_nid,
+		erofs_nid_t target, char *path, unsigned int pos);
+
+static int dumpfs_path_filldir(struct erofs_dir_context *ctx)
+{
+	struct dumpfs_path_context *pctx =
+		container_of(ctx, struct dumpfs_path_context, ctx);
+	char *path = pctx->path;
+	unsigned int pos = pctx->pos;
+
+	if (ctx->de_nid == pctx->target) {
+		memcpy(path + pos, ctx->dname, ctx->de_namelen);
+		return 1;
+	}
+
+	if (ctx->de_ftype == EROFS_FT_DIR &&
+			ctx->de_nid != pctx->parent_nid &&
+			ctx->de_nid != pctx->nid) {
+		memcpy(path + pos, ctx->dname, ctx->de_namelen);
+		if (!get_path_by_nid(ctx->de_nid, pctx->nid, pctx->target,
+				path, pos + ctx->de_namelen))
+			return 1;
+		memset(path + pos, 0, ctx->de_namelen);
+	}
+	return 0;
+}
+
 static int get_path_by_nid(erofs_nid_t nid, erofs_nid_t parent_nid,
 		erofs_nid_t target, char *path, unsigned int pos)
 {
 	int err;
-	struct erofs_inode inode = {.nid = nid};
-	erofs_off_t offset;
-	char buf[EROFS_BLKSIZ];
+	struct erofs_inode inode = { .sbi = &g_sbi, .nid = nid};
+	struct dumpfs_path_context pctx = {
+		.ctx.dir = &inode,
+		.ctx.cb = dumpfs_path_filldir,
+		.nid = nid,
+		.parent_nid = parent_nid,
+		.target = target,
+		.path = path,
+	};
 
 	path[pos++] = '/';
-	if (target == sbi.root_nid)
+	if (target == g_sbi.root_nid)
 		return 0;
 
 	err = erofs_read_inode_from_disk(&inode);
@@ -328,68 +391,11 @@ static int get_path_by_nid(erofs_nid_t nid, erofs_nid_t parent_nid,
 		return err;
 	}
 
-	offset = 0;
-	while (offset < inode.i_size) {
-		erofs_off_t maxsize = min_t(erofs_off_t,
-					inode.i_size - offset, EROFS_BLKSIZ);
-		struct erofs_dirent *de = (void *)buf;
-		struct erofs_dirent *end;
-		unsigned int nameoff;
-
-		err = erofs_pread(&inode, buf, maxsize, offset);
-		if (err)
-			return err;
-
-		nameoff = le16_to_cpu(de->nameoff);
-		if (nameoff < sizeof(struct erofs_dirent) ||
-		    nameoff >= PAGE_SIZE) {
-			erofs_err("invalid de[0].nameoff %u @ nid %llu",
-				  nameoff, nid | 0ULL);
-			return -EFSCORRUPTED;
-		}
-
-		end = (void *)buf + nameoff;
-		while (de < end) {
-			const char *dname;
-			unsigned int dname_len;
-
-			nameoff = le16_to_cpu(de->nameoff);
-			dname = (char *)buf + nameoff;
-			if (de + 1 >= end)
-				dname_len = strnlen(dname, maxsize - nameoff);
-			else
-				dname_len = le16_to_cpu(de[1].nameoff)
-					- nameoff;
-
-			/* a corrupted entry is found */
-			if (nameoff + dname_len > maxsize ||
-			    dname_len > EROFS_NAME_LEN) {
-				erofs_err("bogus dirent @ nid %llu",
-						le64_to_cpu(de->nid) | 0ULL);
-				DBG_BUGON(1);
-				return -EFSCORRUPTED;
-			}
-
-			if (de->nid == target) {
-				memcpy(path + pos, dname, dname_len);
-				return 0;
-			}
-
-			if (de->file_type == EROFS_FT_DIR &&
-					de->nid != parent_nid &&
-					de->nid != nid) {
-				memcpy(path + pos, dname, dname_len);
-				err = get_path_by_nid(de->nid, nid,
-						target, path, pos + dname_len);
-				if (!err)
-					return 0;
-				memset(path + pos, 0, dname_len);
-			}
-			++de;
-		}
-		offset += maxsize;
-	}
-	return -1;
+	pctx.pos = pos;
+	err = erofs_iterate_dir(&pctx.ctx);
+	if (err < 0)
+		return err;
+	return err ? 0 : -1;
 }
 
 static void dumpfs_print_inode(void)
@@ -397,7 +403,7 @@ static void dumpfs_print_inode(void)
 	int err;
 	erofs_off_t size;
 	erofs_nid_t nid = dumpcfg.ino;
-	struct erofs_inode inode = {.nid = nid};
+	struct erofs_inode inode = { .sbi = &g_sbi, .nid = nid};
 	char path[PATH_MAX + 1] = {0};
 	time_t t = inode.i_ctime;
 
@@ -481,6 +487,9 @@ static void dumpfs_print_inode(void)
 	case EROFS_INODE_FLAT_COMPRESSION:
 		fprintf(stderr, "EROFS_INODE_FLAT_COMPRESSION\n");
 		break;
+	case EROFS_INODE_CHUNK_BASED:
+		fprintf(stderr, "EROFS_INODE_CHUNK_BASED\n");
+		break;
 	default:
 		break;
 	}
@@ -490,7 +499,7 @@ static void dumpfs_print_inode(void)
 	fprintf(stderr, "File gid:		%u\n", inode.i_gid);
 	fprintf(stderr, "File hard-link count:	%u\n", inode.i_nlink);
 
-	err = get_path_by_nid(sbi.root_nid, sbi.root_nid, nid, path, 0);
+	err = get_path_by_nid(g_sbi.root_nid, g_sbi.root_nid, nid, path, 0);
 	if (!err)
 		fprintf(stderr, "File path:		%s\n", path);
 	else
@@ -501,7 +510,7 @@ static void dumpfs_print_inode_phy(void)
 {
 	int err;
 	erofs_nid_t nid = dumpcfg.ino_phy;
-	struct erofs_inode inode = {.nid = nid};
+	struct erofs_inode inode = { .sbi = &g_sbi, .nid = nid};
 	char path[PATH_MAX + 1] = {0};
 
 	err = erofs_read_inode_from_disk(&inode);
@@ -510,7 +519,7 @@ static void dumpfs_print_inode_phy(void)
 		return;
 	}
 
-	const erofs_off_t ibase = iloc(inode.nid);
+	const erofs_off_t ibase = iloc(&g_sbi, inode.nid);
 	const erofs_off_t pos = Z_EROFS_VLE_LEGACY_INDEX_ALIGN(
 			ibase + inode.inode_isize + inode.xattr_isize);
 	erofs_blk_t blocks = inode.u.i_blocks;
@@ -540,7 +549,7 @@ static void dumpfs_print_inode_phy(void)
 
 	case EROFS_INODE_FLAT_COMPRESSION_LEGACY:
 	case EROFS_INODE_FLAT_COMPRESSION:
-		err = z_erofs_map_blocks_iter(&inode, &map);
+		err = z_erofs_map_blocks_iter(&inode, &map, 0);
 		if (err)
 			erofs_err("get file blocks range failed");
 
@@ -550,9 +559,16 @@ static void dumpfs_print_inode_phy(void)
 				"	Compressed Block Address:	%u - %u\n",
 				start, end);
 		break;
+
+	case EROFS_INODE_CHUNK_BASED:
+		fprintf(stderr, "File size:			%lu\n",
+				inode.i_size);
+		fprintf(stderr, "	Chunk size:			%llu\n",
+				1ULL << inode.u.chunkbits);
+		break;
 	}
 
-	err = get_path_by_nid(sbi.root_nid, sbi.root_nid, nid, path, 0);
+	err = get_path_by_nid(g_sbi.root_nid, g_sbi.root_nid, nid, path, 0);
 	if (!err)
 		fprintf(stderr, "File Path:			%s\n",
 				path);
@@ -576,161 +592,137 @@ static int get_file_type(const char *filename)
 	return type;
 }
 
-// file count、file size、file type
-static int read_dir(erofs_nid_t nid, erofs_nid_t parent_nid)
+struct dumpfs_stat_context {
+	struct erofs_dir_context ctx;
+	erofs_nid_t nid, parent_nid;
+};
+
+static int read_dir(erofs_nid_t nid, erofs_nid_t parent_nid);
+
+static int dumpfs_stat_filldir(struct erofs_dir_context *ctx)
 {
-	struct erofs_inode vi = { .nid = nid};
-	int err;
-	char buf[EROFS_BLKSIZ];
+	struct dumpfs_stat_context *sctx =
+		container_of(ctx, struct dumpfs_stat_context, ctx);
+	erofs_nid_t nid = sctx->nid, parent_nid = sctx->parent_nid;
 	char filename[PATH_MAX + 1];
-	erofs_off_t offset;
+	struct erofs_inode inode = {
+		.sbi = &g_sbi,
+		.nid = ctx->de_nid,
+	};
+	int actual_size_mark;
+	int original_size_mark;
+	erofs_off_t actual_size = 0;
+	erofs_off_t original_size;
+	int err;
 
-	err = erofs_read_inode_from_disk(&vi);
-	if (err)
-		return err;
+	if (ctx->de_nid != nid && ctx->de_nid != parent_nid)
+		stats.files++;
 
-	offset = 0;
-	while (offset < vi.i_size) {
-		erofs_off_t maxsize = min_t(erofs_off_t,
-			vi.i_size - offset, EROFS_BLKSIZ);
-		struct erofs_dirent *de = (void *)buf;
-		struct erofs_dirent *end;
-		unsigned int nameoff;
+	memset(filename, 0, PATH_MAX + 1);
+	memcpy(filename, ctx->dname, ctx->de_namelen);
 
-		err = erofs_pread(&vi, buf, maxsize, offset);
-		if (err)
+	switch (ctx->de_ftype) {
+	case EROFS_FT_UNKNOWN:
+		break;
+	case EROFS_FT_REG_FILE:
+		err = erofs_read_inode_from_disk(&inode);
+		if (err) {
+			erofs_err("read file inode from disk failed!");
 			return err;
+		}
+		original_size = inode.i_size;
+		stats.files_total_origin_size += original_size;
+		stats.regular_files++;
 
-		nameoff = le16_to_cpu(de->nameoff);
-
-		if (nameoff < sizeof(struct erofs_dirent) ||
-		    nameoff >= PAGE_SIZE) {
-			erofs_err("invalid de[0].nameoff %u @ nid %llu",
-				  nameoff, nid | 0ULL);
-			return -EFSCORRUPTED;
+		err = get_file_compressed_size(&inode, &actual_size);
+		if (err) {
+			erofs_err("get file size failed\n");
+			return err;
 		}
-		end = (void *)buf + nameoff;
-		while (de < end) {
-			const char *dname;
-			unsigned int dname_len;
-			struct erofs_inode inode = { .nid = de->nid };
-			int actual_size_mark;
-			int original_size_mark;
-			erofs_off_t actual_size = 0;
-			erofs_off_t original_size;
-
-			nameoff = le16_to_cpu(de->nameoff);
-			dname = (char *)buf + nameoff;
-
-			if (de + 1 >= end)
-				dname_len = strnlen(dname, maxsize - nameoff);
-			else
-				dname_len =
-					le16_to_cpu(de[1].nameoff) - nameoff;
-
-			/* a corrupted entry is found */
-			if (nameoff + dname_len > maxsize ||
-				dname_len > EROFS_NAME_LEN) {
-				erofs_err("bogus dirent @ nid %llu",
-						le64_to_cpu(de->nid) | 0ULL);
-				DBG_BUGON(1);
-				return -EFSCORRUPTED;
+		stats.files_total_size += actual_size;
+		stats.file_type_stat[get_file_type(filename)]++;
+
+		original_size_mark = 0;
+		actual_size_mark = 0;
+		actual_size >>= 10;
+		original_size >>= 10;
+
+		while (actual_size || original_size) {
+			if (actual_size) {
+				actual_size >>= 1;
+				actual_size_mark++;
+			}
+			if (original_size) {
+				original_size >>= 1;
+				original_size_mark++;
 			}
-			if (de->nid != nid && de->nid != parent_nid)
-				stats.files++;
-
-			memset(filename, 0, PATH_MAX + 1);
-			memcpy(filename, dname, dname_len);
-
-			switch (de->file_type) {
-			case EROFS_FT_UNKNOWN:
-				break;
-			case EROFS_FT_REG_FILE:
-				err = erofs_read_inode_from_disk(&inode);
-				if (err) {
-					erofs_err("read file inode from disk failed!");
-					return err;
-				}
-				original_size = inode.i_size;
-				stats.files_total_origin_size += original_size;
-				stats.regular_files++;
-
-				err = get_file_compressed_size(&inode,
-						&actual_size);
-				if (err) {
-					erofs_err("get file size failed\n");
-					return err;
-				}
-				stats.files_total_size += actual_size;
-				stats.file_type_stat[get_file_type(filename)]++;
-
-				original_size_mark = 0;
-				actual_size_mark = 0;
-				actual_size >>= 10;
-				original_size >>= 10;
-
-				while (actual_size || original_size) {
-					if (actual_size) {
-						actual_size >>= 1;
-						actual_size_mark++;
-					}
-					if (original_size) {
-						original_size >>= 1;
-						original_size_mark++;
-					}
-				}
-
-				if (original_size_mark >= FILE_SIZE_BITS - 1)
-					stats.file_org_size[FILE_SIZE_BITS - 1]++;
-				else
-					stats.file_org_size[original_size_mark]++;
-				if (actual_size_mark >= FILE_SIZE_BITS - 1)
-					stats.file_comp_size[FILE_SIZE_BITS - 1]++;
-				else
-					stats.file_comp_size[actual_size_mark]++;
-				break;
-
-			case EROFS_FT_DIR:
-				if (de->nid != nid && de->nid != parent_nid) {
-					stats.dir_files++;
-					stats.uncompressed_files++;
-					err = read_dir(de->nid, nid);
-					if (err) {
-						fprintf(stderr,
-								"parse dir nid %llu error occurred\n",
-								de->nid);
-						return err;
-					}
-				}
-				break;
-			case EROFS_FT_CHRDEV:
-				stats.chardev_files++;
-				stats.uncompressed_files++;
-				break;
-			case EROFS_FT_BLKDEV:
-				stats.blkdev_files++;
-				stats.uncompressed_files++;
-				break;
-			case EROFS_FT_FIFO:
-				stats.fifo_files++;
-				stats.uncompressed_files++;
-				break;
-			case EROFS_FT_SOCK:
-				stats.sock_files++;
-				stats.uncompressed_files++;
-				break;
-			case EROFS_FT_SYMLINK:
-				stats.symlink_files++;
-				stats.uncompressed_files++;
-				break;
+		}
+
+		if (original_size_mark >= FILE_SIZE_BITS - 1)
+			stats.file_org_size[FILE_SIZE_BITS - 1]++;
+		else
+			stats.file_org_size[original_size_mark]++;
+		if (actual_size_mark >= FILE_SIZE_BITS - 1)
+			stats.file_comp_size[FILE_SIZE_BITS - 1]++;
+		else
+			stats.file_comp_size[actual_size_mark]++;
+		break;
+
+	case EROFS_FT_DIR:
+		if (ctx->de_nid != nid && ctx->de_nid != parent_nid) {
+			stats.dir_files++;
+			stats.uncompressed_files++;
+			err = read_dir(ctx->de_nid, nid);
+			if (err) {
+				fprintf(stderr,
+						"parse dir nid %llu error occurred\n",
+						ctx->de_nid | 0ULL);
+				return err;
 			}
-			++de;
 		}
-		offset += maxsize;
+		break;
+	case EROFS_FT_CHRDEV:
+		stats.chardev_files++;
+		stats.uncompressed_files++;
+		break;
+	case EROFS_FT_BLKDEV:
+		stats.blkdev_files++;
+		stats.uncompressed_files++;
+		break;
+	case EROFS_FT_FIFO:
+		stats.fifo_files++;
+		stats.uncompressed_files++;
+		break;
+	case EROFS_FT_SOCK:
+		stats.sock_files++;
+		stats.uncompressed_files++;
+		break;
+	case EROFS_FT_SYMLINK:
+		stats.symlink_files++;
+		stats.uncompressed_files++;
+		break;
 	}
 	return 0;
 }
 
+// file count、file size、file type
+static int read_dir(erofs_nid_t nid, erofs_nid_t parent_nid)
+{
+	struct erofs_inode vi = { .sbi = &g_sbi, .nid = nid};
+	struct dumpfs_stat_context sctx = {
+		.ctx.dir = &vi,
+		.ctx.cb = dumpfs_stat_filldir,
+		.nid = nid,
+		.parent_nid = parent_nid,
+	};
+	int err;
+
+	err = erofs_read_inode_from_disk(&vi);
+	if (err)
+		return err;
+	return erofs_iterate_dir(&sctx.ctx);
+}
+
 static void dumpfs_print_statistic_of_filetype(void)
 {
 	fprintf(stderr, "Filesystem total file count:         %lu\n",
@@ -831,8 +823,8 @@ static void dumpfs_print_statistic(void)
 {
 	int err;
 
-	stats.blocks = sbi.blocks;
-	err = read_dir(sbi.root_nid, sbi.root_nid);
+	stats.blocks = g_sbi.blocks;
+	err = read_dir(g_sbi.root_nid, g_sbi.root_nid);
 	if (err) {
 		erofs_err("read dir failed");
 		return;
@@ -861,13 +853,13 @@ int main(int argc, char **argv)
 		return -1;
 	}
 
-	err = dev_open_ro(cfg.c_img_path);
+	err = dev_open_ro(&g_sbi, cfg.c_img_path);
 	if (err) {
 		erofs_err("open image file failed");
 		return -1;
 	}
 
-	err = erofs_read_superblock();
+	err = erofs_read_superblock(&g_sbi);
 	if (err) {
 		erofs_err("read superblock failed");
 		return -1;
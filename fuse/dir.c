@@ -4,100 +4,89 @@
  *
  * Created by Li Guifu <blucerlee@gmail.com>
  */
-#include <fuse.h>
-#include <fuse_opt.h>
+#include <stdlib.h>
 
-#include "erofs/internal.h"
 #include "erofs/print.h"
+#include "erofs/dir.h"
+#include "meta.h"
 
-static int erofs_fill_dentries(struct erofs_inode *dir,
-			       fuse_fill_dir_t filler, void *buf,
-			       void *dblk, unsigned int nameoff,
-			       unsigned int maxsize)
+#include <fuse.h>
+#include <fuse_lowlevel.h>
+
+fuse_ino_t erofsfuse_to_ino(erofs_nid_t nid);
+
+/* file types of dirents, so that callers don't need to stat each entry */
+static const umode_t erofsfuse_mode_by_ftype[EROFS_FT_MAX] = {
+	[EROFS_FT_REG_FILE]	= S_IFREG,
+	[EROFS_FT_DIR]		= S_IFDIR,
+	[EROFS_FT_CHRDEV]	= S_IFCHR,
+	[EROFS_FT_BLKDEV]	= S_IFBLK,
+	[EROFS_FT_FIFO]		= S_IFIFO,
+	[EROFS_FT_SOCK]		= S_IFSOCK,
+	[EROFS_FT_SYMLINK]	= S_IFLNK,
+};
+
+struct erofsfuse_readdir_context {
+	struct erofs_dir_context ctx;
+
+	fuse_req_t req;
+	char *buf;
+	size_t size, pos;
+};
+
+/* returns 1 when the reply buffer is full */
+static int erofsfuse_filldir(struct erofs_dir_context *ctx)
 {
-	struct erofs_dirent *de = dblk;
-	const struct erofs_dirent *end = dblk + nameoff;
+	struct erofsfuse_readdir_context *rctx =
+		container_of(ctx, struct erofsfuse_readdir_context, ctx);
 	char namebuf[EROFS_NAME_LEN + 1];
-
-	while (de < end) {
-		const char *de_name;
-		unsigned int de_namelen;
-
-		nameoff = le16_to_cpu(de->nameoff);
-		de_name = (char *)dblk + nameoff;
-
-		/* the last dirent in the block? */
-		if (de + 1 >= end)
-			de_namelen = strnlen(de_name, maxsize - nameoff);
-		else
-			de_namelen = le16_to_cpu(de[1].nameoff) - nameoff;
-
-		/* a corrupted entry is found */
-		if (nameoff + de_namelen > maxsize ||
-		    de_namelen > EROFS_NAME_LEN) {
-			erofs_err("bogus dirent @ nid %llu", dir->nid | 0ULL);
-			DBG_BUGON(1);
-			return -EFSCORRUPTED;
-		}
-
-		memcpy(namebuf, de_name, de_namelen);
-		namebuf[de_namelen] = '\0';
-
-		filler(buf, namebuf, NULL, 0);
-		++de;
-	}
+	struct stat stbuf = {};
+	size_t entsize;
+
+	memcpy(namebuf, ctx->dname, ctx->de_namelen);
+	namebuf[ctx->de_namelen] = '\0';
+
+	stbuf.st_ino = erofsfuse_to_ino(ctx->de_nid);
+	if (ctx->de_ftype < EROFS_FT_MAX)
+		stbuf.st_mode = erofsfuse_mode_by_ftype[ctx->de_ftype];
+	/* the offset of an entry is the cookie of the one following it */
+	entsize = fuse_add_direntry(rctx->req, rctx->buf + rctx->pos,
+				    rctx->size - rctx->pos, namebuf,
+				    &stbuf, ctx->next_pos);
+	if (entsize > rctx->size - rctx->pos)
+		return 1;
+	rctx->pos += entsize;
 	return 0;
 }
 
-int erofsfuse_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
-		      off_t offset, struct fuse_file_info *fi)
+void erofsfuse_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
+		       off_t off, struct fuse_file_info *fi)
 {
+	struct erofs_inode *dir = (struct erofs_inode *)(uintptr_t)fi->fh;
+	struct erofsfuse_readdir_context rctx = {
+		.ctx.dir = dir,
+		.ctx.cb = erofsfuse_filldir,
+		.ctx.pos = off,
+		.req = req,
+		.size = size,
+	};
 	int ret;
-	struct erofs_inode dir;
-	char dblk[EROFS_BLKSIZ];
-	erofs_off_t pos;
-
-	erofs_dbg("readdir:%s offset=%llu", path, (long long)offset);
 
-	ret = erofs_ilookup(path, &dir);
-	if (ret)
-		return ret;
+	erofs_dbg("readdir(%llu): size = %zu, off = %llu",
+		  dir->nid | 0ULL, size, (unsigned long long)off);
 
-	erofs_dbg("path=%s nid = %llu", path, dir.nid | 0ULL);
-
-	if (!S_ISDIR(dir.i_mode))
-		return -ENOTDIR;
-
-	if (!dir.i_size)
-		return 0;
-
-	pos = 0;
-	while (pos < dir.i_size) {
-		unsigned int nameoff, maxsize;
-		struct erofs_dirent *de;
-
-		maxsize = min_t(unsigned int, EROFS_BLKSIZ,
-				dir.i_size - pos);
-		ret = erofs_pread(&dir, dblk, maxsize, pos);
-		if (ret)
-			return ret;
-
-		de = (struct erofs_dirent *)dblk;
-		nameoff = le16_to_cpu(de->nameoff);
-		if (nameoff < sizeof(struct erofs_dirent) ||
-		    nameoff >= PAGE_SIZE) {
-			erofs_err("invalid de[0].nameoff %u @ nid %llu",
-				  nameoff, dir.nid | 0ULL);
-			ret = -EFSCORRUPTED;
-			break;
-		}
-
-		ret = erofs_fill_dentries(&dir, filler, buf,
-					  dblk, nameoff, maxsize);
-		if (ret)
-			break;
-		pos += maxsize;
+	rctx.buf = malloc(size);
+	if (!rctx.buf) {
+		fuse_reply_err(req, ENOMEM);
+		return;
 	}
-	return 0;
-}
 
+	ret = erofsfuse_meta_iterate_dir(&rctx.ctx);
+	if (ret == -ENODATA)
+		ret = erofs_iterate_dir(&rctx.ctx);
+	if (ret < 0)
+		fuse_reply_err(req, -ret);
+	else
+		fuse_reply_buf(req, rctx.buf, rctx.pos);
+	free(rctx.buf);
+}
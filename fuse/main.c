@@ -8,126 +8,529 @@
 #include <string.h>
 #include <signal.h>
 #include <libgen.h>
-#include <fuse.h>
-#include <fuse_opt.h>
+#include <fcntl.h>
+#include <float.h>
 
 #include "erofs/config.h"
 #include "erofs/print.h"
 #include "erofs/io.h"
+#include "erofs/xattr.h"
+#include "readahead.h"
+#include "meta.h"
+#include "trace.h"
+
+#include <fuse.h>
+#include <fuse_lowlevel.h>
 
-int erofsfuse_readdir(const char *path, void *buffer, fuse_fill_dir_t filler,
-		      off_t offset, struct fuse_file_info *fi);
+/* an erofs image never changes once mounted, so let the kernel cache it */
+#define EROFSFUSE_TIMEOUT	DBL_MAX
+
+void erofsfuse_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
+		       off_t off, struct fuse_file_info *fi);
+
+static struct options {
+	const char *disk;
+	const char *mountpoint;
+	unsigned int debug_lvl;
+	unsigned int readahead;
+	unsigned int decompress_workers;
+	const char *trace;
+	bool preload_meta;
+	bool show_help;
+	bool odebug;
+} fusecfg = {
+	.readahead = 16,
+};
+
+/*
+ * FUSE reserves FUSE_ROOT_ID for the root directory and inode number 0 is
+ * invalid, so map nid to (nid + FUSE_ROOT_ID) and swap the root nid with
+ * nid 0 to keep the mapping one-to-one.
+ */
+fuse_ino_t erofsfuse_to_ino(erofs_nid_t nid)
+{
+	if (nid == g_sbi.root_nid)
+		return FUSE_ROOT_ID;
+	if (!nid)
+		return g_sbi.root_nid + FUSE_ROOT_ID;
+	return nid + FUSE_ROOT_ID;
+}
+
+static erofs_nid_t erofsfuse_to_nid(fuse_ino_t ino)
+{
+	if (ino == FUSE_ROOT_ID)
+		return g_sbi.root_nid;
+	if (ino == g_sbi.root_nid + FUSE_ROOT_ID)
+		return 0;
+	return ino - FUSE_ROOT_ID;
+}
 
-static void *erofsfuse_init(struct fuse_conn_info *info)
+static void erofsfuse_fill_stat(struct erofs_inode *vi, struct stat *stbuf)
 {
-	erofs_info("Using FUSE protocol %d.%d", info->proto_major, info->proto_minor);
-	return NULL;
+	memset(stbuf, 0, sizeof(*stbuf));
+	stbuf->st_ino = erofsfuse_to_ino(vi->nid);
+	stbuf->st_mode  = vi->i_mode;
+	stbuf->st_nlink = vi->i_nlink;
+	stbuf->st_size  = vi->i_size;
+	stbuf->st_blocks = roundup(vi->i_size, EROFS_BLKSIZ) >> 9;
+	stbuf->st_uid = vi->i_uid;
+	stbuf->st_gid = vi->i_gid;
+	if (S_ISBLK(vi->i_mode) || S_ISCHR(vi->i_mode))
+		stbuf->st_rdev = vi->u.i_rdev;
+	stbuf->st_ctime = vi->i_ctime;
+	stbuf->st_mtime = stbuf->st_ctime;
+	stbuf->st_atime = stbuf->st_ctime;
 }
 
-static int erofsfuse_open(const char *path, struct fuse_file_info *fi)
+/* get the inode from the preloaded metadata if possible */
+static int erofsfuse_read_inode(struct erofs_inode *vi)
 {
-	erofs_dbg("open path=%s", path);
+	int ret = erofsfuse_meta_iget(vi);
 
-	if ((fi->flags & O_ACCMODE) != O_RDONLY)
-		return -EACCES;
+	if (ret != -ENODATA)
+		return ret;
+	return erofs_read_inode_from_disk(vi);
+}
 
-	return 0;
+static void erofsfuse_init(void *userdata, struct fuse_conn_info *conn)
+{
+	erofs_info("Using FUSE protocol %d.%d", conn->proto_major, conn->proto_minor);
+#ifdef FUSE_CAP_SPLICE_WRITE
+	/* uncompressed data can be spliced from the image directly */
+	if (conn->capable & FUSE_CAP_SPLICE_WRITE)
+		conn->want |= FUSE_CAP_SPLICE_WRITE;
+#endif
+	/* start readahead workers here since daemonizing drops threads */
+	if (erofsfuse_ra_init(fusecfg.readahead))
+		erofs_err("failed to start readahead workers, readahead off");
 }
 
-static int erofsfuse_getattr(const char *path, struct stat *stbuf)
+static void erofsfuse_destroy(void *userdata)
 {
-	struct erofs_inode vi = {};
+	erofsfuse_ra_exit();
+}
+
+static void erofsfuse_lookup(fuse_req_t req, fuse_ino_t parent,
+			     const char *name)
+{
+	struct nameidata nd = {
+		.sbi = &g_sbi,
+		.nid = erofsfuse_to_nid(parent),
+	};
+	struct fuse_entry_param e = {
+		.attr_timeout = EROFSFUSE_TIMEOUT,
+		.entry_timeout = EROFSFUSE_TIMEOUT,
+	};
+	struct erofs_inode vi = { .sbi = &g_sbi };
 	int ret;
 
-	erofs_dbg("getattr(%s)", path);
-	ret = erofs_ilookup(path, &vi);
+	erofs_dbg("lookup(%llu, %s)", nd.nid | 0ULL, name);
+	ret = erofsfuse_meta_namei(&nd, name, strlen(name));
+	if (ret == -ENODATA)
+		ret = erofs_namei(&nd, name, strlen(name));
+	if (ret == -ENOENT) {
+		/* a zero inode number makes the kernel cache the negative entry */
+		fuse_reply_entry(req, &e);
+		return;
+	}
 	if (ret)
-		return -ENOENT;
-
-	stbuf->st_mode  = vi.i_mode;
-	stbuf->st_nlink = vi.i_nlink;
-	stbuf->st_size  = vi.i_size;
-	stbuf->st_blocks = roundup(vi.i_size, EROFS_BLKSIZ) >> 9;
-	stbuf->st_uid = vi.i_uid;
-	stbuf->st_gid = vi.i_gid;
-	if (S_ISBLK(vi.i_mode) || S_ISCHR(vi.i_mode))
-		stbuf->st_rdev = vi.u.i_rdev;
-	stbuf->st_ctime = vi.i_ctime;
-	stbuf->st_mtime = stbuf->st_ctime;
-	stbuf->st_atime = stbuf->st_ctime;
-	return 0;
+		goto err_out;
+
+	vi.nid = nd.nid;
+	ret = erofsfuse_read_inode(&vi);
+	if (ret)
+		goto err_out;
+
+	erofsfuse_trace_lookup(erofsfuse_to_nid(parent), vi.nid, name);
+
+	erofsfuse_fill_stat(&vi, &e.attr);
+	e.ino = e.attr.st_ino;
+	fuse_reply_entry(req, &e);
+	return;
+err_out:
+	fuse_reply_err(req, -ret);
 }
 
-static int erofsfuse_read(const char *path, char *buffer,
-			  size_t size, off_t offset,
-			  struct fuse_file_info *fi)
+static void erofsfuse_getattr(fuse_req_t req, fuse_ino_t ino,
+			      struct fuse_file_info *fi)
 {
+	struct erofs_inode vi = { .sbi = &g_sbi, .nid = erofsfuse_to_nid(ino) };
+	struct stat stbuf;
 	int ret;
+
+	erofs_dbg("getattr(%llu)", vi.nid | 0ULL);
+	ret = erofsfuse_read_inode(&vi);
+	if (ret) {
+		fuse_reply_err(req, -ret);
+		return;
+	}
+	erofsfuse_fill_stat(&vi, &stbuf);
+	fuse_reply_attr(req, &stbuf, EROFSFUSE_TIMEOUT);
+}
+
+/* the file handle of an open regular file */
+struct erofsfuse_file {
 	struct erofs_inode vi;
+	struct erofsfuse_ra *ra;
+};
+
+static void erofsfuse_open(fuse_req_t req, fuse_ino_t ino,
+			   struct fuse_file_info *fi)
+{
+	struct erofsfuse_file *f;
+	int ret;
 
-	erofs_dbg("path:%s size=%zd offset=%llu", path, size, (long long)offset);
+	erofs_dbg("open(%llu)", erofsfuse_to_nid(ino) | 0ULL);
+	if ((fi->flags & O_ACCMODE) != O_RDONLY) {
+		fuse_reply_err(req, EACCES);
+		return;
+	}
 
-	ret = erofs_ilookup(path, &vi);
+	f = calloc(1, sizeof(*f));
+	if (!f) {
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+
+	f->vi.sbi = &g_sbi;
+	f->vi.nid = erofsfuse_to_nid(ino);
+	ret = erofsfuse_read_inode(&f->vi);
 	if (ret)
-		return ret;
+		goto err_out;
 
-	ret = erofs_pread(&vi, buffer, size, offset);
+	if (S_ISDIR(f->vi.i_mode)) {
+		ret = -EISDIR;
+		goto err_out;
+	}
+
+	if (erofs_inode_is_data_compressed(f->vi.datalayout)) {
+		struct erofs_map_blocks map = {
+			.index = UINT_MAX,
+		};
+
+		/*
+		 * load the compression header in advance since the inode is
+		 * shared by concurrent reads and readahead workers.
+		 */
+		ret = erofs_map_blocks(&f->vi, &map, 0);
+		if (ret)
+			goto err_out;
+
+		f->ra = erofsfuse_ra_alloc(&f->vi);
+		if (IS_ERR(f->ra)) {
+			ret = PTR_ERR(f->ra);
+			goto err_out;
+		}
+	}
+
+	fi->fh = (uintptr_t)f;
+	fi->keep_cache = 1;
+	fuse_reply_open(req, fi);
+	return;
+err_out:
+	free(f);
+	fuse_reply_err(req, -ret);
+}
+
+static void erofsfuse_release(fuse_req_t req, fuse_ino_t ino,
+			      struct fuse_file_info *fi)
+{
+	struct erofsfuse_file *f = (struct erofsfuse_file *)(uintptr_t)fi->fh;
+
+	erofsfuse_ra_free(f->ra);
+	free(f);
+	fuse_reply_err(req, 0);
+}
+
+/* keep the directory inode in the file handle for later readdirs */
+static void erofsfuse_opendir(fuse_req_t req, fuse_ino_t ino,
+			      struct fuse_file_info *fi)
+{
+	struct erofs_inode *vi;
+	int ret;
+
+	erofs_dbg("opendir(%llu)", erofsfuse_to_nid(ino) | 0ULL);
+	vi = malloc(sizeof(*vi));
+	if (!vi) {
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+
+	vi->sbi = &g_sbi;
+	vi->nid = erofsfuse_to_nid(ino);
+	ret = erofsfuse_read_inode(vi);
 	if (ret)
-		return ret;
-	if (offset + size > vi.i_size)
-		return vi.i_size - offset;
-	if (offset >= vi.i_size)
-		return 0;
-	return size;
+		goto err_out;
+
+	if (!S_ISDIR(vi->i_mode)) {
+		ret = -ENOTDIR;
+		goto err_out;
+	}
+
+	fi->fh = (uintptr_t)vi;
+	fi->keep_cache = 1;
+	fuse_reply_open(req, fi);
+	return;
+err_out:
+	free(vi);
+	fuse_reply_err(req, -ret);
+}
+
+static void erofsfuse_releasedir(fuse_req_t req, fuse_ino_t ino,
+				 struct fuse_file_info *fi)
+{
+	free((void *)(uintptr_t)fi->fh);
+	fuse_reply_err(req, 0);
+}
+
+#if FUSE_VERSION >= FUSE_MAKE_VERSION(2, 9)
+/*
+ * Uncompressed data can be handed over as image file ranges so that libfuse
+ * splices the image pages into /dev/fuse without copying them to userspace.
+ * A flat file maps to at most two extents: its blocks and the inline tail.
+ * Chunk-based files could have holes, so they're read into a buffer instead.
+ */
+static int erofsfuse_read_splice(fuse_req_t req, struct erofs_inode *vi,
+				 size_t size, off_t off)
+{
+	struct fuse_bufvec *bufv;
+	struct erofs_map_blocks map = {
+		.index = UINT_MAX,
+	};
+	erofs_off_t pos = off, end = off + size;
+	int ret;
+
+	bufv = malloc(sizeof(*bufv) + sizeof(struct fuse_buf));
+	if (!bufv)
+		return -ENOMEM;
+
+	*bufv = FUSE_BUFVEC_INIT(0);
+	bufv->count = 0;
+	while (pos < end) {
+		struct fuse_buf *buf = &bufv->buf[bufv->count];
+
+		map.m_la = pos;
+		ret = erofs_map_blocks(vi, &map, 0);
+		if (ret)
+			goto out;
+
+		if (!(map.m_flags & EROFS_MAP_MAPPED) || bufv->count >= 2 ||
+		    map.m_pa + map.m_llen > dev_length(&g_sbi)) {
+			ret = -EFSCORRUPTED;
+			goto out;
+		}
+
+		buf->size = min_t(erofs_off_t, end, map.m_la + map.m_llen) - pos;
+		buf->flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+		buf->mem = NULL;
+		buf->fd = dev_fd(&g_sbi);
+		buf->pos = map.m_pa + pos - map.m_la;
+		++bufv->count;
+		pos += buf->size;
+	}
+	fuse_reply_data(req, bufv, 0);
+	ret = 0;
+out:
+	free(bufv);
+	return ret;
+}
+#endif
+
+static void erofsfuse_read(fuse_req_t req, fuse_ino_t ino, size_t size,
+			   off_t off, struct fuse_file_info *fi)
+{
+	struct erofsfuse_file *f = (struct erofsfuse_file *)(uintptr_t)fi->fh;
+	struct erofs_inode *vi = &f->vi;
+	char *buf;
+	int ret, cached = 0;
+
+	erofs_dbg("read(%llu): size = %zu, off = %llu",
+		  vi->nid | 0ULL, size, (unsigned long long)off);
+
+	if (off >= vi->i_size) {
+		fuse_reply_buf(req, NULL, 0);
+		return;
+	}
+	if (off + size > vi->i_size)
+		size = vi->i_size - off;
+
+#if FUSE_VERSION >= FUSE_MAKE_VERSION(2, 9)
+	if (vi->datalayout == EROFS_INODE_FLAT_PLAIN ||
+	    vi->datalayout == EROFS_INODE_FLAT_INLINE) {
+		ret = erofsfuse_read_splice(req, vi, size, off);
+		if (ret)
+			fuse_reply_err(req, -ret);
+		else
+			erofsfuse_trace_read(vi->nid, off, size, 0);
+		return;
+	}
+#endif
+	buf = malloc(size);
+	if (!buf) {
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+
+	if (f->ra) {
+		cached = erofsfuse_ra_read(f->ra, buf, size, off);
+		ret = cached < 0 ? cached : 0;
+	} else {
+		ret = erofs_pread(vi, buf, size, off);
+	}
+	if (ret) {
+		fuse_reply_err(req, -ret);
+	} else {
+		erofsfuse_trace_read(vi->nid, off, size, cached);
+		fuse_reply_buf(req, buf, size);
+	}
+	free(buf);
+}
+
+static void erofsfuse_readlink(fuse_req_t req, fuse_ino_t ino)
+{
+	struct erofs_inode vi = { .sbi = &g_sbi, .nid = erofsfuse_to_nid(ino) };
+	char *buf;
+	int ret;
+
+	ret = erofsfuse_read_inode(&vi);
+	if (ret) {
+		fuse_reply_err(req, -ret);
+		return;
+	}
+
+	if (!S_ISLNK(vi.i_mode) || vi.i_size >= EROFS_BLKSIZ) {
+		fuse_reply_err(req, EINVAL);
+		return;
+	}
+
+	buf = malloc(vi.i_size + 1);
+	if (!buf) {
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+
+	ret = erofs_pread(&vi, buf, vi.i_size, 0);
+	if (ret) {
+		fuse_reply_err(req, -ret);
+	} else {
+		buf[vi.i_size] = '\0';
+		erofs_dbg("readlink(%llu): %s", vi.nid | 0ULL, buf);
+		fuse_reply_readlink(req, buf);
+	}
+	free(buf);
 }
 
-static int erofsfuse_readlink(const char *path, char *buffer, size_t size)
+static void erofsfuse_getxattr(fuse_req_t req, fuse_ino_t ino,
+			       const char *name, size_t size)
 {
-	int ret = erofsfuse_read(path, buffer, size, 0, NULL);
+	struct erofs_inode vi = { .sbi = &g_sbi, .nid = erofsfuse_to_nid(ino) };
+	char *buf = NULL;
+	int ret;
+
+	erofs_dbg("getxattr(%llu): name = %s, size = %zu",
+		  vi.nid | 0ULL, name, size);
+	ret = erofsfuse_read_inode(&vi);
+	if (ret)
+		goto err_out;
+
+	if (size) {
+		buf = malloc(size);
+		if (!buf) {
+			ret = -ENOMEM;
+			goto err_out;
+		}
+	}
 
+	ret = erofs_getxattr(&vi, name, buf, size);
 	if (ret < 0)
-		return ret;
-	DBG_BUGON(ret > size);
-	if (ret == size)
-		buffer[size - 1] = '\0';
-	erofs_dbg("readlink(%s): %s", path, buffer);
-	return 0;
+		goto err_out;
+	if (!size)
+		fuse_reply_xattr(req, ret);
+	else
+		fuse_reply_buf(req, buf, ret);
+	free(buf);
+	return;
+err_out:
+	free(buf);
+	fuse_reply_err(req, -ret);
 }
 
-static struct fuse_operations erofs_ops = {
-	.readlink = erofsfuse_readlink,
+static void erofsfuse_listxattr(fuse_req_t req, fuse_ino_t ino, size_t size)
+{
+	struct erofs_inode vi = { .sbi = &g_sbi, .nid = erofsfuse_to_nid(ino) };
+	char *buf = NULL;
+	int ret;
+
+	erofs_dbg("listxattr(%llu): size = %zu", vi.nid | 0ULL, size);
+	ret = erofsfuse_read_inode(&vi);
+	if (ret)
+		goto err_out;
+
+	if (size) {
+		buf = malloc(size);
+		if (!buf) {
+			ret = -ENOMEM;
+			goto err_out;
+		}
+	}
+
+	ret = erofs_listxattr(&vi, buf, size);
+	if (ret < 0)
+		goto err_out;
+	if (!size)
+		fuse_reply_xattr(req, ret);
+	else
+		fuse_reply_buf(req, buf, ret);
+	free(buf);
+	return;
+err_out:
+	free(buf);
+	fuse_reply_err(req, -ret);
+}
+
+static const struct fuse_lowlevel_ops erofsfuse_lops = {
+	.init = erofsfuse_init,
+	.destroy = erofsfuse_destroy,
+	.lookup = erofsfuse_lookup,
 	.getattr = erofsfuse_getattr,
-	.readdir = erofsfuse_readdir,
+	.readlink = erofsfuse_readlink,
 	.open = erofsfuse_open,
 	.read = erofsfuse_read,
-	.init = erofsfuse_init,
+	.release = erofsfuse_release,
+	.opendir = erofsfuse_opendir,
+	.readdir = erofsfuse_readdir,
+	.releasedir = erofsfuse_releasedir,
+	.getxattr = erofsfuse_getxattr,
+	.listxattr = erofsfuse_listxattr,
 };
 
-static struct options {
-	const char *disk;
-	const char *mountpoint;
-	unsigned int debug_lvl;
-	bool show_help;
-	bool odebug;
-} fusecfg;
-
 #define OPTION(t, p)                           \
     { t, offsetof(struct options, p), 1 }
 static const struct fuse_opt option_spec[] = {
 	OPTION("--dbglevel=%u", debug_lvl),
+	OPTION("--readahead=%u", readahead),
+	OPTION("--decompress-threads=%u", decompress_workers),
+	OPTION("--trace=%s", trace),
+	OPTION("preload_meta", preload_meta),
 	OPTION("--help", show_help),
 	FUSE_OPT_END
 };
 
-#define OPTION(t, p)    { t, offsetof(struct options, p), 1 }
-
 static void usage(void)
 {
+#if FUSE_MAJOR_VERSION < 3
 	struct fuse_args args = FUSE_ARGS_INIT(0, NULL);
 
+#endif
 	fputs("usage: [options] IMAGE MOUNTPOINT\n\n"
 	      "Options:\n"
 	      "    --dbglevel=#           set output message level to # (maximum 9)\n"
+	      "    --readahead=#          read # pclusters ahead for sequential reads of\n"
+	      "                           compressed files (default 16, 0 to disable)\n"
+	      "    --decompress-threads=# decompress pclusters of large reads with #\n"
+	      "                           extra threads (default 0)\n"
+	      "    --trace=X              record reads of files into X\n"
+	      "    -o preload_meta        load all metadata at mount time\n"
 #if FUSE_MAJOR_VERSION < 3
 	      "    --help                 display this help and exit\n"
 #endif
@@ -135,6 +538,7 @@ static void usage(void)
 
 #if FUSE_MAJOR_VERSION >= 3
 	fuse_cmdline_help();
+	fuse_lowlevel_help();
 #else
 	fuse_opt_add_arg(&args, ""); /* progname */
 	fuse_opt_add_arg(&args, "-ho"); /* progname */
@@ -148,6 +552,11 @@ static void erofsfuse_dumpcfg(void)
 	erofs_dump("disk: %s\n", fusecfg.disk);
 	erofs_dump("mountpoint: %s\n", fusecfg.mountpoint);
 	erofs_dump("dbglevel: %u\n", cfg.c_dbg_lvl);
+	erofs_dump("readahead: %u\n", fusecfg.readahead);
+	erofs_dump("decompress threads: %u\n", cfg.c_decompress_workers);
+	erofs_dump("trace: %s\n", fusecfg.trace ? fusecfg.trace : "(none)");
+	erofs_dump("preload metadata: %s\n",
+		   fusecfg.preload_meta ? "yes" : "no");
 }
 
 static int optional_opt_func(void *data, const char *arg, int key,
@@ -199,6 +608,90 @@ static void signal_handle_sigsegv(int signal)
 }
 #endif
 
+#if FUSE_MAJOR_VERSION >= 3
+static int erofsfuse_loop(struct fuse_args *args)
+{
+	struct fuse_cmdline_opts opts = {};
+	struct fuse_session *se;
+	int ret = -1;
+
+	if (fuse_parse_cmdline(args, &opts))
+		return -1;
+
+	se = fuse_session_new(args, &erofsfuse_lops,
+			      sizeof(erofsfuse_lops), NULL);
+	if (!se)
+		goto out;
+
+	if (fuse_set_signal_handlers(se))
+		goto out_destroy;
+
+	if (fuse_session_mount(se, opts.mountpoint))
+		goto out_remove_handlers;
+
+	fuse_daemonize(opts.foreground);
+	if (opts.singlethread) {
+		ret = fuse_session_loop(se);
+	} else {
+		struct fuse_loop_config config = {
+			.clone_fd = opts.clone_fd,
+			.max_idle_threads = opts.max_idle_threads,
+		};
+
+		ret = fuse_session_loop_mt(se, &config);
+	}
+	fuse_session_unmount(se);
+out_remove_handlers:
+	fuse_remove_signal_handlers(se);
+out_destroy:
+	fuse_session_destroy(se);
+out:
+	free(opts.mountpoint);
+	return ret;
+}
+#else
+static int erofsfuse_loop(struct fuse_args *args)
+{
+	struct fuse_session *se;
+	struct fuse_chan *ch;
+	char *mountpoint;
+	int multithreaded, foreground;
+	int ret = -1;
+
+	if (fuse_parse_cmdline(args, &mountpoint, &multithreaded, &foreground))
+		return -1;
+
+	ch = fuse_mount(mountpoint, args);
+	if (!ch)
+		goto out;
+
+	se = fuse_lowlevel_new(args, &erofsfuse_lops,
+			       sizeof(erofsfuse_lops), NULL);
+	if (!se)
+		goto out_unmount;
+
+	if (fuse_set_signal_handlers(se))
+		goto out_destroy;
+
+	fuse_session_add_chan(se, ch);
+	if (!fuse_daemonize(foreground)) {
+		if (multithreaded)
+			ret = fuse_session_loop_mt(se);
+		else
+			ret = fuse_session_loop(se);
+	}
+	fuse_remove_signal_handlers(se);
+	fuse_session_remove_chan(ch);
+out_destroy:
+	fuse_session_destroy(se);
+out_unmount:
+	fuse_unmount(mountpoint, ch);
+out:
+	free(mountpoint);
+	return ret;
+}
+#endif
+
 int main(int argc, char *argv[])
 {
 	int ret;
@@ -223,30 +716,54 @@ int main(int argc, char *argv[])
 	if (fusecfg.show_help || !fusecfg.mountpoint)
 		usage();
 	cfg.c_dbg_lvl = fusecfg.debug_lvl;
+	cfg.c_decompress_workers = fusecfg.decompress_workers;
 
 	if (fusecfg.odebug && cfg.c_dbg_lvl < EROFS_DBG)
 		cfg.c_dbg_lvl = EROFS_DBG;
 
 	erofsfuse_dumpcfg();
-	ret = dev_open_ro(fusecfg.disk);
+	ret = dev_open_ro(&g_sbi, fusecfg.disk);
 	if (ret) {
 		fprintf(stderr, "failed to open: %s\n", fusecfg.disk);
 		goto err_fuse_free_args;
 	}
 
-	ret = erofs_read_superblock();
+	ret = erofs_read_superblock(&g_sbi);
 	if (ret) {
 		fprintf(stderr, "failed to read erofs super block\n");
 		goto err_dev_close;
 	}
 
-	ret = fuse_main(args.argc, args.argv, &erofs_ops, NULL);
+	if (fusecfg.preload_meta) {
+		ret = erofsfuse_preload_meta(&g_sbi);
+		if (ret) {
+			fprintf(stderr, "failed to preload metadata: %s\n",
+				erofs_strerror(ret));
+			goto err_put_super;
+		}
+	}
+
+	/* open it before daemonizing, which changes the working directory */
+	if (fusecfg.trace) {
+		ret = erofsfuse_trace_open(fusecfg.trace);
+		if (ret) {
+			fprintf(stderr, "failed to open trace file %s: %s\n",
+				fusecfg.trace, erofs_strerror(ret));
+			goto err_drop_meta;
+		}
+	}
+
+	ret = erofsfuse_loop(&args);
+	erofsfuse_trace_close();
+err_drop_meta:
+	erofsfuse_drop_meta();
+err_put_super:
+	erofs_put_super(&g_sbi);
 err_dev_close:
-	dev_close();
+	dev_close(&g_sbi);
 err_fuse_free_args:
 	fuse_opt_free_args(&args);
 err:
 	erofs_exit_configure();
 	return ret ? EXIT_FAILURE : EXIT_SUCCESS;
 }
-
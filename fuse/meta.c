@@ -0,0 +1,535 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * erofs-utils/fuse/meta.c
+ *
+ * Preload all inodes, dirents and xattrs at mount time so that lookups,
+ * getattrs and readdirs never go to the image later, nor do xattr requests
+ * as long as the xattr cache holds them.  The tree is loaded level by level
+ * from the root: inodes of a level are read in nid order and then their
+ * dirents in block order, so that the image is always read forward in
+ * large windows rather than a few bytes here and there.
+ */
+#include <stdlib.h>
+#include <sys/stat.h>
+
+#include "erofs/print.h"
+#include "erofs/io.h"
+#include "erofs/xattr.h"
+#include "meta.h"
+
+/* how much of the image is read at once while preloading */
+#define EROFSFUSE_META_WINDOW	(1024 * 1024)
+
+struct erofsfuse_dentry {
+	erofs_nid_t nid;
+	/* the cookie of the dirent, see struct erofs_dir_context */
+	erofs_off_t pos;
+	unsigned int nameoff;
+	unsigned char namelen, ftype;
+};
+
+/* what erofsfuse needs of struct erofs_inode */
+struct erofsfuse_minode {
+	erofs_nid_t nid;
+	erofs_off_t i_size;
+	u64 i_ctime;
+	u32 i_ctime_nsec;
+	u32 i_uid, i_gid, i_nlink;
+	/* i_blkaddr, i_rdev or the chunk format */
+	u32 i_u;
+	umode_t i_mode;
+	unsigned char datalayout, inode_isize;
+	unsigned int xattr_isize;
+
+	/* (directories) dirents in the on-disk order and all their names */
+	struct erofsfuse_dentry *dentries;
+	unsigned int nr_dentries;
+	char *names;
+};
+
+/* all preloaded inodes sorted by nid, never changed after mounting */
+static struct erofsfuse_minode *erofsfuse_minodes;
+static unsigned int erofsfuse_nr_minodes;
+
+struct erofsfuse_preload {
+	struct erofs_sb_info *sbi;
+
+	/* the window of the image in memory */
+	char *buf;
+	erofs_off_t start;
+	unsigned int len;
+
+	unsigned int max_minodes;
+};
+
+/* an inode to load and the directory in which it's found */
+struct erofsfuse_pending {
+	erofs_nid_t nid, parent;
+};
+
+/* a directory to load and where its dirents start */
+struct erofsfuse_pending_dir {
+	erofs_off_t pos;
+	unsigned int idx;
+	erofs_nid_t parent;
+};
+
+struct erofsfuse_meta_dirctx {
+	struct erofs_dir_context ctx;
+	struct erofsfuse_minode *dir;
+	unsigned int max_dentries, namesize, nameused;
+};
+
+static void erofsfuse_meta_fill_inode(struct erofs_inode *vi,
+				      const struct erofsfuse_minode *mi)
+{
+	vi->nid = mi->nid;
+	vi->i_size = mi->i_size;
+	vi->i_ctime = mi->i_ctime;
+	vi->i_ctime_nsec = mi->i_ctime_nsec;
+	vi->i_uid = mi->i_uid;
+	vi->i_gid = mi->i_gid;
+	vi->i_nlink = mi->i_nlink;
+	vi->u.i_blkaddr = mi->i_u;
+	vi->i_mode = mi->i_mode;
+	vi->datalayout = mi->datalayout;
+	vi->inode_isize = mi->inode_isize;
+	vi->xattr_isize = mi->xattr_isize;
+
+	vi->flags = 0;
+	if (erofs_inode_is_data_compressed(vi->datalayout))
+		z_erofs_fill_inode(vi);
+}
+
+static const void *erofsfuse_meta_read(struct erofsfuse_preload *p,
+				       erofs_off_t pos, unsigned int len)
+{
+	int ret;
+
+	if (pos < p->start || pos + len > p->start + p->len) {
+		erofs_off_t start = round_down(pos, EROFS_BLKSIZ);
+
+		if (pos + len > dev_length(p->sbi))
+			return ERR_PTR(-EFSCORRUPTED);
+
+		p->len = min_t(erofs_off_t, dev_length(p->sbi) - start,
+			       EROFSFUSE_META_WINDOW);
+		ret = dev_read(p->sbi, p->buf, start, p->len);
+		if (ret < 0) {
+			p->len = 0;
+			return ERR_PTR(ret);
+		}
+		p->start = start;
+	}
+	return p->buf + (pos - p->start);
+}
+
+static int erofsfuse_meta_load_inode(struct erofsfuse_preload *p,
+				     erofs_nid_t nid)
+{
+	struct erofs_inode vi = { .sbi = p->sbi, .nid = nid };
+	struct erofsfuse_minode *mi;
+	const void *dic;
+	int ret;
+
+	dic = erofsfuse_meta_read(p, iloc(p->sbi, nid),
+				  sizeof(struct erofs_inode_compact));
+	if (!IS_ERR(dic) && erofs_inode_is_extended(dic))
+		dic = erofsfuse_meta_read(p, iloc(p->sbi, nid),
+					  sizeof(struct erofs_inode_extended));
+	if (IS_ERR(dic))
+		return PTR_ERR(dic);
+
+	ret = erofs_read_inode_from_buf(&vi, dic);
+	if (ret)
+		return ret;
+
+	/* warm up the xattr caches, the xattrs were just read anyway */
+	if (vi.xattr_isize) {
+		ret = erofs_listxattr(&vi, NULL, 0);
+		if (ret < 0)
+			return ret;
+	}
+
+	if (erofsfuse_nr_minodes >= p->max_minodes) {
+		unsigned int max = max(p->max_minodes * 2, 256U);
+
+		mi = realloc(erofsfuse_minodes, max * sizeof(*mi));
+		if (!mi)
+			return -ENOMEM;
+		erofsfuse_minodes = mi;
+		p->max_minodes = max;
+	}
+
+	mi = &erofsfuse_minodes[erofsfuse_nr_minodes++];
+	*mi = (struct erofsfuse_minode) {
+		.nid = nid,
+		.i_size = vi.i_size,
+		.i_ctime = vi.i_ctime,
+		.i_ctime_nsec = vi.i_ctime_nsec,
+		.i_uid = vi.i_uid,
+		.i_gid = vi.i_gid,
+		.i_nlink = vi.i_nlink,
+		.i_u = vi.u.i_blkaddr,
+		.i_mode = vi.i_mode,
+		.datalayout = vi.datalayout,
+		.inode_isize = vi.inode_isize,
+		.xattr_isize = vi.xattr_isize,
+	};
+	return 0;
+}
+
+static int erofsfuse_meta_filldir(struct erofs_dir_context *ctx)
+{
+	struct erofsfuse_meta_dirctx *mctx =
+		container_of(ctx, struct erofsfuse_meta_dirctx, ctx);
+	struct erofsfuse_minode *dir = mctx->dir;
+	struct erofsfuse_dentry *d;
+
+	if (dir->nr_dentries >= mctx->max_dentries) {
+		unsigned int max = max(mctx->max_dentries * 2, 16U);
+
+		d = realloc(dir->dentries, max * sizeof(*d));
+		if (!d)
+			return -ENOMEM;
+		dir->dentries = d;
+		mctx->max_dentries = max;
+	}
+
+	if (mctx->nameused + ctx->de_namelen > mctx->namesize) {
+		unsigned int size = max(mctx->namesize * 2,
+					mctx->nameused + EROFS_NAME_LEN);
+		char *names = realloc(dir->names, size);
+
+		if (!names)
+			return -ENOMEM;
+		dir->names = names;
+		mctx->namesize = size;
+	}
+
+	d = &dir->dentries[dir->nr_dentries++];
+	d->nid = ctx->de_nid;
+	d->pos = ctx->pos;
+	d->nameoff = mctx->nameused;
+	d->namelen = ctx->de_namelen;
+	d->ftype = ctx->de_ftype;
+	memcpy(dir->names + d->nameoff, ctx->dname, d->namelen);
+	mctx->nameused += d->namelen;
+	return 0;
+}
+
+static erofs_off_t erofsfuse_meta_dirpos(struct erofsfuse_preload *p,
+					 const struct erofsfuse_minode *dir,
+					 erofs_off_t pos)
+{
+	erofs_off_t lastblk = DIV_ROUND_UP(dir->i_size, EROFS_BLKSIZ) -
+		(dir->datalayout == EROFS_INODE_FLAT_INLINE);
+
+	if (erofs_blknr(pos) < lastblk)
+		return blknr_to_addr(dir->i_u) + pos;
+	return iloc(p->sbi, dir->nid) + dir->inode_isize + dir->xattr_isize +
+		erofs_blkoff(pos);
+}
+
+static int erofsfuse_meta_load_dir(struct erofsfuse_preload *p,
+				   struct erofsfuse_minode *dir)
+{
+	struct erofs_inode vi = { .sbi = p->sbi };
+	struct erofsfuse_meta_dirctx mctx = {
+		.ctx.dir = &vi,
+		.ctx.cb = erofsfuse_meta_filldir,
+		.dir = dir,
+	};
+	erofs_off_t pos;
+	int ret;
+
+	erofsfuse_meta_fill_inode(&vi, dir);
+	if (dir->datalayout != EROFS_INODE_FLAT_PLAIN &&
+	    dir->datalayout != EROFS_INODE_FLAT_INLINE)
+		return erofs_iterate_dir(&mctx.ctx);
+
+	for (pos = 0; pos < dir->i_size; pos += EROFS_BLKSIZ) {
+		unsigned int maxsize = min_t(erofs_off_t, dir->i_size - pos,
+					     EROFS_BLKSIZ);
+		const void *dblk;
+
+		dblk = erofsfuse_meta_read(p, erofsfuse_meta_dirpos(p, dir, pos),
+					   maxsize);
+		if (IS_ERR(dblk))
+			return PTR_ERR(dblk);
+
+		ret = erofs_iterate_dirents(&mctx.ctx, dblk, maxsize, pos);
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
+static int erofsfuse_cmp_pending(const void *a, const void *b)
+{
+	const struct erofsfuse_pending *pa = a, *pb = b;
+
+	return pa->nid < pb->nid ? -1 : pa->nid > pb->nid;
+}
+
+static int erofsfuse_cmp_pending_dir(const void *a, const void *b)
+{
+	const struct erofsfuse_pending_dir *da = a, *db = b;
+
+	return da->pos < db->pos ? -1 : da->pos > db->pos;
+}
+
+static int erofsfuse_cmp_minode(const void *a, const void *b)
+{
+	const struct erofsfuse_minode *ma = a, *mb = b;
+
+	return ma->nid < mb->nid ? -1 : ma->nid > mb->nid;
+}
+
+/*
+ * Load a level of the tree: @level holds the inodes to load, and the
+ * inodes which they contain are returned in @next for the next level.
+ */
+static int erofsfuse_meta_load_level(struct erofsfuse_preload *p,
+				     struct erofsfuse_pending *level,
+				     unsigned int nr,
+				     struct erofsfuse_pending **next,
+				     unsigned int *nr_next)
+{
+	struct erofsfuse_pending_dir *dirs;
+	unsigned int i, j, nr_dirs = 0, max_next = 0;
+	int ret = 0;
+
+	*next = NULL;
+	*nr_next = 0;
+	dirs = malloc(nr * sizeof(*dirs));
+	if (!dirs)
+		return -ENOMEM;
+
+	qsort(level, nr, sizeof(*level), erofsfuse_cmp_pending);
+	for (i = 0; i < nr; ++i) {
+		struct erofsfuse_minode *mi;
+
+		/* hard links, or the same directory found twice */
+		if (i && level[i].nid == level[i - 1].nid)
+			continue;
+
+		ret = erofsfuse_meta_load_inode(p, level[i].nid);
+		if (ret)
+			goto out;
+
+		mi = &erofsfuse_minodes[erofsfuse_nr_minodes - 1];
+		if (!S_ISDIR(mi->i_mode))
+			continue;
+
+		dirs[nr_dirs++] = (struct erofsfuse_pending_dir) {
+			.pos = erofsfuse_meta_dirpos(p, mi, 0),
+			.idx = erofsfuse_nr_minodes - 1,
+			.parent = level[i].parent,
+		};
+	}
+
+	qsort(dirs, nr_dirs, sizeof(*dirs), erofsfuse_cmp_pending_dir);
+	for (i = 0; i < nr_dirs; ++i) {
+		struct erofsfuse_minode *dir = &erofsfuse_minodes[dirs[i].idx];
+
+		ret = erofsfuse_meta_load_dir(p, dir);
+		if (ret)
+			goto out;
+
+		for (j = 0; j < dir->nr_dentries; ++j) {
+			struct erofsfuse_dentry *d = &dir->dentries[j];
+			const char *name = dir->names + d->nameoff;
+
+			if (name[0] == '.' && (d->namelen == 1 ||
+			    (d->namelen == 2 && name[1] == '.'))) {
+				/*
+				 * directories can't be hard linked, so each of
+				 * them is reached only once from its parent,
+				 * which also rules out loops in the tree.
+				 */
+				if (d->namelen == 2 && d->nid != dirs[i].parent)
+					goto bogus;
+				continue;
+			}
+			if (d->nid == dir->nid)
+				goto bogus;
+
+			if (*nr_next >= max_next) {
+				struct erofsfuse_pending *n;
+
+				max_next = max(max_next * 2, 256U);
+				n = realloc(*next, max_next * sizeof(*n));
+				if (!n) {
+					ret = -ENOMEM;
+					goto out;
+				}
+				*next = n;
+			}
+			(*next)[(*nr_next)++] = (struct erofsfuse_pending) {
+				.nid = d->nid,
+				.parent = dir->nid,
+			};
+		}
+	}
+out:
+	free(dirs);
+	return ret;
+bogus:
+	erofs_err("bogus directory tree @ nid %llu",
+		  erofsfuse_minodes[dirs[i].idx].nid | 0ULL);
+	ret = -EFSCORRUPTED;
+	goto out;
+}
+
+int erofsfuse_preload_meta(struct erofs_sb_info *sbi)
+{
+	struct erofsfuse_preload p = { .sbi = sbi };
+	struct erofsfuse_pending *level, *next;
+	unsigned int i, j, nr = 1, nr_next;
+	int ret = 0;
+
+	p.buf = malloc(EROFSFUSE_META_WINDOW);
+	level = malloc(sizeof(*level));
+	if (!p.buf || !level) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	/* ".." of the root directory points to itself */
+	level[0].nid = level[0].parent = sbi->root_nid;
+	while (nr) {
+		ret = erofsfuse_meta_load_level(&p, level, nr, &next, &nr_next);
+		free(level);
+		level = next;
+		nr = nr_next;
+		if (ret)
+			goto out;
+	}
+
+	/* drop hard links found in different levels */
+	qsort(erofsfuse_minodes, erofsfuse_nr_minodes,
+	      sizeof(*erofsfuse_minodes), erofsfuse_cmp_minode);
+	for (i = j = 0; i < erofsfuse_nr_minodes; ++i) {
+		if (j && erofsfuse_minodes[i].nid == erofsfuse_minodes[j - 1].nid)
+			continue;
+		erofsfuse_minodes[j++] = erofsfuse_minodes[i];
+	}
+	erofsfuse_nr_minodes = j;
+	erofs_info("preloaded %u inodes", erofsfuse_nr_minodes);
+out:
+	free(level);
+	free(p.buf);
+	if (ret)
+		erofsfuse_drop_meta();
+	return ret;
+}
+
+void erofsfuse_drop_meta(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < erofsfuse_nr_minodes; ++i) {
+		free(erofsfuse_minodes[i].dentries);
+		free(erofsfuse_minodes[i].names);
+	}
+	free(erofsfuse_minodes);
+	erofsfuse_minodes = NULL;
+	erofsfuse_nr_minodes = 0;
+}
+
+static struct erofsfuse_minode *erofsfuse_meta_find(erofs_nid_t nid)
+{
+	struct erofsfuse_minode key = { .nid = nid };
+
+	if (!erofsfuse_nr_minodes)
+		return NULL;
+	return bsearch(&key, erofsfuse_minodes, erofsfuse_nr_minodes,
+		       sizeof(key), erofsfuse_cmp_minode);
+}
+
+int erofsfuse_meta_iget(struct erofs_inode *vi)
+{
+	struct erofsfuse_minode *mi = erofsfuse_meta_find(vi->nid);
+
+	if (!mi)
+		return -ENODATA;
+	erofsfuse_meta_fill_inode(vi, mi);
+	return 0;
+}
+
+/* dirents are sorted by name in the whole directory */
+int erofsfuse_meta_namei(struct nameidata *nd,
+			 const char *name, unsigned int len)
+{
+	struct erofsfuse_minode *dir = erofsfuse_meta_find(nd->nid);
+	unsigned int lo = 0, hi;
+
+	if (!dir)
+		return -ENODATA;
+	if (!S_ISDIR(dir->i_mode))
+		return -ENOTDIR;
+
+	hi = dir->nr_dentries;
+	while (lo < hi) {
+		unsigned int mid = lo + (hi - lo) / 2;
+		struct erofsfuse_dentry *d = &dir->dentries[mid];
+		int cmp = memcmp(name, dir->names + d->nameoff,
+				 min(len, (unsigned int)d->namelen));
+
+		if (!cmp)
+			cmp = (int)len - d->namelen;
+		if (!cmp) {
+			nd->nid = d->nid;
+			nd->ftype = d->ftype;
+			return 0;
+		}
+		if (cmp < 0)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+	return -ENOENT;
+}
+
+int erofsfuse_meta_iterate_dir(struct erofs_dir_context *ctx)
+{
+	struct erofsfuse_minode *dir = erofsfuse_meta_find(ctx->dir->nid);
+	unsigned int lo = 0, hi;
+
+	if (!dir)
+		return -ENODATA;
+	if (!S_ISDIR(dir->i_mode))
+		return -ENOTDIR;
+	if (ctx->pos >= dir->i_size)
+		return 0;
+
+	/* look for the first dirent at or after the cookie */
+	hi = dir->nr_dentries;
+	while (lo < hi) {
+		unsigned int mid = lo + (hi - lo) / 2;
+
+		if (dir->dentries[mid].pos < ctx->pos)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	for (; lo < dir->nr_dentries; ++lo) {
+		struct erofsfuse_dentry *d = &dir->dentries[lo];
+		int ret;
+
+		ctx->de_nid = d->nid;
+		ctx->de_ftype = d->ftype;
+		ctx->dname = dir->names + d->nameoff;
+		ctx->de_namelen = d->namelen;
+		ctx->pos = d->pos;
+		ctx->next_pos = lo + 1 < dir->nr_dentries ? d[1].pos :
+			round_down(d->pos, EROFS_BLKSIZ) + EROFS_BLKSIZ;
+		ret = ctx->cb(ctx);
+		if (ret)
+			return ret;
+	}
+	ctx->pos = dir->i_size;
+	return 0;
+}
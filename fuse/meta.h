@@ -0,0 +1,23 @@
+/* SPDX-License-Identifier: GPL-2.0+ */
+/*
+ * erofs-utils/fuse/meta.h
+ */
+#ifndef __EROFSFUSE_META_H
+#define __EROFSFUSE_META_H
+
+#include "erofs/internal.h"
+#include "erofs/dir.h"
+
+int erofsfuse_preload_meta(struct erofs_sb_info *sbi);
+void erofsfuse_drop_meta(void);
+
+/*
+ * The following return -ENODATA if the inode (directory) isn't preloaded,
+ * the callers should then go to the image instead.
+ */
+int erofsfuse_meta_iget(struct erofs_inode *vi);
+int erofsfuse_meta_namei(struct nameidata *nd,
+			 const char *name, unsigned int len);
+int erofsfuse_meta_iterate_dir(struct erofs_dir_context *ctx);
+
+#endif
@@ -0,0 +1,277 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * erofs-utils/fuse/readahead.c
+ *
+ * Sequential readahead for compressed files: once an open file is read
+ * sequentially, the following pclusters are read and decompressed by
+ * background workers into a per-file window, which later reads consume.
+ */
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "erofs/internal.h"
+#include "erofs/print.h"
+#include "erofs/workqueue.h"
+#include "readahead.h"
+
+/* the number of back-to-back reads before readahead kicks in */
+#define EROFSFUSE_RA_MIN_SEQ	2
+#define EROFSFUSE_RA_MAX_WORKERS	4
+
+enum {
+	EROFSFUSE_RA_NONE,
+	EROFSFUSE_RA_INFLIGHT,
+	EROFSFUSE_RA_READY,
+};
+
+struct erofsfuse_ra_window {
+	struct erofs_work work;
+	struct erofsfuse_ra *ra;
+
+	char *buf;
+	size_t bufsize;
+	/* decompressed data of [start, end) once ready */
+	erofs_off_t start, end;
+	int state, err;
+};
+
+struct erofsfuse_ra {
+	struct erofs_inode *vi;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+
+	erofs_off_t next_off;
+	unsigned int seqcount;
+	/* one window being consumed and one being filled ahead of it */
+	struct erofsfuse_ra_window win[2];
+};
+
+static struct erofs_workqueue erofsfuse_ra_wq;
+static unsigned int erofsfuse_ra_pclusters;
+
+/* find where the next @nr extents starting from @start end */
+static int erofsfuse_ra_window_end(struct erofs_inode *vi, erofs_off_t start,
+				   unsigned int nr, erofs_off_t *end)
+{
+	struct erofs_map_blocks map = {
+		.index = UINT_MAX,
+	};
+	erofs_off_t pos = start;
+	int ret;
+
+	while (pos < vi->i_size && nr--) {
+		map.m_la = pos;
+		ret = erofs_map_blocks(vi, &map, EROFS_GET_BLOCKS_FIEMAP);
+		if (ret)
+			return ret;
+		if (!map.m_llen)
+			break;
+		pos = map.m_la + map.m_llen;
+	}
+	*end = min_t(erofs_off_t, pos, vi->i_size);
+	return 0;
+}
+
+static void erofsfuse_ra_workfn(struct erofs_work *work)
+{
+	struct erofsfuse_ra_window *w =
+		container_of(work, struct erofsfuse_ra_window, work);
+	struct erofsfuse_ra *ra = w->ra;
+	erofs_off_t end;
+	int err;
+
+	err = erofsfuse_ra_window_end(ra->vi, w->start,
+				      erofsfuse_ra_pclusters, &end);
+	if (!err && end - w->start > w->bufsize) {
+		char *buf = realloc(w->buf, end - w->start);
+
+		if (!buf) {
+			err = -ENOMEM;
+		} else {
+			w->buf = buf;
+			w->bufsize = end - w->start;
+		}
+	}
+	if (!err)
+		err = erofs_pread(ra->vi, w->buf, end - w->start, w->start);
+
+	pthread_mutex_lock(&ra->lock);
+	w->end = err ? w->start : end;
+	w->err = err;
+	w->state = EROFSFUSE_RA_READY;
+	pthread_cond_broadcast(&ra->cond);
+	pthread_mutex_unlock(&ra->lock);
+
+	erofs_dbg("readahead(%llu): [%llu, %llu) err %d", ra->vi->nid | 0ULL,
+		  w->start | 0ULL, end | 0ULL, err);
+}
+
+static bool erofsfuse_ra_window_useful(struct erofsfuse_ra_window *w,
+				       erofs_off_t pos)
+{
+	return w->state == EROFSFUSE_RA_READY && !w->err && w->end > pos;
+}
+
+/* start filling a free window right after the data which is ready */
+static void erofsfuse_ra_kick(struct erofsfuse_ra *ra, erofs_off_t pos)
+{
+	struct erofsfuse_ra_window *w, *free = NULL;
+	erofs_off_t start = pos;
+	int i, j;
+
+	for (i = 0; i < ARRAY_SIZE(ra->win); ++i) {
+		w = &ra->win[i];
+		/* only one readahead request per file at a time */
+		if (w->state == EROFSFUSE_RA_INFLIGHT)
+			return;
+		if (!free && !erofsfuse_ra_window_useful(w, pos))
+			free = w;
+	}
+	if (!free)
+		return;
+
+	for (j = 0; j < ARRAY_SIZE(ra->win); ++j) {
+		for (i = 0; i < ARRAY_SIZE(ra->win); ++i) {
+			w = &ra->win[i];
+			if (erofsfuse_ra_window_useful(w, pos) &&
+			    w->start <= start && w->end > start)
+				start = w->end;
+		}
+	}
+	if (start >= ra->vi->i_size)
+		return;
+
+	free->start = free->end = start;
+	free->err = 0;
+	free->state = EROFSFUSE_RA_INFLIGHT;
+	erofs_workqueue_add(&erofsfuse_ra_wq, &free->work);
+}
+
+static struct erofsfuse_ra_window *
+erofsfuse_ra_lookup(struct erofsfuse_ra *ra, erofs_off_t pos)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(ra->win); ++i) {
+		struct erofsfuse_ra_window *w = &ra->win[i];
+
+		/* the end of an inflight window is unknown yet */
+		if (w->state == EROFSFUSE_RA_INFLIGHT && pos >= w->start)
+			return w;
+		if (w->state == EROFSFUSE_RA_READY &&
+		    pos >= w->start && pos < w->end)
+			return w;
+	}
+	return NULL;
+}
+
+/* returns how many bytes were served from readahead or a negative errno */
+int erofsfuse_ra_read(struct erofsfuse_ra *ra, char *buf,
+		      erofs_off_t size, erofs_off_t off)
+{
+	struct erofsfuse_ra_window *w;
+	erofs_off_t pos = off, end = off + size;
+
+	pthread_mutex_lock(&ra->lock);
+	while (pos < end && (w = erofsfuse_ra_lookup(ra, pos))) {
+		erofs_off_t count;
+
+		while (w->state == EROFSFUSE_RA_INFLIGHT)
+			pthread_cond_wait(&ra->cond, &ra->lock);
+
+		if (w->err || pos < w->start || pos >= w->end)
+			break;
+
+		count = min(end, w->end) - pos;
+		memcpy(buf + pos - off, w->buf + pos - w->start, count);
+		pos += count;
+	}
+
+	if (off == ra->next_off) {
+		if (ra->seqcount < UINT_MAX)
+			++ra->seqcount;
+	} else {
+		ra->seqcount = 0;
+	}
+	ra->next_off = end;
+
+	if (ra->seqcount >= EROFSFUSE_RA_MIN_SEQ)
+		erofsfuse_ra_kick(ra, end);
+	pthread_mutex_unlock(&ra->lock);
+
+	if (pos < end) {
+		int ret = erofs_pread(ra->vi, buf + pos - off, end - pos, pos);
+
+		if (ret)
+			return ret;
+	}
+	return pos - off;
+}
+
+struct erofsfuse_ra *erofsfuse_ra_alloc(struct erofs_inode *vi)
+{
+	struct erofsfuse_ra *ra;
+	int i;
+
+	if (!erofsfuse_ra_pclusters)
+		return NULL;
+
+	ra = calloc(1, sizeof(*ra));
+	if (!ra)
+		return ERR_PTR(-ENOMEM);
+
+	ra->vi = vi;
+	pthread_mutex_init(&ra->lock, NULL);
+	pthread_cond_init(&ra->cond, NULL);
+	for (i = 0; i < ARRAY_SIZE(ra->win); ++i) {
+		ra->win[i].ra = ra;
+		ra->win[i].work.fn = erofsfuse_ra_workfn;
+	}
+	return ra;
+}
+
+void erofsfuse_ra_free(struct erofsfuse_ra *ra)
+{
+	int i;
+
+	if (!ra)
+		return;
+
+	pthread_mutex_lock(&ra->lock);
+	for (i = 0; i < ARRAY_SIZE(ra->win); ++i)
+		while (ra->win[i].state == EROFSFUSE_RA_INFLIGHT)
+			pthread_cond_wait(&ra->cond, &ra->lock);
+	pthread_mutex_unlock(&ra->lock);
+
+	for (i = 0; i < ARRAY_SIZE(ra->win); ++i)
+		free(ra->win[i].buf);
+	pthread_cond_destroy(&ra->cond);
+	pthread_mutex_destroy(&ra->lock);
+	free(ra);
+}
+
+int erofsfuse_ra_init(unsigned int nr_pclusters)
+{
+	long ncpus;
+	int ret;
+
+	if (!nr_pclusters)
+		return 0;
+
+	ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+	ret = erofs_workqueue_init(&erofsfuse_ra_wq,
+				   ncpus < 1 ? 1 : min_t(long, ncpus,
+						EROFSFUSE_RA_MAX_WORKERS));
+	if (ret)
+		return ret;
+	erofsfuse_ra_pclusters = nr_pclusters;
+	return 0;
+}
+
+void erofsfuse_ra_exit(void)
+{
+	if (!erofsfuse_ra_pclusters)
+		return;
+	erofs_workqueue_shutdown(&erofsfuse_ra_wq);
+	erofsfuse_ra_pclusters = 0;
+}
@@ -0,0 +1,19 @@
+/* SPDX-License-Identifier: GPL-2.0+ */
+/*
+ * erofs-utils/fuse/readahead.h
+ */
+#ifndef __EROFSFUSE_READAHEAD_H
+#define __EROFSFUSE_READAHEAD_H
+
+#include "erofs/internal.h"
+
+struct erofsfuse_ra;
+
+int erofsfuse_ra_init(unsigned int nr_pclusters);
+void erofsfuse_ra_exit(void);
+struct erofsfuse_ra *erofsfuse_ra_alloc(struct erofs_inode *vi);
+void erofsfuse_ra_free(struct erofsfuse_ra *ra);
+int erofsfuse_ra_read(struct erofsfuse_ra *ra, char *buf,
+		      erofs_off_t size, erofs_off_t off);
+
+#endif
@@ -0,0 +1,139 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * erofs-utils/fuse/trace.c
+ *
+ * Record an access trace of file reads, one line per read request:
+ *
+ *   <usecs since mount> <nid> <offset> <length> <H|P|M> <path>
+ *
+ * where H, P and M tell if the data was all, partly or not at all served
+ * from erofsfuse's readahead windows rather than read from the image.
+ * Paths are learnt from lookups, so that the trace can be turned into
+ * file orders for later image builds.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "erofs/print.h"
+#include "erofs/hashtable.h"
+#include "trace.h"
+
+#define EROFSFUSE_TRACE_PATH_HASHBITS	12
+
+struct erofsfuse_trace_path {
+	struct hlist_node node;
+	erofs_nid_t nid;
+	char path[];
+};
+
+static FILE *erofsfuse_trace_fp;
+static struct timespec erofsfuse_trace_start;
+static DECLARE_HASHTABLE(erofsfuse_trace_paths, EROFSFUSE_TRACE_PATH_HASHBITS);
+static pthread_mutex_t erofsfuse_trace_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static const char *erofsfuse_trace_find_path(erofs_nid_t nid)
+{
+	struct erofsfuse_trace_path *tp;
+
+	hash_for_each_possible(erofsfuse_trace_paths, tp, node, nid)
+		if (tp->nid == nid)
+			return tp->path;
+	return NULL;
+}
+
+static int erofsfuse_trace_add_path(erofs_nid_t nid, const char *dir,
+				    const char *name)
+{
+	struct erofsfuse_trace_path *tp;
+	size_t dirlen = strlen(dir), namelen = strlen(name);
+
+	/* a "/" is needed in between unless the parent is the root */
+	tp = malloc(sizeof(*tp) + dirlen + namelen + 2);
+	if (!tp)
+		return -ENOMEM;
+	tp->nid = nid;
+	memcpy(tp->path, dir, dirlen);
+	if (!dirlen || dir[dirlen - 1] != '/')
+		tp->path[dirlen++] = '/';
+	memcpy(tp->path + dirlen, name, namelen + 1);
+	hash_add(erofsfuse_trace_paths, &tp->node, nid);
+	return 0;
+}
+
+int erofsfuse_trace_open(const char *filename)
+{
+	erofsfuse_trace_fp = fopen(filename, "w");
+	if (!erofsfuse_trace_fp)
+		return -errno;
+	/* flush each record so the trace is complete if erofsfuse is killed */
+	setvbuf(erofsfuse_trace_fp, NULL, _IOLBF, 0);
+
+	clock_gettime(CLOCK_MONOTONIC, &erofsfuse_trace_start);
+	fprintf(erofsfuse_trace_fp,
+		"# usecs nid offset length H(it)|P(artial)|M(iss) path\n");
+	return erofsfuse_trace_add_path(g_sbi.root_nid, "", "");
+}
+
+void erofsfuse_trace_close(void)
+{
+	struct erofsfuse_trace_path *tp;
+	struct hlist_node *n;
+	int bkt;
+
+	if (!erofsfuse_trace_fp)
+		return;
+
+	fclose(erofsfuse_trace_fp);
+	erofsfuse_trace_fp = NULL;
+	hash_for_each_safe(erofsfuse_trace_paths, bkt, n, tp, node) {
+		hash_del(&tp->node);
+		free(tp);
+	}
+}
+
+/* remember the first path of each inode for later reads */
+void erofsfuse_trace_lookup(erofs_nid_t parent, erofs_nid_t nid,
+			    const char *name)
+{
+	const char *dir;
+
+	if (!erofsfuse_trace_fp)
+		return;
+
+	pthread_mutex_lock(&erofsfuse_trace_lock);
+	if (!erofsfuse_trace_find_path(nid)) {
+		dir = erofsfuse_trace_find_path(parent);
+		if (dir && erofsfuse_trace_add_path(nid, dir, name))
+			erofs_err("failed to trace path of nid %llu",
+				  nid | 0ULL);
+	}
+	pthread_mutex_unlock(&erofsfuse_trace_lock);
+}
+
+void erofsfuse_trace_read(erofs_nid_t nid, erofs_off_t off, erofs_off_t len,
+			  erofs_off_t cached)
+{
+	struct timespec now;
+	const char *path;
+	long long usecs;
+	char hit;
+
+	if (!erofsfuse_trace_fp)
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	usecs = (now.tv_sec - erofsfuse_trace_start.tv_sec) * 1000000LL +
+		(now.tv_nsec - erofsfuse_trace_start.tv_nsec) / 1000;
+	if (cached >= len)
+		hit = 'H';
+	else
+		hit = cached ? 'P' : 'M';
+
+	pthread_mutex_lock(&erofsfuse_trace_lock);
+	path = erofsfuse_trace_find_path(nid);
+	fprintf(erofsfuse_trace_fp, "%lld %llu %llu %llu %c %s\n", usecs,
+		nid | 0ULL, off | 0ULL, len | 0ULL, hit, path ? path : "?");
+	pthread_mutex_unlock(&erofsfuse_trace_lock);
+}
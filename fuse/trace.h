@@ -0,0 +1,17 @@
+/* SPDX-License-Identifier: GPL-2.0+ */
+/*
+ * erofs-utils/fuse/trace.h
+ */
+#ifndef __EROFSFUSE_TRACE_H
+#define __EROFSFUSE_TRACE_H
+
+#include "erofs/internal.h"
+
+int erofsfuse_trace_open(const char *filename);
+void erofsfuse_trace_close(void);
+void erofsfuse_trace_lookup(erofs_nid_t parent, erofs_nid_t nid,
+			    const char *name);
+void erofsfuse_trace_read(erofs_nid_t nid, erofs_off_t off, erofs_off_t len,
+			  erofs_off_t cached);
+
+#endif
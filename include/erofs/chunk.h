@@ -0,0 +1,18 @@
+/* SPDX-License-Identifier: GPL-2.0+ */
+/*
+ * erofs-utils/include/erofs/chunk.h
+ */
+#ifndef __EROFS_CHUNK_H
+#define __EROFS_CHUNK_H
+
+#include "internal.h"
+
+/* the largest chunk size which mkfs accepts */
+#define EROFS_CHUNK_MAX_BITS	20
+
+int erofs_write_chunked_file(struct erofs_inode *inode, int fd);
+
+int erofs_chunk_init(void);
+void erofs_chunk_exit(void);
+
+#endif
@@ -44,6 +44,8 @@ struct erofs_configure {
 	bool c_random_pclusterblks;
 #endif
 	char c_timeinherit;
+	/* the number of threads decompressing pclusters of large reads */
+	unsigned int c_decompress_workers;
 
 #ifdef HAVE_LIBSELINUX
 	struct selabel_handle *sehnd;
@@ -54,11 +56,27 @@ struct erofs_configure {
 	char *c_compr_alg_master;
 	int c_compr_level_master;
 	int c_force_inodeversion;
+	/* lay out all metadata in one region after the file data */
+	bool c_segregate_meta;
+	/* inline the tail pcluster of compressed files */
+	bool c_ztailpacking;
+	/* pack the tails of compressed files into the packed inode */
+	bool c_fragments;
+	/* refer to compressed data chunks seen before instead of writing them */
+	bool c_dedupe;
 	/* < 0, xattr disabled and INT_MAX, always use inline xattrs */
 	int c_inline_xattr_tolerance;
 
 	u32 c_physical_clusterblks;
+	/* log2 of the lcluster size of compressed files, 0 for block size */
+	u32 c_lclusterbits;
+	/* log2 of the chunk size of uncompressed files, 0 for flat files */
+	u32 c_chunkbits;
 	u32 c_max_decompressed_extent_bytes;
+	/* compress fixed windows of this size independently, 0 if disabled */
+	u32 c_fixed_inputsize;
+	/* pclusters don't cross boundaries of this many blocks, 0 if unset */
+	u32 c_pcluster_alignblks;
 	u64 c_unix_timestamp;
 	u32 c_uid, c_gid;
 #ifdef WITH_ANDROID
@@ -16,6 +16,7 @@ enum {
 };
 
 struct z_erofs_decompress_req {
+	struct erofs_sb_info *sbi;
 	char *in, *out;
 
 	/*
@@ -28,8 +29,19 @@ struct z_erofs_decompress_req {
 	/* indicate the algorithm will be used for decompression */
 	unsigned int alg;
 	bool partial_decoding;
+	/* the input overlaps the tail of the output buffer */
+	bool inplace_io;
 };
 
+enum {
+	Z_EROFS_WORKSPACE_DECODE,	/* decoded data to be partially copied */
+	Z_EROFS_WORKSPACE_RAW,		/* compressed data of batched reads */
+	Z_EROFS_WORKSPACE_MAX
+};
+
+void *z_erofs_get_workspace(unsigned int id, size_t size);
+int z_erofs_inplace_margin(struct erofs_sb_info *sbi, unsigned int alg,
+			   unsigned int inputsize, unsigned int outputsize);
 int z_erofs_decompress(struct z_erofs_decompress_req *rq);
 
 #endif
@@ -0,0 +1,61 @@
+/* SPDX-License-Identifier: GPL-2.0+ */
+/*
+ * erofs-utils/include/erofs/dedupe.h
+ */
+#ifndef __EROFS_DEDUPE_H
+#define __EROFS_DEDUPE_H
+
+#include "internal.h"
+#include "hashtable.h"
+
+/* chunks are cut at block boundaries, no longer than this */
+#define Z_EROFS_DEDUPE_MAX_CHUNKBLKS	64
+
+/* a pcluster written for a chunk, which later chunks can refer to */
+struct z_erofs_dedupe_pcluster {
+	erofs_blk_t blkaddr;
+	unsigned int compressedblks;
+	/* decompressed length of the pcluster */
+	unsigned int count;
+	bool raw;
+	/* clusterofs was reset to 0 for the raw pcluster, see compress.c */
+	bool clusterofs_reset;
+};
+
+/* a chunk recorded in the dedupe table */
+struct z_erofs_dedupe_item {
+	struct hlist_node node;
+	struct list_head list;
+
+	u8 digest[32];
+	unsigned int length;
+
+	unsigned int nr;
+	struct z_erofs_dedupe_pcluster pcs[];
+};
+
+/* the chunk occurring more than once, which is being compressed */
+struct z_erofs_dedupe_chunk {
+	u8 digest[32];
+	unsigned int length;
+
+	/* the pclusters written for the chunk so far, < 0 if unrecordable */
+	int nr;
+	struct z_erofs_dedupe_pcluster pcs[Z_EROFS_DEDUPE_MAX_CHUNKBLKS * 2];
+};
+
+unsigned int z_erofs_dedupe_chunksize(const u8 *data, unsigned int len,
+				      bool final);
+int z_erofs_dedupe_scan(const char *path);
+bool z_erofs_dedupe_file_is_shared(dev_t dev, ino_t ino);
+bool z_erofs_dedupe_chunk_is_shared(struct z_erofs_dedupe_chunk *chunk,
+				    const u8 *data, unsigned int len);
+const struct z_erofs_dedupe_item *
+z_erofs_dedupe_match(const struct z_erofs_dedupe_chunk *chunk);
+int z_erofs_dedupe_insert(const struct z_erofs_dedupe_chunk *chunk);
+void z_erofs_dedupe_commit(bool drop);
+
+int z_erofs_dedupe_init(void);
+void z_erofs_dedupe_exit(void);
+
+#endif
@@ -175,5 +175,10 @@ static inline u32 get_unaligned_le32(const u8 *p)
 	return p[0] | p[1] << 8 | p[2] << 16 | p[3] << 24;
 }
 
+static inline u64 get_unaligned_le64(const u8 *p)
+{
+	return get_unaligned_le32(p) | (u64)get_unaligned_le32(p + 4) << 32;
+}
+
 #endif
 
@@ -0,0 +1,46 @@
+/* SPDX-License-Identifier: GPL-2.0+ */
+/*
+ * erofs-utils/include/erofs/dir.h
+ */
+#ifndef __EROFS_DIR_H
+#define __EROFS_DIR_H
+
+#include "internal.h"
+
+struct erofs_dir_context;
+
+/*
+ * called for each dirent: return 0 to go on, a positive value to stop
+ * at the current dirent or a negative errno to abort the iteration.
+ */
+typedef int (*erofs_readdir_cb)(struct erofs_dir_context *ctx);
+
+/*
+ * Directories are walked with cookies as the kernel does: the cookie of
+ * a dirent is its byte position in the directory, i.e. the dirent block
+ * number and the index of the dirent in that block.
+ */
+struct erofs_dir_context {
+	struct erofs_inode *dir;
+	erofs_readdir_cb cb;
+
+	/*
+	 * where to start from; it's the cookie of the current dirent in the
+	 * callback and where to resume from once erofs_iterate_dir() returns.
+	 */
+	erofs_off_t pos;
+	/* (in the callback) the cookie of the dirent after the current one */
+	erofs_off_t next_pos;
+
+	/* (in the callback) the current dirent */
+	erofs_nid_t de_nid;
+	const char *dname;
+	unsigned int de_namelen;
+	unsigned char de_ftype;
+};
+
+int erofs_iterate_dirents(struct erofs_dir_context *ctx, const void *dblk,
+			  unsigned int maxsize, erofs_off_t blkpos);
+int erofs_iterate_dir(struct erofs_dir_context *ctx);
+
+#endif
@@ -0,0 +1,27 @@
+/* SPDX-License-Identifier: GPL-2.0+ */
+/*
+ * erofs-utils/include/erofs/fragments.h
+ */
+#ifndef __EROFS_FRAGMENTS_H
+#define __EROFS_FRAGMENTS_H
+
+#include "internal.h"
+
+/* no '/' in it so that it never matches any source path */
+#define EROFS_PACKED_INODE	"packed_file"
+
+static inline bool erofs_is_packed_inode(struct erofs_inode *inode)
+{
+	return !strcmp(inode->i_srcpath, EROFS_PACKED_INODE);
+}
+
+erofs_off_t z_erofs_fragments_tell(void);
+int z_erofs_pack_fragments(struct erofs_inode *inode, void *data,
+			   unsigned int len);
+void z_erofs_drop_fragments(struct erofs_inode *inode);
+struct erofs_inode *erofs_mkfs_build_packed_file(void);
+
+int z_erofs_fragments_init(void);
+void z_erofs_fragments_exit(void);
+
+#endif
@@ -38,8 +38,8 @@ typedef unsigned short umode_t;
 
 #define PAGE_MASK		(~(PAGE_SIZE-1))
 
-#define LOG_BLOCK_SIZE          (12)
-#define EROFS_BLKSIZ            (1U << LOG_BLOCK_SIZE)
+#define EROFS_MIN_BLOCK_SIZE	512
+#define EROFS_MAX_BLOCK_SIZE	(64 * 1024)
 
 #define EROFS_ISLOTBITS		5
 #define EROFS_SLOTSIZE		(1U << EROFS_ISLOTBITS)
@@ -52,11 +52,11 @@ typedef u32 erofs_blk_t;
 #define NULL_ADDR	((unsigned int)-1)
 #define NULL_ADDR_UL	((unsigned long)-1)
 
-#define erofs_blknr(addr)       ((addr) / EROFS_BLKSIZ)
-#define erofs_blkoff(addr)      ((addr) % EROFS_BLKSIZ)
-#define blknr_to_addr(nr)       ((erofs_off_t)(nr) * EROFS_BLKSIZ)
-
-#define BLK_ROUND_UP(addr)	DIV_ROUND_UP(addr, EROFS_BLKSIZ)
+/* the block size is decided per image, see erofs_sb_info */
+#define erofs_blksiz(sbi)		(1U << (sbi)->blkszbits)
+#define erofs_sbi_blknr(sbi, addr)	((addr) >> (sbi)->blkszbits)
+#define erofs_sbi_blkoff(sbi, addr)	((addr) & (erofs_blksiz(sbi) - 1))
+#define erofs_sbi_pos(sbi, nr)		((erofs_off_t)(nr) << (sbi)->blkszbits)
 
 struct erofs_buffer_head;
 
@@ -72,6 +72,7 @@ struct erofs_sb_info {
 	u32 build_time_nsec;
 
 	unsigned char islotbits;
+	unsigned char blkszbits;
 
 	/* what we really care is nid, rather than ino.. */
 	erofs_nid_t root_nid;
@@ -82,33 +83,60 @@ struct erofs_sb_info {
 
 	u16 available_compr_algs;
 	u16 lz4_max_distance;
+
+	/* the special inode which keeps the fragments of other files */
+	erofs_nid_t packed_nid;
+	struct erofs_inode *packed_inode;
+
+	/* the device (or image file) which the filesystem lives in */
+	const char *devname;
+	int devfd;
+	u64 devsz;
 };
 
-/* global sbi */
-extern struct erofs_sb_info sbi;
+#ifdef EROFS_UTILS_BUILD
+/* the filesystem which mkfs.erofs, dump.erofs and erofsfuse work on */
+extern struct erofs_sb_info g_sbi;
+
+/*
+ * shorthands for g_sbi, which the tools use. Readers which could open
+ * several images use the erofs_sbi_*() helpers of the given filesystem.
+ */
+#define LOG_BLOCK_SIZE          (g_sbi.blkszbits)
+#define EROFS_BLKSIZ            (1U << LOG_BLOCK_SIZE)
+
+#define erofs_blknr(addr)       ((addr) / EROFS_BLKSIZ)
+#define erofs_blkoff(addr)      ((addr) % EROFS_BLKSIZ)
+#define blknr_to_addr(nr)       ((erofs_off_t)(nr) * EROFS_BLKSIZ)
+
+#define BLK_ROUND_UP(addr)	DIV_ROUND_UP(addr, EROFS_BLKSIZ)
+#endif
 
-static inline erofs_off_t iloc(erofs_nid_t nid)
+static inline erofs_off_t iloc(struct erofs_sb_info *sbi, erofs_nid_t nid)
 {
-	return blknr_to_addr(sbi.meta_blkaddr) + (nid << sbi.islotbits);
+	return erofs_sbi_pos(sbi, sbi->meta_blkaddr) + (nid << sbi->islotbits);
 }
 
 #define EROFS_FEATURE_FUNCS(name, compat, feature) \
-static inline bool erofs_sb_has_##name(void) \
+static inline bool erofs_sb_has_##name(struct erofs_sb_info *sbi) \
 { \
-	return sbi.feature_##compat & EROFS_FEATURE_##feature; \
+	return sbi->feature_##compat & EROFS_FEATURE_##feature; \
 } \
-static inline void erofs_sb_set_##name(void) \
+static inline void erofs_sb_set_##name(struct erofs_sb_info *sbi) \
 { \
-	sbi.feature_##compat |= EROFS_FEATURE_##feature; \
+	sbi->feature_##compat |= EROFS_FEATURE_##feature; \
 } \
-static inline void erofs_sb_clear_##name(void) \
+static inline void erofs_sb_clear_##name(struct erofs_sb_info *sbi) \
 { \
-	sbi.feature_##compat &= ~EROFS_FEATURE_##feature; \
+	sbi->feature_##compat &= ~EROFS_FEATURE_##feature; \
 }
 
 EROFS_FEATURE_FUNCS(lz4_0padding, incompat, INCOMPAT_LZ4_0PADDING)
 EROFS_FEATURE_FUNCS(compr_cfgs, incompat, INCOMPAT_COMPR_CFGS)
 EROFS_FEATURE_FUNCS(big_pcluster, incompat, INCOMPAT_BIG_PCLUSTER)
+EROFS_FEATURE_FUNCS(chunked_file, incompat, INCOMPAT_CHUNKED_FILE)
+EROFS_FEATURE_FUNCS(ztailpacking, incompat, INCOMPAT_ZTAILPACKING)
+EROFS_FEATURE_FUNCS(fragments, incompat, INCOMPAT_FRAGMENTS)
 EROFS_FEATURE_FUNCS(sb_chksum, compat, COMPAT_SB_CHKSUM)
 
 #define EROFS_I_EA_INITED	(1 << 0)
@@ -116,6 +144,8 @@ EROFS_FEATURE_FUNCS(sb_chksum, compat, COMPAT_SB_CHKSUM)
 
 struct erofs_inode {
 	struct list_head i_hash, i_subdirs, i_xattrs;
+	/* the filesystem which the inode belongs to */
+	struct erofs_sb_info *sbi;
 
 	union {
 		/* (erofsfuse) runtime flags */
@@ -140,10 +170,12 @@ struct erofs_inode {
 		u32 i_blkaddr;
 		u32 i_blocks;
 		u32 i_rdev;
+		struct {
+			unsigned short	chunkformat;
+			unsigned char	chunkbits;
+		};
 	} u;
 
-	char i_srcpath[PATH_MAX + 1];
-
 	unsigned char datalayout;
 	unsigned char inode_isize;
 	/* inline tail-end packing size */
@@ -153,21 +185,38 @@ struct erofs_inode {
 	unsigned int extent_isize;
 
 	erofs_nid_t nid;
-	struct erofs_buffer_head *bh;
-	struct erofs_buffer_head *bh_inline, *bh_data;
 
 	void *idata;
 
 	union {
 		void *compressmeta;
+		void *chunkindexes;
 		struct {
 			uint16_t z_advise;
 			uint8_t  z_algorithmtype[2];
 			uint8_t  z_logical_clusterbits;
+			uint16_t z_idata_size;
+			/* the inline tail pcluster, see z_erofs_fill_inode_lazy */
+			erofs_blk_t z_tailextent_headlcn;
+			erofs_off_t z_idataoff;
+			erofs_off_t z_fragmentoff;
 		};
 	};
-#ifdef WITH_ANDROID
+#ifdef EROFS_UTILS_BUILD
+	/*
+	 * (mkfs.erofs) build state, which liberofs readers never touch. It
+	 * comes last so that inodes of other users can leave it out.
+	 */
+	char i_srcpath[PATH_MAX + 1];
+	struct erofs_buffer_head *bh;
+	struct erofs_buffer_head *bh_inline, *bh_data;
+	/* file capabilities from Android fs_config */
 	uint64_t capabilities;
+	/* data has been laid out ahead of the tree walk */
+	bool prebuilt;
+	/* the tail data kept in the packed inode */
+	erofs_off_t fragmentoff;
+	unsigned int fragment_size;
 #endif
 };
 
@@ -194,6 +243,15 @@ static inline unsigned int erofs_inode_datalayout(unsigned int value)
 			      EROFS_I_DATALAYOUT_BITS);
 }
 
+/* check i_format of an on-disk inode to tell how large the inode is */
+static inline bool erofs_inode_is_extended(const void *buf)
+{
+	const struct erofs_inode_compact *dic = buf;
+
+	return erofs_inode_version(le16_to_cpu(dic->i_format)) ==
+		EROFS_INODE_LAYOUT_EXTENDED;
+}
+
 #define IS_ROOT(x)	((x) == (x)->i_parent)
 
 struct erofs_dentry {
@@ -231,6 +289,7 @@ enum {
 	BH_Mapped,
 	BH_Zipped,
 	BH_FullMapped,
+	BH_Fragment,
 };
 
 /* Has a disk mapping */
@@ -241,10 +300,18 @@ enum {
 #define EROFS_MAP_ZIPPED	(1 << BH_Zipped)
 /* The length of extent is full */
 #define EROFS_MAP_FULL_MAPPED	(1 << BH_FullMapped)
+/* The extent is a fragment in the packed inode */
+#define EROFS_MAP_FRAGMENT	(1 << BH_Fragment)
 
-struct erofs_map_blocks {
-	char mpage[EROFS_BLKSIZ];
+/*
+ * Used to get the exact decompressed length, e.g. fiemap (consider lookback
+ * approach instead if possible since it's more metadata lightweight.)
+ */
+#define EROFS_GET_BLOCKS_FIEMAP	0x0002
+/* Used to locate the inline tail pcluster when loading the map header */
+#define EROFS_GET_BLOCKS_FINDTAIL	0x0008
 
+struct erofs_map_blocks {
 	erofs_off_t m_pa, m_la;
 	u64 m_plen, m_llen;
 
@@ -253,18 +320,32 @@ struct erofs_map_blocks {
 };
 
 /* super.c */
-int erofs_read_superblock(void);
+int erofs_read_superblock(struct erofs_sb_info *sbi);
+void erofs_put_super(struct erofs_sb_info *sbi);
+struct erofs_inode *erofs_packed_inode(struct erofs_sb_info *sbi);
 
 /* namei.c */
-int erofs_ilookup(const char *path, struct erofs_inode *vi);
+struct nameidata {
+	struct erofs_sb_info *sbi;
+	erofs_nid_t	nid;
+	unsigned int	ftype;
+};
+
+int erofs_namei(struct nameidata *nd, const char *name, unsigned int len);
+int erofs_ilookup(struct erofs_sb_info *sbi, const char *path,
+		  struct erofs_inode *vi);
 
 /* data.c */
+int erofs_map_blocks(struct erofs_inode *inode,
+		     struct erofs_map_blocks *map, int flags);
 int erofs_pread(struct erofs_inode *inode, char *buf,
 		erofs_off_t count, erofs_off_t offset);
 /* zmap.c */
 int z_erofs_fill_inode(struct erofs_inode *vi);
 int z_erofs_map_blocks_iter(struct erofs_inode *vi,
-			    struct erofs_map_blocks *map);
+			    struct erofs_map_blocks *map,
+			    int flags);
+void z_erofs_drop_extent_cache(struct erofs_sb_info *sbi);
 
 #define EFSCORRUPTED	EUCLEAN		/* Filesystem is corrupted */
 
@@ -11,36 +11,44 @@
 
 #include <unistd.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include "internal.h"
 
 #ifndef O_BINARY
 #define O_BINARY	0
 #endif
 
-int dev_open(const char *devname);
-int dev_open_ro(const char *dev);
-void dev_close(void);
-int dev_write(const void *buf, u64 offset, size_t len);
-int dev_read(void *buf, u64 offset, size_t len);
-int dev_fillzero(u64 offset, size_t len, bool padding);
-int dev_fsync(void);
-int dev_resize(erofs_blk_t nblocks);
-u64 dev_length(void);
+int dev_open(struct erofs_sb_info *sbi, const char *devname);
+int dev_open_ro(struct erofs_sb_info *sbi, const char *dev);
+void dev_close(struct erofs_sb_info *sbi);
+int dev_write(struct erofs_sb_info *sbi, const void *buf,
+	      u64 offset, size_t len);
+int dev_read(struct erofs_sb_info *sbi, void *buf, u64 offset, size_t len);
+int dev_readv(struct erofs_sb_info *sbi, const struct iovec *iov,
+	      int iovcnt, u64 offset);
+int dev_fillzero(struct erofs_sb_info *sbi, u64 offset, size_t len,
+		 bool padding);
+int dev_fsync(struct erofs_sb_info *sbi);
+int dev_resize(struct erofs_sb_info *sbi, erofs_blk_t nblocks);
+u64 dev_length(struct erofs_sb_info *sbi);
+int dev_fd(struct erofs_sb_info *sbi);
+ssize_t erofs_read_sparse(int fd, void *buf, size_t len);
 dev_t erofs_new_decode_dev(u32 dev);
+int erofs_read_inode_from_buf(struct erofs_inode *vi, const void *buf);
 int erofs_read_inode_from_disk(struct erofs_inode *vi);
 
-static inline int blk_write(const void *buf, erofs_blk_t blkaddr,
-			    u32 nblocks)
+static inline int blk_write(struct erofs_sb_info *sbi, const void *buf,
+			    erofs_blk_t blkaddr, u32 nblocks)
 {
-	return dev_write(buf, blknr_to_addr(blkaddr),
-			 blknr_to_addr(nblocks));
+	return dev_write(sbi, buf, erofs_sbi_pos(sbi, blkaddr),
+			 erofs_sbi_pos(sbi, nblocks));
 }
 
-static inline int blk_read(void *buf, erofs_blk_t start,
-			    u32 nblocks)
+static inline int blk_read(struct erofs_sb_info *sbi, void *buf,
+			   erofs_blk_t start, u32 nblocks)
 {
-	return dev_read(buf, blknr_to_addr(start),
-			 blknr_to_addr(nblocks));
+	return dev_read(sbi, buf, erofs_sbi_pos(sbi, start),
+			erofs_sbi_pos(sbi, nblocks));
 }
 
 #endif
@@ -0,0 +1,35 @@
+/* SPDX-License-Identifier: GPL-2.0+ */
+/*
+ * erofs-utils/include/erofs/workqueue.h
+ */
+#ifndef __EROFS_WORKQUEUE_H
+#define __EROFS_WORKQUEUE_H
+
+#include <pthread.h>
+#include "defs.h"
+#include "list.h"
+
+struct erofs_work;
+
+typedef void (*erofs_workfn_t)(struct erofs_work *work);
+
+struct erofs_work {
+	struct list_head list;
+	erofs_workfn_t fn;
+};
+
+struct erofs_workqueue {
+	struct list_head head;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+
+	pthread_t *workers;
+	unsigned int nworkers;
+	bool shutdown;
+};
+
+int erofs_workqueue_init(struct erofs_workqueue *wq, unsigned int nworkers);
+void erofs_workqueue_add(struct erofs_workqueue *wq, struct erofs_work *work);
+void erofs_workqueue_shutdown(struct erofs_workqueue *wq);
+
+#endif
@@ -18,8 +18,11 @@ static struct erofs_buffer_block blkh = {
 };
 static erofs_blk_t tail_blkaddr;
 
-/* buckets for all mapped buffer blocks to boost up allocation */
-static struct list_head mapped_buckets[META + 1][EROFS_BLKSIZ];
+/*
+ * buckets for all mapped buffer blocks to boost up allocation, one for each
+ * byte offset in a block of the chosen block size
+ */
+static struct list_head *mapped_buckets[META + 1];
 /* last mapped buffer block to accelerate erofs_mapbh() */
 static struct erofs_buffer_block *last_mapped_block = &blkh;
 
@@ -47,7 +50,7 @@ int erofs_bh_flush_generic_write(struct erofs_buffer_head *bh, void *buf)
 	erofs_off_t offset = erofs_btell(bh, false);
 
 	DBG_BUGON(nbh->off < bh->off);
-	return dev_write(buf, offset, nbh->off - bh->off);
+	return dev_write(&g_sbi, buf, offset, nbh->off - bh->off);
 }
 
 static bool erofs_bh_flush_buf_write(struct erofs_buffer_head *bh)
@@ -67,20 +70,39 @@ struct erofs_bhops erofs_buf_write_bhops = {
 /* return buffer_head of erofs super block (with size 0) */
 struct erofs_buffer_head *erofs_buffer_init(void)
 {
-	int i, j;
-	struct erofs_buffer_head *bh = erofs_balloc(META, 0, 0, 0);
+	unsigned int i, j;
+	struct erofs_buffer_head *bh;
 
-	if (IS_ERR(bh))
-		return bh;
+	for (i = 0; i < ARRAY_SIZE(mapped_buckets); i++) {
+		mapped_buckets[i] = malloc(EROFS_BLKSIZ *
+					   sizeof(*mapped_buckets[i]));
+		if (!mapped_buckets[i]) {
+			erofs_buffer_exit();
+			return ERR_PTR(-ENOMEM);
+		}
+		for (j = 0; j < EROFS_BLKSIZ; j++)
+			init_list_head(&mapped_buckets[i][j]);
+	}
 
+	bh = erofs_balloc(META, 0, 0, 0);
+	if (IS_ERR(bh)) {
+		erofs_buffer_exit();
+		return bh;
+	}
 	bh->op = &erofs_skip_write_bhops;
-
-	for (i = 0; i < ARRAY_SIZE(mapped_buckets); i++)
-		for (j = 0; j < ARRAY_SIZE(mapped_buckets[0]); j++)
-			init_list_head(&mapped_buckets[i][j]);
 	return bh;
 }
 
+void erofs_buffer_exit(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(mapped_buckets); i++) {
+		free(mapped_buckets[i]);
+		mapped_buckets[i] = NULL;
+	}
+}
+
 static void erofs_bupdate_mapped(struct erofs_buffer_block *bb)
 {
 	struct list_head *bkt;
@@ -370,6 +392,18 @@ erofs_blk_t erofs_mapbh(struct erofs_buffer_block *bb)
 	return tail_blkaddr;
 }
 
+/* map all buffer blocks and fill them up so that nothing is attached later */
+void erofs_bseal(void)
+{
+	struct erofs_buffer_block *bb;
+
+	erofs_mapbh(NULL);
+	list_for_each_entry(bb, &blkh.list, list) {
+		bb->buffers.off = round_up(bb->buffers.off, EROFS_BLKSIZ);
+		erofs_bupdate_mapped(bb);
+	}
+}
+
 bool erofs_bflush(struct erofs_buffer_block *bb)
 {
 	struct erofs_buffer_block *p, *n;
@@ -401,7 +435,7 @@ bool erofs_bflush(struct erofs_buffer_block *bb)
 
 		padding = EROFS_BLKSIZ - p->buffers.off % EROFS_BLKSIZ;
 		if (padding != EROFS_BLKSIZ)
-			dev_fillzero(blknr_to_addr(blkaddr) - padding,
+			dev_fillzero(&g_sbi, blknr_to_addr(blkaddr) - padding,
 				     padding, true);
 
 		DBG_BUGON(!list_empty(&p->buffers.list));
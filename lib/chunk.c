@@ -0,0 +1,197 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * erofs-utils/lib/chunk.c
+ *
+ * Uncompressed files are cut into fixed-size chunks, which are mapped by a
+ * block address array right after the inode. All-zero chunks are left as
+ * holes and chunks with the same data share their blocks.
+ */
+#include <stdlib.h>
+#include <unistd.h>
+#include "erofs/print.h"
+#include "erofs/cache.h"
+#include "erofs/io.h"
+#include "erofs/hashtable.h"
+#include "erofs/chunk.h"
+#include "sha256.h"
+
+#define EROFS_CHUNK_HASHTABLE_BITS	16
+
+/* a chunk written before, which later chunks with the same data refer to */
+struct erofs_chunk_item {
+	struct hlist_node node;
+
+	u8 digest[EROFS_SHA256_DIGEST_SIZE];
+	unsigned int length;
+	erofs_blk_t blkaddr;
+};
+
+static DECLARE_HASHTABLE(erofs_chunk_table, EROFS_CHUNK_HASHTABLE_BITS);
+
+static u64 erofs_chunk_key(const u8 *digest)
+{
+	u64 key;
+
+	memcpy(&key, digest, sizeof(key));
+	return key;
+}
+
+static struct erofs_chunk_item *erofs_chunk_lookup(const u8 *digest,
+						   unsigned int len)
+{
+	struct erofs_chunk_item *e;
+
+	hash_for_each_possible(erofs_chunk_table, e, node,
+			       erofs_chunk_key(digest))
+		if (e->length == len &&
+		    !memcmp(e->digest, digest, sizeof(e->digest)))
+			return e;
+	return NULL;
+}
+
+static int erofs_chunk_insert(const u8 *digest, unsigned int len,
+			      erofs_blk_t blkaddr)
+{
+	struct erofs_chunk_item *e = malloc(sizeof(*e));
+
+	if (!e)
+		return -ENOMEM;
+
+	memcpy(e->digest, digest, sizeof(e->digest));
+	e->length = len;
+	e->blkaddr = blkaddr;
+	hash_add(erofs_chunk_table, &e->node, erofs_chunk_key(e->digest));
+	return 0;
+}
+
+/* forget the chunks written from @blkaddr on, whose blocks are revoked */
+static void erofs_chunk_revoke(erofs_blk_t blkaddr)
+{
+	struct erofs_chunk_item *e;
+	struct hlist_node *tmp;
+	unsigned int bkt;
+
+	hash_for_each_safe(erofs_chunk_table, bkt, tmp, e, node) {
+		if (e->blkaddr < blkaddr)
+			continue;
+		hash_del(&e->node);
+		free(e);
+	}
+}
+
+static bool erofs_chunk_is_zero(const u8 *buf, unsigned int len)
+{
+	/* all bytes are equal to their next ones and the first one is 0 */
+	return !buf[0] && !memcmp(buf, buf + 1, len - 1);
+}
+
+int erofs_write_chunked_file(struct erofs_inode *inode, int fd)
+{
+	const unsigned int chunksize = 1U << cfg.c_chunkbits;
+	const unsigned int count = DIV_ROUND_UP(inode->i_size, chunksize);
+	erofs_off_t remaining = inode->i_size;
+	struct erofs_buffer_head *bh;
+	erofs_blk_t blkaddr, nblocks = 0;
+	unsigned int i;
+	__le32 *indexes;
+	u8 *buf;
+	int ret;
+
+	indexes = malloc(count * EROFS_BLOCK_MAP_ENTRY_SIZE);
+	if (!indexes)
+		return -ENOMEM;
+
+	buf = malloc(chunksize);
+	if (!buf) {
+		ret = -ENOMEM;
+		goto err_free;
+	}
+
+	/* allocate main data buffer */
+	bh = erofs_balloc(DATA, 0, 0, 0);
+	if (IS_ERR(bh)) {
+		ret = PTR_ERR(bh);
+		goto err_free;
+	}
+	blkaddr = erofs_mapbh(bh->block);
+
+	for (i = 0; i < count; ++i) {
+		const unsigned int len = min_t(erofs_off_t, remaining,
+					       chunksize);
+		u8 digest[EROFS_SHA256_DIGEST_SIZE];
+		struct erofs_chunk_item *e;
+
+		ret = erofs_read_sparse(fd, buf, len);
+		if (ret < 0)
+			goto err_bdrop;
+		remaining -= len;
+
+		/* leave a hole, which reads as zeroes */
+		if (ret == len || erofs_chunk_is_zero(buf, len)) {
+			indexes[i] = cpu_to_le32(NULL_ADDR);
+			continue;
+		}
+
+		erofs_sha256(buf, len, digest);
+		e = erofs_chunk_lookup(digest, len);
+		if (e) {
+			indexes[i] = cpu_to_le32(e->blkaddr);
+			continue;
+		}
+
+		/* the last chunk could end in the middle of a block */
+		memset(buf + len, 0, roundup(len, EROFS_BLKSIZ) - len);
+		ret = blk_write(&g_sbi, buf, blkaddr + nblocks,
+				BLK_ROUND_UP(len));
+		if (ret)
+			goto err_bdrop;
+
+		ret = erofs_chunk_insert(digest, len, blkaddr + nblocks);
+		if (ret)
+			goto err_bdrop;
+		indexes[i] = cpu_to_le32(blkaddr + nblocks);
+		nblocks += BLK_ROUND_UP(len);
+	}
+
+	if (nblocks) {
+		ret = erofs_bh_balloon(bh, blknr_to_addr(nblocks));
+		DBG_BUGON(ret != EROFS_BLKSIZ);
+		/* dropped in erofs_write_tail_end() as flat files do */
+		inode->bh_data = bh;
+	} else {
+		/* all chunks are holes or deduplicated */
+		erofs_bdrop(bh, true);
+	}
+	free(buf);
+
+	erofs_info("wrote %s (%llu bytes) as %u chunks in %u new blocks",
+		   inode->i_srcpath, (unsigned long long)inode->i_size,
+		   count, nblocks);
+
+	inode->datalayout = EROFS_INODE_CHUNK_BASED;
+	inode->u.chunkformat = cfg.c_chunkbits - LOG_BLOCK_SIZE;
+	inode->u.chunkbits = cfg.c_chunkbits;
+	inode->extent_isize = count * EROFS_BLOCK_MAP_ENTRY_SIZE;
+	inode->chunkindexes = indexes;
+	erofs_sb_set_chunked_file(&g_sbi);
+	return 0;
+
+err_bdrop:
+	erofs_chunk_revoke(blkaddr);
+	erofs_bdrop(bh, true);	/* revoke buffer */
+err_free:
+	free(buf);
+	free(indexes);
+	return ret;
+}
+
+int erofs_chunk_init(void)
+{
+	hash_init(erofs_chunk_table);
+	return 0;
+}
+
+void erofs_chunk_exit(void)
+{
+	erofs_chunk_revoke(0);
+}
@@ -17,6 +17,8 @@
 #include "erofs/io.h"
 #include "erofs/cache.h"
 #include "erofs/compress.h"
+#include "erofs/fragments.h"
+#include "erofs/dedupe.h"
 #include "compressor.h"
 
 static struct erofs_compress compresshandle;
@@ -24,6 +26,27 @@ static int compressionlevel;
 
 static unsigned int algorithmtype[2];
 
+struct z_erofs_compressindex_vec {
+	union {
+		erofs_blk_t blkaddr;
+		u16 delta[2];
+	} u;
+	u16 clusterofs;
+	u8  clustertype;
+};
+
+/* compacted indexes, which are encoded pack by pack while compressing */
+struct z_erofs_compacted_ctx {
+	struct z_erofs_compressindex_vec cv[16];
+	unsigned int nr;		/* indexes pending in cv[] */
+	unsigned int nidx;		/* indexes encoded so far */
+	/* # of indexes in each part, see z_erofs_init_compacted_indexes() */
+	unsigned int compacted_4b_initial, compacted_2b, compacted_4b_end;
+	unsigned int logical_clusterbits;
+	erofs_blk_t blkaddr;
+	bool dummy_head, big_pcluster;
+};
+
 struct z_erofs_vle_compress_ctx {
 	u8 *metacur;
 
@@ -31,41 +54,273 @@ struct z_erofs_vle_compress_ctx {
 	unsigned int head, tail;
 	unsigned int compressedblks;
 	erofs_blk_t blkaddr;		/* pointing to the next blkaddr */
+	unsigned int lclustersize;
 	u16 clusterofs;
+	bool tailraw;			/* the inline tail is uncompressed */
+
+	bool dedupe;			/* the file shares chunks with others */
+	bool dupnext;			/* a shared chunk starts at chunkcut */
+	unsigned int chunkend;		/* the end of the chunks scanned */
+	unsigned int chunkcut;		/* pclusters don't cross it */
+	unsigned int windowleft;	/* left in the fixed-size input window */
+	bool windowraw;			/* the window is incompressible */
+	struct z_erofs_dedupe_chunk chunk;
+
+	bool compacted;			/* encode compacted indexes at metacur */
+	struct z_erofs_compacted_ctx cc;
 };
 
 #define Z_EROFS_LEGACY_MAP_HEADER_SIZE	\
 	(sizeof(struct z_erofs_map_header) + Z_EROFS_VLE_LEGACY_HEADER_PADDING)
 
-static unsigned int vle_compressmeta_capacity(erofs_off_t filesize)
+static unsigned int vle_compressmeta_capacity(struct erofs_inode *inode,
+					      struct z_erofs_vle_compress_ctx *ctx)
 {
-	const unsigned int indexsize = BLK_ROUND_UP(filesize) *
-		sizeof(struct z_erofs_vle_decompressed_index);
+	const struct z_erofs_compacted_ctx *const cc = &ctx->cc;
+	unsigned int indexsize;
 
-	return Z_EROFS_LEGACY_MAP_HEADER_SIZE + indexsize;
+	if (!ctx->compacted) {
+		indexsize = BLK_ROUND_UP(inode->i_size) *
+			sizeof(struct z_erofs_vle_decompressed_index);
+		return Z_EROFS_LEGACY_MAP_HEADER_SIZE + indexsize;
+	}
+
+	/* the final compacted_4b_end pack could have only one index */
+	indexsize = cc->compacted_4b_initial * 4 + cc->compacted_2b * 2 +
+		round_up(cc->compacted_4b_end, 2) * 4;
+	return sizeof(struct z_erofs_map_header) + indexsize;
+}
+
+/*
+ * Skip to the next alignment boundary if @blks blocks would cross it, which
+ * only happens to windows of fixed-input mode, see z_erofs_pclustersize().
+ */
+static void z_erofs_align_pcluster(struct z_erofs_vle_compress_ctx *ctx,
+				   unsigned int blks)
+{
+	const unsigned int alignblks = cfg.c_pcluster_alignblks;
+	unsigned int left;
+
+	if (!alignblks)
+		return;
+	left = alignblks - ctx->blkaddr % alignblks;
+	if (blks > left) {
+		erofs_dbg("Skipping %u blocks at %u to align pclusters",
+			  left, ctx->blkaddr);
+		ctx->blkaddr += left;
+	}
+}
+
+static void *parse_legacy_indexes(struct z_erofs_compressindex_vec *cv,
+				  unsigned int nr, void *metacur)
+{
+	struct z_erofs_vle_decompressed_index *const db = metacur;
+	unsigned int i;
+
+	for (i = 0; i < nr; ++i, ++cv) {
+		struct z_erofs_vle_decompressed_index *const di = db + i;
+		const unsigned int advise = le16_to_cpu(di->di_advise);
+
+		cv->clustertype = (advise >> Z_EROFS_VLE_DI_CLUSTER_TYPE_BIT) &
+			((1 << Z_EROFS_VLE_DI_CLUSTER_TYPE_BITS) - 1);
+		cv->clusterofs = le16_to_cpu(di->di_clusterofs);
+
+		if (cv->clustertype == Z_EROFS_VLE_CLUSTER_TYPE_NONHEAD) {
+			cv->u.delta[0] = le16_to_cpu(di->di_u.delta[0]);
+			cv->u.delta[1] = le16_to_cpu(di->di_u.delta[1]);
+		} else {
+			cv->u.blkaddr = le32_to_cpu(di->di_u.blkaddr);
+		}
+	}
+	return db + nr;
+}
+
+static void *write_compacted_indexes(u8 *out,
+				     struct z_erofs_compressindex_vec *cv,
+				     erofs_blk_t *blkaddr_ret,
+				     unsigned int destsize,
+				     unsigned int logical_clusterbits,
+				     bool final, bool *dummy_head,
+				     bool big_pcluster)
+{
+	/* pclusters are counted in lclusters */
+	const unsigned int lclusterblks =
+		1 << (logical_clusterbits - LOG_BLOCK_SIZE);
+	unsigned int vcnt, encodebits, pos, i, cblks;
+	bool update_blkaddr;
+	erofs_blk_t blkaddr;
+
+	if (destsize == 4) {
+		vcnt = 2;
+	} else if (destsize == 2 && logical_clusterbits == 12) {
+		vcnt = 16;
+	} else {
+		return ERR_PTR(-EINVAL);
+	}
+	encodebits = (vcnt * destsize * 8 - 32) / vcnt;
+	blkaddr = *blkaddr_ret;
+	update_blkaddr = big_pcluster;
+
+	pos = 0;
+	for (i = 0; i < vcnt; ++i) {
+		unsigned int offset, v;
+		u8 ch, rem;
+
+		if (cv[i].clustertype == Z_EROFS_VLE_CLUSTER_TYPE_NONHEAD) {
+			if (cv[i].u.delta[0] & Z_EROFS_VLE_DI_D0_CBLKCNT) {
+				cblks = cv[i].u.delta[0] & ~Z_EROFS_VLE_DI_D0_CBLKCNT;
+				offset = cv[i].u.delta[0];
+				blkaddr += cblks * lclusterblks;
+				*dummy_head = false;
+			} else if (i + 1 == vcnt) {
+				offset = cv[i].u.delta[1];
+			} else {
+				offset = cv[i].u.delta[0];
+			}
+		} else {
+			offset = cv[i].clusterofs;
+			if (*dummy_head) {
+				blkaddr += lclusterblks;
+				if (update_blkaddr)
+					*blkaddr_ret = blkaddr;
+			}
+			*dummy_head = true;
+			update_blkaddr = false;
+
+			if (cv[i].u.blkaddr != blkaddr) {
+				if (i + 1 != vcnt)
+					DBG_BUGON(!final);
+				DBG_BUGON(cv[i].u.blkaddr);
+			}
+		}
+		v = (cv[i].clustertype << logical_clusterbits) | offset;
+		rem = pos & 7;
+		ch = out[pos / 8] & ((1 << rem) - 1);
+		out[pos / 8] = (v << rem) | ch;
+		out[pos / 8 + 1] = v >> (8 - rem);
+		out[pos / 8 + 2] = v >> (16 - rem);
+		pos += encodebits;
+	}
+	DBG_BUGON(destsize * vcnt * 8 != pos + 32);
+	*(__le32 *)(out + destsize * vcnt - 4) = cpu_to_le32(*blkaddr_ret);
+	*blkaddr_ret = blkaddr;
+	return out + destsize * vcnt;
+}
+
+static void z_erofs_init_compacted_indexes(struct erofs_inode *inode,
+					  struct z_erofs_vle_compress_ctx *ctx)
+{
+	const unsigned int mpos = Z_EROFS_VLE_EXTENT_ALIGN(inode->inode_isize +
+							   inode->xattr_isize) +
+				  sizeof(struct z_erofs_map_header);
+	/* each lcluster of the file takes an index */
+	const unsigned int totalidx = DIV_ROUND_UP(inode->i_size,
+						   ctx->lclustersize);
+	struct z_erofs_compacted_ctx *const cc = &ctx->cc;
+
+	cc->logical_clusterbits = inode->z_logical_clusterbits;
+	cc->big_pcluster = inode->z_advise & Z_EROFS_ADVISE_BIG_PCLUSTER_1;
+	/* # of 8-byte units so that it can be aligned with 32 bytes */
+	if (cc->logical_clusterbits == 12) {
+		cc->compacted_4b_initial = (32 - mpos % 32) / 4;
+		if (cc->compacted_4b_initial == 32 / 4)
+			cc->compacted_4b_initial = 0;
+
+		if (cc->compacted_4b_initial > totalidx) {
+			cc->compacted_4b_initial = cc->compacted_2b = 0;
+			cc->compacted_4b_end = totalidx;
+		} else {
+			cc->compacted_2b = rounddown(totalidx -
+						     cc->compacted_4b_initial, 16);
+			cc->compacted_4b_end = totalidx -
+				cc->compacted_4b_initial - cc->compacted_2b;
+		}
+	} else {
+		cc->compacted_2b = cc->compacted_4b_initial = 0;
+		cc->compacted_4b_end = totalidx;
+	}
+	cc->nr = cc->nidx = 0;
+
+	cc->blkaddr = ctx->blkaddr;
+	cc->dummy_head = false;
+	/* prior to bigpcluster, blkaddr was bumped up once coming into HEAD */
+	if (!cc->big_pcluster) {
+		cc->blkaddr -= 1 << (cc->logical_clusterbits - LOG_BLOCK_SIZE);
+		cc->dummy_head = true;
+	}
+}
+
+/* append an index, which is encoded once its compacted pack is complete */
+static void z_erofs_write_index(struct z_erofs_vle_compress_ctx *ctx,
+				struct z_erofs_vle_decompressed_index *di)
+{
+	struct z_erofs_compacted_ctx *const cc = &ctx->cc;
+	unsigned int destsize = 4, vcnt = 2;
+
+	if (!ctx->compacted) {
+		memcpy(ctx->metacur, di, sizeof(*di));
+		ctx->metacur += sizeof(*di);
+		return;
+	}
+
+	parse_legacy_indexes(cc->cv + cc->nr++, 1, di);
+	/* compacted_2b packs are in between the two compacted_4b parts */
+	if (cc->nidx >= cc->compacted_4b_initial &&
+	    cc->nidx < cc->compacted_4b_initial + cc->compacted_2b) {
+		destsize = 2;
+		vcnt = 16;
+	}
+	if (cc->nr < vcnt)
+		return;
+
+	ctx->metacur = write_compacted_indexes(ctx->metacur, cc->cv,
+					       &cc->blkaddr, destsize,
+					       cc->logical_clusterbits, false,
+					       &cc->dummy_head,
+					       cc->big_pcluster);
+	cc->nidx += vcnt;
+	cc->nr = 0;
 }
 
 static void vle_write_indexes_final(struct z_erofs_vle_compress_ctx *ctx)
 {
 	const unsigned int type = Z_EROFS_VLE_CLUSTER_TYPE_PLAIN;
+	struct z_erofs_compacted_ctx *const cc = &ctx->cc;
 	struct z_erofs_vle_decompressed_index di;
 
-	if (!ctx->clusterofs)
-		return;
+	if (ctx->clusterofs) {
+		di.di_clusterofs = cpu_to_le16(ctx->clusterofs);
+		di.di_u.blkaddr = 0;
+		di.di_advise = cpu_to_le16(type <<
+					   Z_EROFS_VLE_DI_CLUSTER_TYPE_BIT);
+		z_erofs_write_index(ctx, &di);
+	}
 
-	di.di_clusterofs = cpu_to_le16(ctx->clusterofs);
-	di.di_u.blkaddr = 0;
-	di.di_advise = cpu_to_le16(type << Z_EROFS_VLE_DI_CLUSTER_TYPE_BIT);
+	if (!ctx->compacted)
+		return;
 
-	memcpy(ctx->metacur, &di, sizeof(di));
-	ctx->metacur += sizeof(di);
+	/* generate final compacted_4b_end if needed */
+	if (cc->nr) {
+		DBG_BUGON(cc->nr != 1);
+		memset(cc->cv + 1, 0, sizeof(cc->cv[1]));
+		ctx->metacur = write_compacted_indexes(ctx->metacur, cc->cv,
+						       &cc->blkaddr, 4,
+						       cc->logical_clusterbits,
+						       true, &cc->dummy_head,
+						       cc->big_pcluster);
+		cc->nidx += cc->nr;
+		cc->nr = 0;
+	}
+	DBG_BUGON(cc->nidx != cc->compacted_4b_initial + cc->compacted_2b +
+			      cc->compacted_4b_end);
 }
 
 static void vle_write_indexes(struct z_erofs_vle_compress_ctx *ctx,
 			      unsigned int count, bool raw)
 {
+	const unsigned int lclustersize = ctx->lclustersize;
 	unsigned int clusterofs = ctx->clusterofs;
-	unsigned int d0 = 0, d1 = (clusterofs + count) / EROFS_BLKSIZ;
+	unsigned int d0 = 0, d1 = (clusterofs + count) / lclustersize;
 	struct z_erofs_vle_decompressed_index di;
 	unsigned int type;
 	__le16 advise;
@@ -80,8 +335,7 @@ static void vle_write_indexes(struct z_erofs_vle_compress_ctx *ctx,
 
 		di.di_advise = advise;
 		di.di_u.blkaddr = cpu_to_le32(ctx->blkaddr);
-		memcpy(ctx->metacur, &di, sizeof(di));
-		ctx->metacur += sizeof(di);
+		z_erofs_write_index(ctx, &di);
 
 		/* don't add the final index if the tail-end block exists */
 		ctx->clusterofs = 0;
@@ -90,9 +344,15 @@ static void vle_write_indexes(struct z_erofs_vle_compress_ctx *ctx,
 
 	do {
 		/* XXX: big pcluster feature should be per-inode */
-		if (d0 == 1 && cfg.c_physical_clusterblks > 1) {
+		if (d0 == 1 &&
+		    cfg.c_physical_clusterblks * EROFS_BLKSIZ > lclustersize) {
+			/* CBLKCNT is counted in lclusters */
+			const unsigned int compressedlcs =
+				DIV_ROUND_UP(ctx->compressedblks * EROFS_BLKSIZ,
+					     lclustersize);
+
 			type = Z_EROFS_VLE_CLUSTER_TYPE_NONHEAD;
-			di.di_u.delta[0] = cpu_to_le16(ctx->compressedblks |
+			di.di_u.delta[0] = cpu_to_le16(compressedlcs |
 					Z_EROFS_VLE_DI_D0_CBLKCNT);
 			di.di_u.delta[1] = cpu_to_le16(d1);
 		} else if (d0) {
@@ -108,338 +368,426 @@ static void vle_write_indexes(struct z_erofs_vle_compress_ctx *ctx,
 		advise = cpu_to_le16(type << Z_EROFS_VLE_DI_CLUSTER_TYPE_BIT);
 		di.di_advise = advise;
 
-		memcpy(ctx->metacur, &di, sizeof(di));
-		ctx->metacur += sizeof(di);
+		z_erofs_write_index(ctx, &di);
 
-		count -= EROFS_BLKSIZ - clusterofs;
+		count -= lclustersize - clusterofs;
 		clusterofs = 0;
 
 		++d0;
 		--d1;
-	} while (clusterofs + count >= EROFS_BLKSIZ);
+	} while (clusterofs + count >= lclustersize);
 
 	ctx->clusterofs = clusterofs + count;
 }
 
-static int write_uncompressed_extent(struct z_erofs_vle_compress_ctx *ctx,
-				     unsigned int *len, char *dst)
+/* keep the tail pcluster in idata so that it can be inlined later */
+static int z_erofs_fill_inline_data(struct erofs_inode *inode,
+				    struct z_erofs_vle_compress_ctx *ctx,
+				    void *data, unsigned int len, bool raw)
+{
+	DBG_BUGON(inode->idata || len >= EROFS_BLKSIZ);
+	inode->idata = malloc(len);
+	if (!inode->idata)
+		return -ENOMEM;
+	memcpy(inode->idata, data, len);
+	inode->idata_size = len;
+	inode->z_advise |= Z_EROFS_ADVISE_INLINE_PCLUSTER;
+	ctx->tailraw = raw;
+	erofs_dbg("Inlining %u %s tail data of %s", len,
+		  raw ? "uncompressed" : "compressed", inode->i_srcpath);
+	return len;
+}
+
+static int write_uncompressed_extent(struct erofs_inode *inode,
+				     struct z_erofs_vle_compress_ctx *ctx,
+				     unsigned int *len, char *dst,
+				     bool may_inline)
 {
 	int ret;
 	unsigned int count;
 
 	/* reset clusterofs to 0 if permitted */
-	if (!erofs_sb_has_lz4_0padding() &&
+	if (!erofs_sb_has_lz4_0padding(&g_sbi) &&
 	    ctx->head >= ctx->clusterofs) {
 		ctx->head -= ctx->clusterofs;
 		*len += ctx->clusterofs;
 		ctx->clusterofs = 0;
 	}
 
-	/* write uncompressed data */
-	count = min(EROFS_BLKSIZ, *len);
+	if (may_inline && *len < EROFS_BLKSIZ)
+		return z_erofs_fill_inline_data(inode, ctx,
+						ctx->queue + ctx->head,
+						*len, true);
+
+	/* write uncompressed data, which takes a whole lcluster */
+	count = min(ctx->lclustersize, *len);
 
 	memcpy(dst, ctx->queue + ctx->head, count);
-	memset(dst + count, 0, EROFS_BLKSIZ - count);
+	memset(dst + count, 0, ctx->lclustersize - count);
 
 	erofs_dbg("Writing %u uncompressed data to block %u",
 		  count, ctx->blkaddr);
-	ret = blk_write(dst, ctx->blkaddr, 1);
+	ret = blk_write(&g_sbi, dst, ctx->blkaddr,
+			ctx->lclustersize / EROFS_BLKSIZ);
 	if (ret)
 		return ret;
 	return count;
 }
 
+/* whether the tail of @inode, which is @len bytes, can be packed or not */
+static bool z_erofs_may_pack_fragments(struct erofs_inode *inode,
+				       unsigned int len)
+{
+	if (!cfg.c_fragments || erofs_is_packed_inode(inode))
+		return false;
+	/* whole-file fragments and legacy indexes keep 64-bit offsets */
+	if (len == inode->i_size ||
+	    inode->datalayout == EROFS_INODE_FLAT_COMPRESSION_LEGACY)
+		return true;
+	return z_erofs_fragments_tell() <= UINT32_MAX;
+}
+
 /* TODO: apply per-(sub)file strategies here */
 static unsigned int z_erofs_get_max_pclusterblks(struct erofs_inode *inode)
 {
 #ifndef NDEBUG
-	if (cfg.c_random_pclusterblks)
-		return 1 + rand() % cfg.c_physical_clusterblks;
+	if (cfg.c_random_pclusterblks) {
+		const unsigned int lclusterblks =
+			1 << (inode->z_logical_clusterbits - LOG_BLOCK_SIZE);
+
+		return (1 + rand() % (cfg.c_physical_clusterblks /
+				      lclusterblks)) * lclusterblks;
+	}
 #endif
 	return cfg.c_physical_clusterblks;
 }
 
+/*
+ * Get the max size of the next pcluster. Pclusters are shrunk to end at
+ * the next alignment boundary rather than leaving a gap before it, which
+ * is at least an lcluster away since pclusters start at lcluster boundaries.
+ */
+static unsigned int z_erofs_pclustersize(struct erofs_inode *inode,
+					 struct z_erofs_vle_compress_ctx *ctx)
+{
+	const unsigned int alignblks = cfg.c_pcluster_alignblks;
+	unsigned int pclustersize =
+		z_erofs_get_max_pclusterblks(inode) * EROFS_BLKSIZ;
+
+	/* fixed-size windows aren't cut, they skip to the boundary instead */
+	if (!alignblks || cfg.c_fixed_inputsize)
+		return pclustersize;
+	return min(pclustersize,
+		   (alignblks - ctx->blkaddr % alignblks) * EROFS_BLKSIZ);
+}
+
+/* refer to the pclusters of the same data as the shared chunk at ctx->head */
+static int z_erofs_dedupe_start_chunk(struct erofs_inode *inode,
+				      struct z_erofs_vle_compress_ctx *ctx)
+{
+	const struct z_erofs_dedupe_item *e;
+	const erofs_blk_t blkaddr = ctx->blkaddr;
+	unsigned int i;
+
+	ctx->dupnext = false;
+	ctx->chunkcut = ctx->chunkend;
+	e = z_erofs_dedupe_match(&ctx->chunk);
+	if (!e) {
+		/* the first one, record its pclusters for the others */
+		ctx->chunk.nr = 0;
+		return 0;
+	}
+
+	/* chunks start at block boundaries */
+	DBG_BUGON(ctx->clusterofs);
+	for (i = 0; i < e->nr; ++i) {
+		const struct z_erofs_dedupe_pcluster *pc = &e->pcs[i];
+
+		if (pc->clusterofs_reset) {
+			ctx->head -= ctx->clusterofs;
+			ctx->clusterofs = 0;
+		}
+		ctx->head += pc->count;
+		ctx->blkaddr = pc->blkaddr;
+		ctx->compressedblks = pc->compressedblks;
+		vle_write_indexes(ctx, pc->count, pc->raw);
+	}
+	ctx->blkaddr = blkaddr;
+	DBG_BUGON(ctx->head != ctx->chunkend);
+
+	erofs_dbg("Deduplicating %u bytes of %s with %u pclusters at %u",
+		  e->length, inode->i_srcpath, e->nr, e->pcs[0].blkaddr);
+	return 1;
+}
+
+/*
+ * Cut pclusters only at the boundaries of chunks which occur more than once
+ * in the image, so that the others keep the compression ratio. Scan the
+ * chunks ahead of ctx->head for the next such chunk, or deal with the one
+ * starting at ctx->head. Return 1 if indexes referring to the pclusters of
+ * the same data are written, 0 if data up to ctx->chunkcut (or at most to
+ * ctx->chunkend if it's not ahead) should be compressed, or -EAGAIN if more
+ * data is needed.
+ */
+static int z_erofs_dedupe_begin_chunk(struct erofs_inode *inode,
+				      struct z_erofs_vle_compress_ctx *ctx,
+				      bool final)
+{
+	unsigned int len;
+
+	if (ctx->head < ctx->chunkcut)
+		return 0;
+	if (ctx->dupnext)
+		return z_erofs_dedupe_start_chunk(inode, ctx);
+
+	while (ctx->chunkend < ctx->tail) {
+		len = z_erofs_dedupe_chunksize(ctx->queue + ctx->chunkend,
+					       ctx->tail - ctx->chunkend, final);
+		if (!len)
+			break;
+		ctx->chunkend += len;
+		if (!z_erofs_dedupe_chunk_is_shared(&ctx->chunk,
+				ctx->queue + ctx->chunkend - len, len))
+			continue;
+
+		ctx->dupnext = true;
+		ctx->chunkcut = ctx->chunkend - len;
+		if (ctx->head == ctx->chunkcut)
+			return z_erofs_dedupe_start_chunk(inode, ctx);
+		return 0;
+	}
+	return ctx->head < ctx->chunkend ? 0 : -EAGAIN;
+}
+
+/* record the pcluster just written for the current dedupe chunk */
+static int z_erofs_dedupe_record(struct erofs_inode *inode,
+				 struct z_erofs_vle_compress_ctx *ctx,
+				 unsigned int count, bool raw,
+				 bool clusterofs_reset)
+{
+	struct z_erofs_dedupe_chunk *const chunk = &ctx->chunk;
+	int ret;
+
+	if (chunk->nr < 0)
+		return 0;
+
+	/* the inline pcluster and the fragment cannot be referred to */
+	if (inode->idata_size || inode->fragment_size ||
+	    chunk->nr >= ARRAY_SIZE(chunk->pcs)) {
+		chunk->nr = -1;
+		return 0;
+	}
+
+	chunk->pcs[chunk->nr++] = (struct z_erofs_dedupe_pcluster) {
+		.blkaddr = ctx->blkaddr,
+		.compressedblks = ctx->compressedblks,
+		.count = count,
+		.raw = raw,
+		.clusterofs_reset = clusterofs_reset,
+	};
+	if (ctx->head < ctx->chunkend)
+		return 0;
+
+	DBG_BUGON(ctx->head != ctx->chunkend);
+	ret = z_erofs_dedupe_insert(chunk);
+	chunk->nr = -1;
+	return ret;
+}
+
 static int vle_compress_one(struct erofs_inode *inode,
 			    struct z_erofs_vle_compress_ctx *ctx,
 			    bool final)
 {
 	struct erofs_compress *const h = &compresshandle;
-	unsigned int len = ctx->tail - ctx->head;
 	unsigned int count;
 	int ret;
-	static char dstbuf[EROFS_CONFIG_COMPR_MAX_SZ + EROFS_BLKSIZ];
-	char *const dst = dstbuf + EROFS_BLKSIZ;
+	/*
+	 * pclusters are up to Z_EROFS_PCLUSTER_MAX_SIZE, and leave room for
+	 * the 0padding of a whole lcluster.
+	 */
+	static char dstbuf[Z_EROFS_PCLUSTER_MAX_SIZE +
+			   Z_EROFS_LCLUSTER_MAX_SIZE];
+	char *const dst = dstbuf + Z_EROFS_LCLUSTER_MAX_SIZE;
 
-	while (len) {
+	while (ctx->head < ctx->tail) {
 		const unsigned int pclustersize =
-			z_erofs_get_max_pclusterblks(inode) * EROFS_BLKSIZ;
-		bool raw;
+			z_erofs_pclustersize(inode, ctx);
+		const unsigned int head = ctx->head;
+		unsigned int len = ctx->tail - ctx->head;
+		/* whether the data to compress reaches the end of file */
+		bool tail = final;
+		bool raw, may_inline = false, cut = false;
+
+		if (ctx->dedupe) {
+			unsigned int end;
+
+			ret = z_erofs_dedupe_begin_chunk(inode, ctx, final);
+			if (ret == -EAGAIN)
+				break;
+			if (ret < 0)
+				return ret;
+			if (ret)
+				continue;
+
+			/* pclusters never cross shared chunks */
+			cut = ctx->head < ctx->chunkcut;
+			end = cut ? ctx->chunkcut : ctx->chunkend;
+			if (end < ctx->tail) {
+				len = end - ctx->head;
+				tail = false;
+			}
+		}
 
 		if (len <= pclustersize) {
-			if (final) {
-				if (len <= EROFS_BLKSIZ)
-					goto nocompression;
-			} else {
+			if (!final && !cut)
 				break;
+			/* the last pcluster could be packed or inlined */
+			if (tail && z_erofs_may_pack_fragments(inode, len)) {
+				ret = z_erofs_pack_fragments(inode,
+						ctx->queue + ctx->head, len);
+				if (ret < 0)
+					return ret;
+				count = ret;
+				ctx->compressedblks = 1;
+				raw = false;
+				goto write_indexes;
 			}
+			may_inline = tail && cfg.c_ztailpacking;
+			if (!may_inline && len <= ctx->lclustersize)
+				goto nocompression;
 		}
 
 		count = min(len, cfg.c_max_decompressed_extent_bytes);
-		ret = erofs_compress_destsize(h, compressionlevel,
-					      ctx->queue + ctx->head,
-					      &count, dst, pclustersize);
+		if (cfg.c_fixed_inputsize) {
+			/* compress the rest of the window as a whole */
+			if (!ctx->windowleft) {
+				ctx->windowleft = cfg.c_fixed_inputsize;
+				ctx->windowraw = false;
+			}
+			/* don't compress the rest of a window which failed */
+			if (ctx->windowraw)
+				goto nocompression;
+			count = min(count, ctx->windowleft);
+			ret = erofs_compress(h, compressionlevel,
+					     ctx->queue + ctx->head, count,
+					     dst, pclustersize, !may_inline);
+		} else {
+			ret = erofs_compress_destsize(h, compressionlevel,
+						      ctx->queue + ctx->head,
+						      &count, dst,
+						      pclustersize,
+						      !may_inline);
+		}
+		/* not the last pcluster, it has to save blocks */
+		if (ret > 0 && may_inline &&
+		    (count < len || ret >= EROFS_BLKSIZ))
+			may_inline = false;
+		/* pclusters take whole lclusters, which should save space */
+		if (ret > 0 && !may_inline &&
+		    roundup(ret, ctx->lclustersize) >= count)
+			ret = -EAGAIN;
+
 		if (ret <= 0) {
 			if (ret != -EAGAIN) {
 				erofs_err("failed to compress %s: %s",
 					  inode->i_srcpath,
 					  erofs_strerror(ret));
 			}
+			/* store the whole window raw lcluster by lcluster */
+			ctx->windowraw = cfg.c_fixed_inputsize;
 nocompression:
-			ret = write_uncompressed_extent(ctx, &len, dst);
+			ret = write_uncompressed_extent(inode, ctx, &len, dst,
+							may_inline);
 			if (ret < 0)
 				return ret;
 			count = ret;
-			ctx->compressedblks = 1;
+			ctx->compressedblks = ctx->lclustersize / EROFS_BLKSIZ;
 			raw = true;
+		} else if (may_inline) {
+			ret = z_erofs_fill_inline_data(inode, ctx, dst, ret,
+						       false);
+			if (ret < 0)
+				return ret;
+			ctx->compressedblks = 1;
+			raw = false;
 		} else {
-			const unsigned int tailused = ret & (EROFS_BLKSIZ - 1);
+			const unsigned int lclustersize = ctx->lclustersize;
+			const unsigned int tailused = ret & (lclustersize - 1);
 			const unsigned int padding =
-				erofs_sb_has_lz4_0padding() && tailused ?
-					EROFS_BLKSIZ - tailused : 0;
+				erofs_sb_has_lz4_0padding(&g_sbi) && tailused ?
+					lclustersize - tailused : 0;
 
-			ctx->compressedblks = DIV_ROUND_UP(ret, EROFS_BLKSIZ);
+			ctx->compressedblks = roundup(ret, lclustersize) /
+				EROFS_BLKSIZ;
 			DBG_BUGON(ctx->compressedblks * EROFS_BLKSIZ >= count);
 
 			/* zero out garbage trailing data for non-0padding */
-			if (!erofs_sb_has_lz4_0padding())
+			if (!erofs_sb_has_lz4_0padding(&g_sbi))
 				memset(dst + ret, 0,
-				       roundup(ret, EROFS_BLKSIZ) - ret);
+				       roundup(ret, lclustersize) - ret);
 
 			/* write compressed data */
+			z_erofs_align_pcluster(ctx, ctx->compressedblks);
 			erofs_dbg("Writing %u compressed data to %u of %u blocks",
 				  count, ctx->blkaddr, ctx->compressedblks);
 
-			ret = blk_write(dst - padding, ctx->blkaddr,
+			ret = blk_write(&g_sbi, dst - padding, ctx->blkaddr,
 					ctx->compressedblks);
 			if (ret)
 				return ret;
 			raw = false;
 		}
 
+write_indexes:
 		ctx->head += count;
+		/* raw pclusters take lclusters of the window one by one */
+		if (cfg.c_fixed_inputsize)
+			ctx->windowleft -= min(count, ctx->windowleft);
 		/* write compression indexes for this pcluster */
-		vle_write_indexes(ctx, count, raw);
-
-		ctx->blkaddr += ctx->compressedblks;
-		len -= count;
-
-		if (!final && ctx->head >= EROFS_CONFIG_COMPR_MAX_SZ) {
-			const unsigned int qh_aligned =
-				round_down(ctx->head, EROFS_BLKSIZ);
-			const unsigned int qh_after = ctx->head - qh_aligned;
-
-			memmove(ctx->queue, ctx->queue + qh_aligned,
-				len + qh_after);
-			ctx->head = qh_after;
-			ctx->tail = qh_after + len;
-			break;
-		}
-	}
-	return 0;
-}
-
-struct z_erofs_compressindex_vec {
-	union {
-		erofs_blk_t blkaddr;
-		u16 delta[2];
-	} u;
-	u16 clusterofs;
-	u8  clustertype;
-};
-
-static void *parse_legacy_indexes(struct z_erofs_compressindex_vec *cv,
-				  unsigned int nr, void *metacur)
-{
-	struct z_erofs_vle_decompressed_index *const db = metacur;
-	unsigned int i;
-
-	for (i = 0; i < nr; ++i, ++cv) {
-		struct z_erofs_vle_decompressed_index *const di = db + i;
-		const unsigned int advise = le16_to_cpu(di->di_advise);
-
-		cv->clustertype = (advise >> Z_EROFS_VLE_DI_CLUSTER_TYPE_BIT) &
-			((1 << Z_EROFS_VLE_DI_CLUSTER_TYPE_BITS) - 1);
-		cv->clusterofs = le16_to_cpu(di->di_clusterofs);
-
-		if (cv->clustertype == Z_EROFS_VLE_CLUSTER_TYPE_NONHEAD) {
-			cv->u.delta[0] = le16_to_cpu(di->di_u.delta[0]);
-			cv->u.delta[1] = le16_to_cpu(di->di_u.delta[1]);
-		} else {
-			cv->u.blkaddr = le32_to_cpu(di->di_u.blkaddr);
-		}
-	}
-	return db + nr;
-}
-
-static void *write_compacted_indexes(u8 *out,
-				     struct z_erofs_compressindex_vec *cv,
-				     erofs_blk_t *blkaddr_ret,
-				     unsigned int destsize,
-				     unsigned int logical_clusterbits,
-				     bool final, bool *dummy_head)
-{
-	unsigned int vcnt, encodebits, pos, i, cblks;
-	bool update_blkaddr;
-	erofs_blk_t blkaddr;
-
-	if (destsize == 4) {
-		vcnt = 2;
-	} else if (destsize == 2 && logical_clusterbits == 12) {
-		vcnt = 16;
-	} else {
-		return ERR_PTR(-EINVAL);
-	}
-	encodebits = (vcnt * destsize * 8 - 32) / vcnt;
-	blkaddr = *blkaddr_ret;
-	update_blkaddr = erofs_sb_has_big_pcluster();
-
-	pos = 0;
-	for (i = 0; i < vcnt; ++i) {
-		unsigned int offset, v;
-		u8 ch, rem;
-
-		if (cv[i].clustertype == Z_EROFS_VLE_CLUSTER_TYPE_NONHEAD) {
-			if (cv[i].u.delta[0] & Z_EROFS_VLE_DI_D0_CBLKCNT) {
-				cblks = cv[i].u.delta[0] & ~Z_EROFS_VLE_DI_D0_CBLKCNT;
-				offset = cv[i].u.delta[0];
-				blkaddr += cblks;
-				*dummy_head = false;
-			} else if (i + 1 == vcnt) {
-				offset = cv[i].u.delta[1];
-			} else {
-				offset = cv[i].u.delta[0];
-			}
+		if (inode->fragment_size &&
+		    inode->datalayout == EROFS_INODE_FLAT_COMPRESSION_LEGACY) {
+			const erofs_blk_t blkaddr = ctx->blkaddr;
+
+			/* the HEAD keeps the high 32 bits of fragmentoff */
+			ctx->blkaddr = inode->fragmentoff >> 32;
+			vle_write_indexes(ctx, count, raw);
+			ctx->blkaddr = blkaddr;
 		} else {
-			offset = cv[i].clusterofs;
-			if (*dummy_head) {
-				++blkaddr;
-				if (update_blkaddr)
-					*blkaddr_ret = blkaddr;
-			}
-			*dummy_head = true;
-			update_blkaddr = false;
-
-			if (cv[i].u.blkaddr != blkaddr) {
-				if (i + 1 != vcnt)
-					DBG_BUGON(!final);
-				DBG_BUGON(cv[i].u.blkaddr);
-			}
+			vle_write_indexes(ctx, count, raw);
 		}
-		v = (cv[i].clustertype << logical_clusterbits) | offset;
-		rem = pos & 7;
-		ch = out[pos / 8] & ((1 << rem) - 1);
-		out[pos / 8] = (v << rem) | ch;
-		out[pos / 8 + 1] = v >> (8 - rem);
-		out[pos / 8 + 2] = v >> (16 - rem);
-		pos += encodebits;
-	}
-	DBG_BUGON(destsize * vcnt * 8 != pos + 32);
-	*(__le32 *)(out + destsize * vcnt - 4) = cpu_to_le32(*blkaddr_ret);
-	*blkaddr_ret = blkaddr;
-	return out + destsize * vcnt;
-}
 
-int z_erofs_convert_to_compacted_format(struct erofs_inode *inode,
-					erofs_blk_t blkaddr,
-					unsigned int legacymetasize,
-					void *compressmeta)
-{
-	const unsigned int mpos = Z_EROFS_VLE_EXTENT_ALIGN(inode->inode_isize +
-							   inode->xattr_isize) +
-				  sizeof(struct z_erofs_map_header);
-	const unsigned int totalidx = (legacymetasize -
-				       Z_EROFS_LEGACY_MAP_HEADER_SIZE) / 8;
-	const unsigned int logical_clusterbits = inode->z_logical_clusterbits;
-	u8 *out, *in;
-	struct z_erofs_compressindex_vec cv[16];
-	/* # of 8-byte units so that it can be aligned with 32 bytes */
-	unsigned int compacted_4b_initial, compacted_4b_end;
-	unsigned int compacted_2b;
-	bool dummy_head;
-
-	if (logical_clusterbits < LOG_BLOCK_SIZE || LOG_BLOCK_SIZE < 12)
-		return -EINVAL;
-	if (logical_clusterbits > 14)	/* currently not supported */
-		return -ENOTSUP;
-	if (logical_clusterbits == 12) {
-		compacted_4b_initial = (32 - mpos % 32) / 4;
-		if (compacted_4b_initial == 32 / 4)
-			compacted_4b_initial = 0;
-
-		if (compacted_4b_initial > totalidx) {
-			compacted_4b_initial = compacted_2b = 0;
-			compacted_4b_end = totalidx;
-		} else {
-			compacted_2b = rounddown(totalidx -
-						 compacted_4b_initial, 16);
-			compacted_4b_end = totalidx - compacted_4b_initial -
-					   compacted_2b;
+		if (ctx->dedupe) {
+			ret = z_erofs_dedupe_record(inode, ctx, count, raw,
+						    ctx->head - count < head);
+			if (ret)
+				return ret;
 		}
-	} else {
-		compacted_2b = compacted_4b_initial = 0;
-		compacted_4b_end = totalidx;
-	}
-
-	out = in = compressmeta;
 
-	out += sizeof(struct z_erofs_map_header);
-	in += Z_EROFS_LEGACY_MAP_HEADER_SIZE;
+		/*
+		 * the inline pcluster and the fragment take the next blkaddr
+		 * only nominally.
+		 */
+		if (!inode->idata_size && !inode->fragment_size)
+			ctx->blkaddr += ctx->compressedblks;
 
-	dummy_head = false;
-	/* prior to bigpcluster, blkaddr was bumped up once coming into HEAD */
-	if (!erofs_sb_has_big_pcluster()) {
-		--blkaddr;
-		dummy_head = true;
-	}
-
-	/* generate compacted_4b_initial */
-	while (compacted_4b_initial) {
-		in = parse_legacy_indexes(cv, 2, in);
-		out = write_compacted_indexes(out, cv, &blkaddr,
-					      4, logical_clusterbits, false,
-					      &dummy_head);
-		compacted_4b_initial -= 2;
-	}
-	DBG_BUGON(compacted_4b_initial);
-
-	/* generate compacted_2b */
-	while (compacted_2b) {
-		in = parse_legacy_indexes(cv, 16, in);
-		out = write_compacted_indexes(out, cv, &blkaddr,
-					      2, logical_clusterbits, false,
-					      &dummy_head);
-		compacted_2b -= 16;
+		if (!final && ctx->head >= EROFS_CONFIG_COMPR_MAX_SZ)
+			break;
 	}
-	DBG_BUGON(compacted_2b);
 
-	/* generate compacted_4b_end */
-	while (compacted_4b_end > 1) {
-		in = parse_legacy_indexes(cv, 2, in);
-		out = write_compacted_indexes(out, cv, &blkaddr,
-					      4, logical_clusterbits, false,
-					      &dummy_head);
-		compacted_4b_end -= 2;
+	/* a full queue has to be moved as well if it waits for more data */
+	if (!final && (ctx->head >= EROFS_CONFIG_COMPR_MAX_SZ ||
+		       ctx->tail == sizeof(ctx->queue))) {
+		const unsigned int qh_aligned =
+			round_down(ctx->head, ctx->lclustersize);
+		const unsigned int qh_after = ctx->head - qh_aligned;
+		const unsigned int len = ctx->tail - ctx->head;
+
+		memmove(ctx->queue, ctx->queue + qh_aligned, len + qh_after);
+		ctx->head = qh_after;
+		ctx->tail = qh_after + len;
+		ctx->chunkend -= min(ctx->chunkend, qh_aligned);
+		ctx->chunkcut -= min(ctx->chunkcut, qh_aligned);
 	}
-
-	/* generate final compacted_4b_end if needed */
-	if (compacted_4b_end) {
-		memset(cv, 0, sizeof(cv));
-		in = parse_legacy_indexes(cv, 1, in);
-		out = write_compacted_indexes(out, cv, &blkaddr,
-					      4, logical_clusterbits, true,
-					      &dummy_head);
-	}
-	inode->extent_isize = out - (u8 *)compressmeta;
 	return 0;
 }
 
@@ -451,76 +799,148 @@ static void z_erofs_write_mapheader(struct erofs_inode *inode,
 		.h_algorithmtype = inode->z_algorithmtype[1] << 4 |
 				   inode->z_algorithmtype[0],
 		/* lclustersize */
-		.h_clusterbits = inode->z_logical_clusterbits - 12,
+		.h_clusterbits = inode->z_logical_clusterbits - LOG_BLOCK_SIZE,
 	};
 
-	memset(compressmeta, 0, Z_EROFS_LEGACY_MAP_HEADER_SIZE);
+	/* the whole file is a fragment, only keep its 63-bit offset */
+	if (inode->fragment_size == inode->i_size) {
+		*(__le64 *)compressmeta =
+			cpu_to_le64(inode->fragmentoff | 1ULL << 63);
+		return;
+	}
+
+	if (inode->fragment_size)
+		h.h_fragmentoff = cpu_to_le32(inode->fragmentoff);
+	else
+		h.h_idata_size = cpu_to_le16(inode->idata_size);
+
 	/* write out map header */
 	memcpy(compressmeta, &h, sizeof(struct z_erofs_map_header));
 }
 
-int erofs_write_compressed_file(struct erofs_inode *inode)
+/* write the tail pcluster into a block if it can't be inlined after all */
+static int z_erofs_write_tail_pcluster(struct erofs_inode *inode,
+				       struct z_erofs_vle_compress_ctx *ctx)
+{
+	const unsigned int lclustersize = ctx->lclustersize;
+	unsigned int padding = 0;
+	char *buf;
+	int ret;
+
+	/* 0padding compressed data should end at the pcluster end */
+	if (!ctx->tailraw && erofs_sb_has_lz4_0padding(&g_sbi))
+		padding = lclustersize - inode->idata_size;
+
+	/* the pcluster takes a whole lcluster as the others do */
+	buf = calloc(1, lclustersize);
+	if (!buf)
+		return -ENOMEM;
+	memcpy(buf + padding, inode->idata, inode->idata_size);
+	ret = blk_write(&g_sbi, buf, ctx->blkaddr,
+			lclustersize / EROFS_BLKSIZ);
+	free(buf);
+	if (ret)
+		return ret;
+	ctx->blkaddr += lclustersize / EROFS_BLKSIZ;
+
+	free(inode->idata);
+	inode->idata = NULL;
+	inode->idata_size = 0;
+	inode->z_advise &= ~Z_EROFS_ADVISE_INLINE_PCLUSTER;
+	return 0;
+}
+
+int erofs_write_compressed_file(struct erofs_inode *inode, int fd)
 {
 	struct erofs_buffer_head *bh;
 	struct z_erofs_vle_compress_ctx ctx;
 	erofs_off_t remaining;
 	erofs_blk_t blkaddr, compressed_blocks;
-	unsigned int legacymetasize;
-	int ret, fd;
-
-	u8 *compressmeta = malloc(vle_compressmeta_capacity(inode->i_size));
-	if (!compressmeta)
-		return -ENOMEM;
-
-	fd = open(inode->i_srcpath, O_RDONLY | O_BINARY);
-	if (fd < 0) {
-		ret = -errno;
-		goto err_free;
-	}
+	unsigned int inodesize, padding = 0;
+	bool big_pcluster;
+	u8 *compressmeta;
+	int ret;
 
 	/* allocate main data buffer */
 	bh = erofs_balloc(DATA, 0, 0, 0);
-	if (IS_ERR(bh)) {
-		ret = PTR_ERR(bh);
-		goto err_close;
-	}
+	if (IS_ERR(bh))
+		return PTR_ERR(bh);
 
 	/* initialize per-file compression setting */
 	inode->z_advise = 0;
-	if (!cfg.c_legacy_compress) {
-		inode->z_advise |= Z_EROFS_ADVISE_COMPACTED_2B;
+	inode->z_logical_clusterbits = cfg.c_lclusterbits;
+	ctx.lclustersize = 1U << inode->z_logical_clusterbits;
+	/* CBLKCNT is only needed if pclusters can take several lclusters */
+	big_pcluster = cfg.c_physical_clusterblks * EROFS_BLKSIZ >
+		ctx.lclustersize;
+	/* only files sharing chunks with others are deduplicated */
+	ctx.dedupe = cfg.c_dedupe &&
+		z_erofs_dedupe_file_is_shared(inode->dev, inode->i_ino[1]);
+	/*
+	 * compacted indexes can't refer to pclusters of other chunks, they
+	 * have no room for clusterofs of lclusters larger than 16KiB, and
+	 * CBLKCNT doesn't fit in those of lclusters smaller than 4KiB. Also,
+	 * they can't skip blocks between pclusters for fixed-input mode.
+	 */
+	if (!cfg.c_legacy_compress && !ctx.dedupe &&
+	    !(cfg.c_pcluster_alignblks && cfg.c_fixed_inputsize) &&
+	    inode->z_logical_clusterbits <= 14 &&
+	    (inode->z_logical_clusterbits >= 12 || !big_pcluster)) {
+		/* compacted_2b is only available for 4KiB lclusters */
+		if (inode->z_logical_clusterbits == 12)
+			inode->z_advise |= Z_EROFS_ADVISE_COMPACTED_2B;
 		inode->datalayout = EROFS_INODE_FLAT_COMPRESSION;
 	} else {
 		inode->datalayout = EROFS_INODE_FLAT_COMPRESSION_LEGACY;
 	}
 
-	if (cfg.c_physical_clusterblks > 1) {
+	if (big_pcluster) {
 		inode->z_advise |= Z_EROFS_ADVISE_BIG_PCLUSTER_1;
 		if (inode->datalayout == EROFS_INODE_FLAT_COMPRESSION)
 			inode->z_advise |= Z_EROFS_ADVISE_BIG_PCLUSTER_2;
 	}
 	inode->z_algorithmtype[0] = algorithmtype[0];
 	inode->z_algorithmtype[1] = algorithmtype[1];
-	inode->z_logical_clusterbits = LOG_BLOCK_SIZE;
-
-	z_erofs_write_mapheader(inode, compressmeta);
 
 	blkaddr = erofs_mapbh(bh->block);	/* start_blkaddr */
-	ctx.blkaddr = blkaddr;
-	ctx.metacur = compressmeta + Z_EROFS_LEGACY_MAP_HEADER_SIZE;
+	/* start at an lcluster boundary so that aligned pclusters end there */
+	if (cfg.c_pcluster_alignblks)
+		padding = roundup(blkaddr, ctx.lclustersize / EROFS_BLKSIZ) -
+			blkaddr;
+	ctx.blkaddr = blkaddr + padding;
+
+	/* compacted indexes are encoded directly rather than converted */
+	ctx.compacted = inode->datalayout == EROFS_INODE_FLAT_COMPRESSION;
+	if (ctx.compacted)
+		z_erofs_init_compacted_indexes(inode, &ctx);
+
+	compressmeta = malloc(vle_compressmeta_capacity(inode, &ctx));
+	if (!compressmeta) {
+		erofs_bdrop(bh, true);
+		return -ENOMEM;
+	}
+	ctx.metacur = compressmeta + (ctx.compacted ?
+			sizeof(struct z_erofs_map_header) :
+			Z_EROFS_LEGACY_MAP_HEADER_SIZE);
+	memset(compressmeta, 0, ctx.metacur - compressmeta);
 	ctx.head = ctx.tail = 0;
 	ctx.clusterofs = 0;
+	ctx.tailraw = false;
+	ctx.dupnext = false;
+	ctx.chunkend = ctx.chunkcut = 0;
+	ctx.windowleft = 0;
+	ctx.windowraw = false;
+	ctx.chunk.nr = -1;
 	remaining = inode->i_size;
 
 	while (remaining) {
 		const u64 readcount = min_t(u64, remaining,
 					    sizeof(ctx.queue) - ctx.tail);
 
-		ret = read(fd, ctx.queue + ctx.tail, readcount);
-		if (ret != readcount) {
-			ret = -errno;
+		/* holes of sparse files are zeroed rather than read */
+		ret = erofs_read_sparse(fd, ctx.queue + ctx.tail, readcount);
+		if (ret < 0)
 			goto err_bdrop;
-		}
 		remaining -= readcount;
 		ctx.tail += readcount;
 
@@ -535,49 +955,69 @@ int erofs_write_compressed_file(struct erofs_inode *inode)
 	if (ret)
 		goto err_bdrop;
 
-	/* fall back to no compression mode */
+	vle_write_indexes_final(&ctx);
+
+	/* no index is needed if the whole file is a fragment */
+	if (inode->fragment_size == inode->i_size)
+		inode->extent_isize = sizeof(struct z_erofs_map_header);
+	else
+		inode->extent_isize = ctx.metacur - compressmeta;
+
+	/* the inline pcluster should be in the same block as the indexes */
+	inodesize = Z_EROFS_VLE_EXTENT_ALIGN(inode->inode_isize +
+					     inode->xattr_isize) +
+		    inode->extent_isize;
+	if (inode->idata_size &&
+	    inodesize % EROFS_BLKSIZ + inode->idata_size > EROFS_BLKSIZ) {
+		ret = z_erofs_write_tail_pcluster(inode, &ctx);
+		if (ret)
+			goto err_bdrop;
+	}
+
+	/*
+	 * fall back to no compression mode, an uncompressed inline tail
+	 * saves nothing compared with the tail of an uncompressed file.
+	 */
 	compressed_blocks = ctx.blkaddr - blkaddr;
-	if (compressed_blocks >= BLK_ROUND_UP(inode->i_size)) {
+	/* no padding is needed if no pcluster is written */
+	if (compressed_blocks == padding)
+		compressed_blocks = 0;
+	if (compressed_blocks + (inode->idata_size && ctx.tailraw) >=
+	    BLK_ROUND_UP(inode->i_size)) {
 		ret = -ENOSPC;
 		goto err_bdrop;
 	}
+	z_erofs_write_mapheader(inode, compressmeta);
 
-	vle_write_indexes_final(&ctx);
-
-	close(fd);
-	DBG_BUGON(!compressed_blocks);
-	ret = erofs_bh_balloon(bh, blknr_to_addr(compressed_blocks));
-	DBG_BUGON(ret != EROFS_BLKSIZ);
+	if (compressed_blocks) {
+		ret = erofs_bh_balloon(bh, blknr_to_addr(compressed_blocks));
+		DBG_BUGON(ret != EROFS_BLKSIZ);
+		/* dropped in erofs_write_tail_end() as uncompressed files do */
+		inode->bh_data = bh;
+	} else {
+		/* all data is inlined, packed or deduplicated */
+		erofs_bdrop(bh, true);
+	}
+	z_erofs_dedupe_commit(false);
 
-	erofs_info("compressed %s (%llu bytes) into %u blocks",
+	erofs_info("compressed %s (%llu bytes) into %u blocks%s",
 		   inode->i_srcpath, (unsigned long long)inode->i_size,
-		   compressed_blocks);
+		   compressed_blocks,
+		   inode->idata_size ? " and inline data" :
+		   inode->fragment_size ? " and a fragment" : "");
 
-	/*
-	 * TODO: need to move erofs_bdrop to erofs_write_tail_end
-	 *       when both mkfs & kernel support compression inline.
-	 */
-	erofs_bdrop(bh, false);
-	inode->idata_size = 0;
 	inode->u.i_blocks = compressed_blocks;
-
-	legacymetasize = ctx.metacur - compressmeta;
-	if (inode->datalayout == EROFS_INODE_FLAT_COMPRESSION_LEGACY) {
-		inode->extent_isize = legacymetasize;
-	} else {
-		ret = z_erofs_convert_to_compacted_format(inode, blkaddr,
-							  legacymetasize,
-							  compressmeta);
-		DBG_BUGON(ret);
-	}
 	inode->compressmeta = compressmeta;
 	return 0;
 
 err_bdrop:
+	free(inode->idata);
+	inode->idata = NULL;
+	inode->idata_size = 0;
+	inode->extent_isize = 0;
+	z_erofs_drop_fragments(inode);
+	z_erofs_dedupe_commit(true);
 	erofs_bdrop(bh, true);	/* revoke buffer */
-err_close:
-	close(fd);
-err_free:
 	free(compressmeta);
 	return ret;
 }
@@ -594,7 +1034,7 @@ int z_erofs_build_compr_cfgs(struct erofs_buffer_head *sb_bh)
 	struct erofs_buffer_head *bh = sb_bh;
 	int ret = 0;
 
-	if (sbi.available_compr_algs & (1 << Z_EROFS_COMPRESSION_LZ4)) {
+	if (g_sbi.available_compr_algs & (1 << Z_EROFS_COMPRESSION_LZ4)) {
 		struct {
 			__le16 size;
 			struct z_erofs_lz4_cfgs lz4;
@@ -602,7 +1042,7 @@ int z_erofs_build_compr_cfgs(struct erofs_buffer_head *sb_bh)
 			.size = cpu_to_le16(sizeof(struct z_erofs_lz4_cfgs)),
 			.lz4 = {
 				.max_distance =
-					cpu_to_le16(sbi.lz4_max_distance),
+					cpu_to_le16(g_sbi.lz4_max_distance),
 				.max_pclusterblks = cfg.c_physical_clusterblks,
 			}
 		};
@@ -613,7 +1053,7 @@ int z_erofs_build_compr_cfgs(struct erofs_buffer_head *sb_bh)
 			return PTR_ERR(bh);
 		}
 		erofs_mapbh(bh->block);
-		ret = dev_write(&lz4alg, erofs_btell(bh, false),
+		ret = dev_write(&g_sbi, &lz4alg, erofs_btell(bh, false),
 				sizeof(lz4alg));
 		bh->op = &erofs_drop_directly_bhops;
 	}
@@ -635,7 +1075,7 @@ int z_erofs_compress_init(struct erofs_buffer_head *sb_bh)
 	 */
 	if (!cfg.c_compr_alg_master ||
 	    strncmp(cfg.c_compr_alg_master, "lz4", 3))
-		erofs_sb_clear_lz4_0padding();
+		erofs_sb_clear_lz4_0padding(&g_sbi);
 
 	if (!cfg.c_compr_alg_master)
 		return 0;
@@ -662,12 +1102,17 @@ int z_erofs_compress_init(struct erofs_buffer_head *sb_bh)
 				  cfg.c_physical_clusterblks);
 			return -EINVAL;
 		}
-		erofs_sb_set_big_pcluster();
+		erofs_sb_set_big_pcluster(&g_sbi);
 		erofs_warn("EXPERIMENTAL big pcluster feature in use. Use at your own risk!");
 	}
 
-	if (erofs_sb_has_compr_cfgs()) {
-		sbi.available_compr_algs |= 1 << ret;
+	if (cfg.c_ztailpacking) {
+		erofs_sb_set_ztailpacking(&g_sbi);
+		erofs_warn("EXPERIMENTAL compressed inline data feature in use. Use at your own risk!");
+	}
+
+	if (erofs_sb_has_compr_cfgs(&g_sbi)) {
+		g_sbi.available_compr_algs |= 1 << ret;
 		return z_erofs_build_compr_cfgs(sb_bh);
 	}
 	return 0;
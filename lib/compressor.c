@@ -26,9 +26,10 @@ int erofs_compress_destsize(struct erofs_compress *c,
 			    void *src,
 			    unsigned int *srcsize,
 			    void *dst,
-			    unsigned int dstsize)
+			    unsigned int dstsize,
+			    bool inblocks)
 {
-	unsigned uncompressed_size;
+	unsigned int uncompressed_size, compressed_size;
 	int ret;
 
 	DBG_BUGON(!c->alg);
@@ -40,14 +41,41 @@ int erofs_compress_destsize(struct erofs_compress *c,
 	if (ret < 0)
 		return ret;
 
-	/* check if there is enough gains to compress */
+	/*
+	 * check if there is enough gains to compress, which are counted in
+	 * bytes rather than blocks for the pclusters to be inlined.
+	 */
 	uncompressed_size = *srcsize;
-	if (roundup(ret, EROFS_BLKSIZ) >= uncompressed_size *
+	compressed_size = inblocks ? roundup(ret, EROFS_BLKSIZ) : ret;
+	if (compressed_size >= uncompressed_size *
 	    c->compress_threshold / 100)
 		return -EAGAIN;
 	return ret;
 }
 
+int erofs_compress(struct erofs_compress *c, int compression_level,
+		   void *src, unsigned int srcsize,
+		   void *dst, unsigned int dstsize, bool inblocks)
+{
+	unsigned int compressed_size;
+	int ret;
+
+	DBG_BUGON(!c->alg);
+	if (!c->alg->compress)
+		return -ENOTSUP;
+
+	ret = c->alg->compress(c, compression_level,
+			       src, srcsize, dst, dstsize);
+	if (ret < 0)
+		return ret;
+
+	/* the same gains are needed as erofs_compress_destsize() */
+	compressed_size = inblocks ? roundup(ret, EROFS_BLKSIZ) : ret;
+	if (compressed_size >= srcsize * c->compress_threshold / 100)
+		return -EAGAIN;
+	return ret;
+}
+
 const char *z_erofs_list_available_compressors(unsigned int i)
 {
 	return i >= ARRAY_SIZE(compressors) ? NULL : compressors[i]->name;
@@ -60,9 +88,9 @@ int erofs_compressor_init(struct erofs_compress *c, char *alg_name)
 	/* should be written in "minimum compression ratio * 100" */
 	c->compress_threshold = 100;
 
-	/* optimize for 4k size page */
-	c->destsize_alignsize = PAGE_SIZE;
-	c->destsize_redzone_begin = PAGE_SIZE - 16;
+	/* optimize for the block size */
+	c->destsize_alignsize = EROFS_BLKSIZ;
+	c->destsize_redzone_begin = EROFS_BLKSIZ - 16;
 	c->destsize_redzone_end = EROFS_CONFIG_COMPR_DEF_BOUNDARY;
 
 	if (!alg_name) {
@@ -26,6 +26,10 @@ struct erofs_compressor {
 				 int compress_level,
 				 void *src, unsigned int *srcsize,
 				 void *dst, unsigned int dstsize);
+	/* compress all of @srcsize bytes, -EAGAIN if @dstsize is exceeded */
+	int (*compress)(struct erofs_compress *c, int compress_level,
+			void *src, unsigned int srcsize,
+			void *dst, unsigned int dstsize);
 };
 
 struct erofs_compress {
@@ -47,7 +51,11 @@ extern struct erofs_compressor erofs_compressor_lz4hc;
 
 int erofs_compress_destsize(struct erofs_compress *c, int compression_level,
 			    void *src, unsigned int *srcsize,
-			    void *dst, unsigned int dstsize);
+			    void *dst, unsigned int dstsize, bool inblocks);
+
+int erofs_compress(struct erofs_compress *c, int compression_level,
+		   void *src, unsigned int srcsize,
+		   void *dst, unsigned int dstsize, bool inblocks);
 
 int erofs_compressor_init(struct erofs_compress *c, char *alg_name);
 int erofs_compressor_exit(struct erofs_compress *c);
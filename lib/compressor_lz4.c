@@ -28,6 +28,18 @@ static int lz4_compress_destsize(struct erofs_compress *c,
 	return rc;
 }
 
+static int lz4_compress(struct erofs_compress *c, int compression_level,
+			void *src, unsigned int srcsize,
+			void *dst, unsigned int dstsize)
+{
+	int rc = LZ4_compress_default(src, dst, srcsize, dstsize);
+
+	/* the compressed data doesn't fit in @dstsize */
+	if (!rc)
+		return -EAGAIN;
+	return rc;
+}
+
 static int compressor_lz4_exit(struct erofs_compress *c)
 {
 	return 0;
@@ -36,7 +48,7 @@ static int compressor_lz4_exit(struct erofs_compress *c)
 static int compressor_lz4_init(struct erofs_compress *c)
 {
 	c->alg = &erofs_compressor_lz4;
-	sbi.lz4_max_distance = LZ4_DISTANCE_MAX;
+	g_sbi.lz4_max_distance = LZ4_DISTANCE_MAX;
 	return 0;
 }
 
@@ -47,5 +59,6 @@ struct erofs_compressor erofs_compressor_lz4 = {
 	.init = compressor_lz4_init,
 	.exit = compressor_lz4_exit,
 	.compress_destsize = lz4_compress_destsize,
+	.compress = lz4_compress,
 };
 
@@ -32,6 +32,20 @@ static int lz4hc_compress_destsize(struct erofs_compress *c,
 	return rc;
 }
 
+static int lz4hc_compress(struct erofs_compress *c, int compression_level,
+			  void *src, unsigned int srcsize,
+			  void *dst, unsigned int dstsize)
+{
+	int rc = LZ4_compress_HC_extStateHC(c->private_data, src, dst,
+					    srcsize, dstsize,
+					    compression_level);
+
+	/* the compressed data doesn't fit in @dstsize */
+	if (!rc)
+		return -EAGAIN;
+	return rc;
+}
+
 static int compressor_lz4hc_exit(struct erofs_compress *c)
 {
 	if (!c->private_data)
@@ -49,7 +63,7 @@ static int compressor_lz4hc_init(struct erofs_compress *c)
 	if (!c->private_data)
 		return -ENOMEM;
 
-	sbi.lz4_max_distance = LZ4_DISTANCE_MAX;
+	g_sbi.lz4_max_distance = LZ4_DISTANCE_MAX;
 	return 0;
 }
 
@@ -60,5 +74,6 @@ struct erofs_compressor erofs_compressor_lz4hc = {
 	.init = compressor_lz4hc_init,
 	.exit = compressor_lz4hc_exit,
 	.compress_destsize = lz4hc_compress_destsize,
+	.compress = lz4hc_compress,
 };
 
@@ -11,7 +11,10 @@
 #include "erofs/internal.h"
 
 struct erofs_configure cfg;
-struct erofs_sb_info sbi;
+struct erofs_sb_info g_sbi = {
+	.blkszbits = 12,
+	.devfd = -1,
+};
 
 void erofs_init_configure(void)
 {
@@ -5,11 +5,13 @@
  * Copyright (C) 2020 Gao Xiang <hsiangkao@aol.com>
  * Compression support by Huang Jianan <huangjianan@oppo.com>
  */
+#include <stdlib.h>
 #include "erofs/print.h"
 #include "erofs/internal.h"
 #include "erofs/io.h"
 #include "erofs/trace.h"
 #include "erofs/decompress.h"
+#include "erofs/workqueue.h"
 
 static int erofs_map_blocks_flatmode(struct erofs_inode *inode,
 				     struct erofs_map_blocks *map,
@@ -23,7 +25,7 @@ static int erofs_map_blocks_flatmode(struct erofs_inode *inode,
 
 	trace_erofs_map_blocks_flatmode_enter(inode, map, flags);
 
-	nblocks = DIV_ROUND_UP(inode->i_size, PAGE_SIZE);
+	nblocks = DIV_ROUND_UP(inode->i_size, erofs_blksiz(vi->sbi));
 	lastblk = nblocks - tailendpacking;
 
 	if (offset >= inode->i_size) {
@@ -36,17 +38,18 @@ static int erofs_map_blocks_flatmode(struct erofs_inode *inode,
 	/* there is no hole in flatmode */
 	map->m_flags = EROFS_MAP_MAPPED;
 
-	if (offset < blknr_to_addr(lastblk)) {
-		map->m_pa = blknr_to_addr(vi->u.i_blkaddr) + map->m_la;
-		map->m_plen = blknr_to_addr(lastblk) - offset;
+	if (offset < erofs_sbi_pos(vi->sbi, lastblk)) {
+		map->m_pa = erofs_sbi_pos(vi->sbi, vi->u.i_blkaddr) + map->m_la;
+		map->m_plen = erofs_sbi_pos(vi->sbi, lastblk) - offset;
 	} else if (tailendpacking) {
 		/* 2 - inode inline B: inode, [xattrs], inline last blk... */
-		map->m_pa = iloc(vi->nid) + vi->inode_isize +
-			vi->xattr_isize + erofs_blkoff(map->m_la);
+		map->m_pa = iloc(vi->sbi, vi->nid) + vi->inode_isize +
+			vi->xattr_isize + erofs_sbi_blkoff(vi->sbi, map->m_la);
 		map->m_plen = inode->i_size - offset;
 
 		/* inline data should be located in one meta block */
-		if (erofs_blkoff(map->m_pa) + map->m_plen > PAGE_SIZE) {
+		if (erofs_sbi_blkoff(vi->sbi, map->m_pa) + map->m_plen >
+		    erofs_blksiz(vi->sbi)) {
 			erofs_err("inline data cross block boundary @ nid %" PRIu64,
 				  vi->nid);
 			DBG_BUGON(1);
@@ -71,6 +74,67 @@ err_out:
 	return err;
 }
 
+static int erofs_map_blocks_chunkmode(struct erofs_inode *inode,
+				      struct erofs_map_blocks *map)
+{
+	struct erofs_inode *vi = inode;
+	const erofs_off_t chunksize = 1ULL << vi->u.chunkbits;
+	struct erofs_inode_chunk_index idx;
+	unsigned int unit;
+	erofs_blk_t blkaddr;
+	erofs_off_t pos;
+	u64 chunknr;
+	int err;
+
+	if (map->m_la >= inode->i_size) {
+		/* leave out-of-bound access unmapped */
+		map->m_flags = 0;
+		map->m_plen = map->m_llen = 0;
+		return 0;
+	}
+
+	if (vi->u.chunkformat & EROFS_CHUNK_FORMAT_INDEXES)
+		unit = sizeof(struct erofs_inode_chunk_index);
+	else
+		unit = EROFS_BLOCK_MAP_ENTRY_SIZE;
+
+	chunknr = map->m_la >> vi->u.chunkbits;
+	pos = round_up(iloc(vi->sbi, vi->nid) + vi->inode_isize +
+		       vi->xattr_isize, unit) + unit * chunknr;
+
+	err = dev_read(vi->sbi, &idx, pos, unit);
+	if (err < 0)
+		return -EIO;
+
+	if (unit == EROFS_BLOCK_MAP_ENTRY_SIZE)
+		blkaddr = le32_to_cpu(*(__le32 *)&idx);
+	else
+		blkaddr = le32_to_cpu(idx.blkaddr);
+
+	map->m_la = chunknr << vi->u.chunkbits;
+	map->m_plen = min(chunksize, inode->i_size - map->m_la);
+	map->m_llen = map->m_plen;
+
+	/* NULL_ADDR indicates a hole */
+	if (blkaddr == NULL_ADDR) {
+		map->m_flags = 0;
+		return 0;
+	}
+	map->m_pa = erofs_sbi_pos(vi->sbi, blkaddr);
+	map->m_flags = EROFS_MAP_MAPPED;
+	return 0;
+}
+
+int erofs_map_blocks(struct erofs_inode *inode,
+		     struct erofs_map_blocks *map, int flags)
+{
+	if (erofs_inode_is_data_compressed(inode->datalayout))
+		return z_erofs_map_blocks_iter(inode, map, flags);
+	if (inode->datalayout == EROFS_INODE_CHUNK_BASED)
+		return erofs_map_blocks_chunkmode(inode, map);
+	return erofs_map_blocks_flatmode(inode, map, flags);
+}
+
 static int erofs_read_raw_data(struct erofs_inode *inode, char *buffer,
 			       erofs_off_t size, erofs_off_t offset)
 {
@@ -85,7 +149,7 @@ static int erofs_read_raw_data(struct erofs_inode *inode, char *buffer,
 		erofs_off_t eend;
 
 		map.m_la = ptr;
-		ret = erofs_map_blocks_flatmode(inode, &map, 0);
+		ret = erofs_map_blocks(inode, &map, 0);
 		if (ret)
 			return ret;
 
@@ -112,7 +176,7 @@ static int erofs_read_raw_data(struct erofs_inode *inode, char *buffer,
 			map.m_la = ptr;
 		}
 
-		ret = dev_read(estart, map.m_pa, eend - map.m_la);
+		ret = dev_read(inode->sbi, estart, map.m_pa, eend - map.m_la);
 		if (ret < 0)
 			return -EIO;
 		ptr = eend;
@@ -120,72 +184,319 @@ static int erofs_read_raw_data(struct erofs_inode *inode, char *buffer,
 	return 0;
 }
 
-static int z_erofs_read_data(struct erofs_inode *inode, char *buffer,
-			     erofs_off_t size, erofs_off_t offset)
+/* at most how many compressed bytes are read by a single I/O */
+#define Z_EROFS_READ_BATCH_BYTES	(2 * Z_EROFS_PCLUSTER_MAX_SIZE)
+#define Z_EROFS_READ_BATCH_EXTENTS	64
+
+struct z_erofs_read_extent {
+	erofs_off_t la, pa;
+	u64 llen, plen;
+	unsigned int flags;
+};
+
+struct z_erofs_decompress_batch {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	unsigned int pending;
+	int err;
+};
+
+struct z_erofs_decompress_work {
+	struct erofs_work work;
+	struct z_erofs_decompress_req rq;
+	struct z_erofs_decompress_batch *batch;
+};
+
+static struct erofs_workqueue z_erofs_decompress_wq;
+static pthread_once_t z_erofs_decompress_wq_once = PTHREAD_ONCE_INIT;
+static bool z_erofs_decompress_wq_ready;
+
+static void z_erofs_init_decompress_wq(void)
 {
-	int ret;
-	erofs_off_t end, length, skip;
-	struct erofs_map_blocks map = {
-		.index = UINT_MAX,
+	int ret = erofs_workqueue_init(&z_erofs_decompress_wq,
+				       cfg.c_decompress_workers);
+
+	if (ret)
+		erofs_warn("failed to start decompression workers: %d", ret);
+	else
+		z_erofs_decompress_wq_ready = true;
+}
+
+/* the workers are started on first use and live as long as the process */
+static bool z_erofs_get_decompress_wq(void)
+{
+	if (!cfg.c_decompress_workers)
+		return false;
+	pthread_once(&z_erofs_decompress_wq_once, z_erofs_init_decompress_wq);
+	return z_erofs_decompress_wq_ready;
+}
+
+static void z_erofs_decompress_workfn(struct erofs_work *work)
+{
+	struct z_erofs_decompress_work *dw =
+		container_of(work, struct z_erofs_decompress_work, work);
+	struct z_erofs_decompress_batch *batch = dw->batch;
+	int ret = z_erofs_decompress(&dw->rq);
+
+	pthread_mutex_lock(&batch->lock);
+	if (ret < 0 && !batch->err)
+		batch->err = ret;
+	if (!--batch->pending)
+		pthread_cond_signal(&batch->cond);
+	pthread_mutex_unlock(&batch->lock);
+}
+
+/* hand all but the first pcluster to the workers and wait for them */
+static int z_erofs_decompress_parallel(struct z_erofs_decompress_work *works,
+				       unsigned int nr)
+{
+	struct z_erofs_decompress_batch batch = {
+		.lock = PTHREAD_MUTEX_INITIALIZER,
+		.cond = PTHREAD_COND_INITIALIZER,
+		.pending = nr,
 	};
-	bool partial;
-	unsigned int algorithmformat;
-	char raw[Z_EROFS_PCLUSTER_MAX_SIZE];
+	unsigned int i;
 
-	end = offset + size;
-	while (end > offset) {
-		map.m_la = end - 1;
+	for (i = 0; i < nr; ++i) {
+		works[i].work.fn = z_erofs_decompress_workfn;
+		works[i].batch = &batch;
+		if (i)
+			erofs_workqueue_add(&z_erofs_decompress_wq,
+					    &works[i].work);
+	}
+	z_erofs_decompress_workfn(&works[0].work);
 
-		ret = z_erofs_map_blocks_iter(inode, &map);
-		if (ret)
-			return ret;
+	pthread_mutex_lock(&batch.lock);
+	while (batch.pending)
+		pthread_cond_wait(&batch.cond, &batch.lock);
+	pthread_mutex_unlock(&batch.lock);
 
-		/*
-		 * trim to the needed size if the returned extent is quite
-		 * larger than requested, and set up partial flag as well.
-		 */
-		if (end < map.m_la + map.m_llen) {
-			length = end - map.m_la;
-			partial = true;
-		} else {
-			DBG_BUGON(end != map.m_la + map.m_llen);
-			length = map.m_llen;
-			partial = !(map.m_flags & EROFS_MAP_FULL_MAPPED);
-		}
+	pthread_cond_destroy(&batch.cond);
+	pthread_mutex_destroy(&batch.lock);
+	return batch.err;
+}
+
+/*
+ * Compressed data is read into the output buffer and decoded in place if
+ * possible, like the kernel does. Such input may overrun into the output of
+ * the following extents, so it is only done if they are decoded in order.
+ */
+static int z_erofs_read_batch(struct erofs_sb_info *sbi,
+			      struct z_erofs_read_extent *ext,
+			      unsigned int nr, char *buffer,
+			      erofs_off_t offset, erofs_off_t end)
+{
+	struct z_erofs_decompress_work works[Z_EROFS_READ_BATCH_EXTENTS];
+	struct iovec iov[Z_EROFS_READ_BATCH_EXTENTS];
+	bool parallel = nr > 1 && z_erofs_get_decompress_wq();
+	char *bufend = buffer + (end - offset), *floor = buffer;
+	unsigned int i, j, k, nw;
+	u64 rawlen = 0;
+	char *raw;
+	int ret;
+
+	/* set up a decompression request for each mapped extent */
+	for (i = 0, nw = 0; i < nr; ++i) {
+		struct z_erofs_read_extent *e = &ext[i];
+		struct z_erofs_decompress_req *rq;
+		erofs_off_t skip = 0, length = e->llen;
+		int margin = -1;
+
+		if (!(e->flags & EROFS_MAP_MAPPED))
+			continue;
 
-		if (map.m_la < offset) {
-			skip = offset - map.m_la;
-			end = offset;
-		} else {
-			skip = 0;
-			end = map.m_la;
+		if (e->la < offset)
+			skip = offset - e->la;
+		if (e->la + length > end)
+			length = end - e->la;
+
+		rq = &works[nw++].rq;
+		*rq = (struct z_erofs_decompress_req) {
+			.sbi = sbi,
+			.out = buffer + e->la + skip - offset,
+			.decodedskip = skip,
+			.inputsize = e->plen,
+			.decodedlength = length,
+			.alg = e->flags & EROFS_MAP_ZIPPED ?
+				Z_EROFS_COMPRESSION_LZ4 :
+				Z_EROFS_COMPRESSION_SHIFTED,
+			.partial_decoding = length < e->llen,
+		};
+
+		if (!skip && length == e->llen)
+			margin = z_erofs_inplace_margin(sbi, rq->alg, e->plen,
+							e->llen);
+		if (margin > 0 && parallel)
+			margin = -1;
+		if (margin >= 0) {
+			char *iend = rq->out + e->llen + margin;
+
+			/* don't overwrite the input of previous extents */
+			if (iend <= bufend && iend - e->plen >= floor) {
+				rq->in = iend - e->plen;
+				rq->inplace_io = true;
+				floor = iend;
+				continue;
+			}
 		}
+		rawlen += e->plen;
+	}
 
-		if (!(map.m_flags & EROFS_MAP_MAPPED)) {
-			memset(buffer + end - offset, 0, length);
-			end = map.m_la;
+	raw = NULL;
+	if (rawlen) {
+		raw = z_erofs_get_workspace(Z_EROFS_WORKSPACE_RAW, rawlen);
+		if (!raw)
+			return -ENOMEM;
+	}
+	for (k = 0; k < nw; ++k) {
+		if (works[k].rq.inplace_io)
+			continue;
+		works[k].rq.in = raw;
+		raw += works[k].rq.inputsize;
+	}
+
+	/* read each run of physically contiguous pclusters at once */
+	for (i = 0, k = 0; i < nr; i = j) {
+		erofs_off_t pa = ext[i].pa;
+		u64 len = 0;
+
+		for (j = i; j < nr && (ext[j].flags & EROFS_MAP_MAPPED) &&
+		     ext[j].pa == pa + len; ++j) {
+			iov[j - i] = (struct iovec) {
+				.iov_base = works[k++].rq.in,
+				.iov_len = ext[j].plen,
+			};
+			len += ext[j].plen;
+		}
+		if (j == i) {
+			++j;
 			continue;
 		}
 
-		ret = dev_read(raw, map.m_pa, map.m_plen);
+		ret = dev_readv(sbi, iov, j - i, pa);
 		if (ret < 0)
 			return -EIO;
+	}
 
-		algorithmformat = map.m_flags & EROFS_MAP_ZIPPED ?
-						Z_EROFS_COMPRESSION_LZ4 :
-						Z_EROFS_COMPRESSION_SHIFTED;
-
-		ret = z_erofs_decompress(&(struct z_erofs_decompress_req) {
-					.in = raw,
-					.out = buffer + end - offset,
-					.decodedskip = skip,
-					.inputsize = map.m_plen,
-					.decodedlength = length,
-					.alg = algorithmformat,
-					.partial_decoding = partial
-					 });
-		if (ret < 0)
+	/* and then decompress them into disjoint parts of the buffer */
+	if (parallel && nw > 1) {
+		ret = z_erofs_decompress_parallel(works, nw);
+		if (ret)
 			return ret;
+	} else {
+		for (k = 0; k < nw; ++k) {
+			ret = z_erofs_decompress(&works[k].rq);
+			if (ret < 0)
+				return ret;
+		}
+	}
+
+	/* holes are zeroed last since they could hold in-place input */
+	for (i = 0; i < nr; ++i) {
+		struct z_erofs_read_extent *e = &ext[i];
+		erofs_off_t start = max_t(erofs_off_t, e->la, offset);
+
+		if (e->flags & EROFS_MAP_MAPPED)
+			continue;
+		memset(buffer + start - offset, 0,
+		       min_t(erofs_off_t, e->la + e->llen, end) - start);
+	}
+	return 0;
+}
+
+/* read the part of the tail extent @map kept in the packed inode */
+static int z_erofs_read_fragment(struct erofs_inode *inode, char *buffer,
+				 erofs_off_t size, erofs_off_t offset,
+				 struct erofs_map_blocks *map)
+{
+	struct erofs_inode *packed_inode = erofs_packed_inode(inode->sbi);
+
+	if (IS_ERR(packed_inode))
+		return PTR_ERR(packed_inode);
+	DBG_BUGON(offset < map->m_la);
+	return erofs_pread(packed_inode, buffer, size,
+			   inode->z_fragmentoff + offset - map->m_la);
+}
+
+/*
+ * Walk the extents forward and read physically contiguous pclusters with one
+ * I/O per batch, so that large reads are not split into many small reverse
+ * ordered reads. The fragment, if any, is the last extent.
+ */
+static int z_erofs_read_data(struct erofs_inode *inode, char *buffer,
+			     erofs_off_t size, erofs_off_t offset)
+{
+	struct z_erofs_read_extent ext[Z_EROFS_READ_BATCH_EXTENTS];
+	struct erofs_map_blocks map = {
+		.index = UINT_MAX,
+	};
+	erofs_off_t pos = offset, end = offset + size;
+	int ret;
+
+	if (end > inode->i_size) {
+		/* leave the part beyond EOF zeroed */
+		if (offset >= inode->i_size) {
+			memset(buffer, 0, size);
+			return 0;
+		}
+		memset(buffer + inode->i_size - offset, 0,
+		       end - inode->i_size);
+		end = inode->i_size;
+	}
+
+	while (pos < end) {
+		unsigned int nr = 0;
+		u64 rawlen = 0;
+		bool fragment = false;
+
+		while (pos < end && nr < Z_EROFS_READ_BATCH_EXTENTS) {
+			map.m_la = pos;
+			ret = z_erofs_map_blocks_iter(inode, &map,
+						      EROFS_GET_BLOCKS_FIEMAP);
+			if (ret)
+				return ret;
+			/* a corrupted image must not stall the read loop */
+			if (map.m_la > pos || map.m_la + map.m_llen <= pos) {
+				erofs_err("bogus extent @ nid %" PRIu64 ", pos %" PRIu64,
+					  inode->nid, pos);
+				DBG_BUGON(1);
+				return -EFSCORRUPTED;
+			}
+
+			if (map.m_flags & EROFS_MAP_FRAGMENT) {
+				fragment = true;
+				break;
+			}
+
+			if (map.m_flags & EROFS_MAP_MAPPED) {
+				if (nr && rawlen + map.m_plen >
+						Z_EROFS_READ_BATCH_BYTES)
+					break;
+				rawlen += map.m_plen;
+			}
+			ext[nr++] = (struct z_erofs_read_extent) {
+				.la = map.m_la,
+				.pa = map.m_pa,
+				.llen = map.m_llen,
+				.plen = map.m_plen,
+				.flags = map.m_flags,
+			};
+			pos = map.m_la + map.m_llen;
+		}
+
+		ret = z_erofs_read_batch(inode->sbi, ext, nr, buffer,
+					 offset, end);
+		if (ret)
+			return ret;
+
+		if (fragment) {
+			ret = z_erofs_read_fragment(inode,
+					buffer + pos - offset, end - pos,
+					pos, &map);
+			if (ret)
+				return ret;
+			pos = end;
+		}
 	}
 	return 0;
 }
@@ -196,6 +507,7 @@ int erofs_pread(struct erofs_inode *inode, char *buf,
 	switch (inode->datalayout) {
 	case EROFS_INODE_FLAT_PLAIN:
 	case EROFS_INODE_FLAT_INLINE:
+	case EROFS_INODE_CHUNK_BASED:
 		return erofs_read_raw_data(inode, buf, count, offset);
 	case EROFS_INODE_FLAT_COMPRESSION_LEGACY:
 	case EROFS_INODE_FLAT_COMPRESSION:
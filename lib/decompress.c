@@ -6,77 +6,189 @@
  * Created by Huang Jianan <huangjianan@oppo.com>
  */
 #include <stdlib.h>
+#include <pthread.h>
 
 #include "erofs/decompress.h"
 #include "erofs/err.h"
 
+/*
+ * Each thread keeps its own scratch buffers, which only grow, so that
+ * decompressing does not allocate memory for every request.
+ */
+struct z_erofs_workspaces {
+	void *buf[Z_EROFS_WORKSPACE_MAX];
+	size_t size[Z_EROFS_WORKSPACE_MAX];
+};
+
+static pthread_key_t z_erofs_workspace_key;
+static pthread_once_t z_erofs_workspace_once = PTHREAD_ONCE_INIT;
+
+static void z_erofs_free_workspaces(void *ptr)
+{
+	struct z_erofs_workspaces *ws = ptr;
+	int i;
+
+	for (i = 0; i < Z_EROFS_WORKSPACE_MAX; ++i)
+		free(ws->buf[i]);
+	free(ws);
+}
+
+static void z_erofs_init_workspace_key(void)
+{
+	if (pthread_key_create(&z_erofs_workspace_key,
+			       z_erofs_free_workspaces))
+		abort();
+}
+
+void *z_erofs_get_workspace(unsigned int id, size_t size)
+{
+	struct z_erofs_workspaces *ws;
+	void *buf;
+
+	DBG_BUGON(id >= Z_EROFS_WORKSPACE_MAX);
+	pthread_once(&z_erofs_workspace_once, z_erofs_init_workspace_key);
+	ws = pthread_getspecific(z_erofs_workspace_key);
+	if (!ws) {
+		ws = calloc(1, sizeof(*ws));
+		if (!ws)
+			return NULL;
+		if (pthread_setspecific(z_erofs_workspace_key, ws)) {
+			free(ws);
+			return NULL;
+		}
+	}
+
+	if (size <= ws->size[id])
+		return ws->buf[id];
+
+	/* the old content is never needed, so don't bother copying it */
+	buf = malloc(size);
+	if (!buf)
+		return NULL;
+	free(ws->buf[id]);
+	ws->buf[id] = buf;
+	ws->size[id] = size;
+	return buf;
+}
+
 #ifdef LZ4_ENABLED
 #include <lz4.h>
 
+#ifndef LZ4_DECOMPRESS_INPLACE_MARGIN
+#define LZ4_DECOMPRESS_INPLACE_MARGIN(compressedSize)	\
+	(((compressedSize) >> 8) + 32)
+#endif
+
+/*
+ * return the length of the leading zeroes of @src, which could be longer
+ * than a block if the pcluster takes more than one block per lcluster.
+ */
+static unsigned int z_erofs_lz4_inputmargin(const char *src,
+					    unsigned int inputsize)
+{
+	unsigned int margin = 0;
+	unsigned long word;
+
+	while (margin + sizeof(word) <= inputsize) {
+		memcpy(&word, src + margin, sizeof(word));
+		if (word)
+			break;
+		margin += sizeof(word);
+	}
+	while (margin < inputsize && !src[margin])
+		++margin;
+	return margin;
+}
+
 static int z_erofs_decompress_lz4(struct z_erofs_decompress_req *rq)
 {
 	int ret = 0;
 	char *dest = rq->out;
 	char *src = rq->in;
-	char *buff = NULL;
 	bool support_0padding = false;
 	unsigned int inputmargin = 0;
 
-	if (erofs_sb_has_lz4_0padding()) {
+	if (erofs_sb_has_lz4_0padding(rq->sbi)) {
 		support_0padding = true;
 
-		while (!src[inputmargin & ~PAGE_MASK])
-			if (!(++inputmargin & ~PAGE_MASK))
-				break;
-
+		inputmargin = z_erofs_lz4_inputmargin(src, rq->inputsize);
 		if (inputmargin >= rq->inputsize)
 			return -EIO;
 	}
 
 	if (rq->decodedskip) {
-		buff = malloc(rq->decodedlength);
-		if (!buff)
+		dest = z_erofs_get_workspace(Z_EROFS_WORKSPACE_DECODE,
+					     rq->decodedlength);
+		if (!dest)
 			return -ENOMEM;
-		dest = buff;
 	}
 
-	if (rq->partial_decoding || !support_0padding)
+	if (rq->inplace_io) {
+		DBG_BUGON(!support_0padding || rq->partial_decoding ||
+			  rq->decodedskip);
+		ret = LZ4_decompress_safe(src + inputmargin, dest,
+					  rq->inputsize - inputmargin,
+					  rq->decodedlength);
+	} else if (rq->partial_decoding || !support_0padding) {
 		ret = LZ4_decompress_safe_partial(src + inputmargin, dest,
 				rq->inputsize - inputmargin,
 				rq->decodedlength, rq->decodedlength);
-	else
+	} else {
 		ret = LZ4_decompress_safe(src + inputmargin, dest,
 					  rq->inputsize - inputmargin,
 					  rq->decodedlength);
-
-	if (ret != (int)rq->decodedlength) {
-		ret = -EIO;
-		goto out;
 	}
 
+	if (ret != (int)rq->decodedlength)
+		return -EIO;
+
 	if (rq->decodedskip)
 		memcpy(rq->out, dest + rq->decodedskip,
 		       rq->decodedlength - rq->decodedskip);
-
-out:
-	if (buff)
-		free(buff);
-
-	return ret;
+	return 0;
 }
 #endif
 
+/*
+ * Return how many bytes the output buffer has to extend beyond the decoded
+ * data if the compressed data is read to end there and decoded in place,
+ * or a negative value if that is impossible.
+ */
+int z_erofs_inplace_margin(struct erofs_sb_info *sbi, unsigned int alg,
+			   unsigned int inputsize, unsigned int outputsize)
+{
+	/* uncompressed blocks can just be read into their final place */
+	if (alg == Z_EROFS_COMPRESSION_SHIFTED)
+		return inputsize == outputsize ? 0 : -1;
+#ifdef LZ4_ENABLED
+	/*
+	 * As the kernel does, it needs 0padding so that the compressed data
+	 * ends at the pcluster end, and a margin so that the output never
+	 * catches up with the input which isn't consumed yet.
+	 */
+	if (alg == Z_EROFS_COMPRESSION_LZ4 && erofs_sb_has_lz4_0padding(sbi))
+		return LZ4_DECOMPRESS_INPLACE_MARGIN(inputsize);
+#endif
+	return -1;
+}
+
 int z_erofs_decompress(struct z_erofs_decompress_req *rq)
 {
 	if (rq->alg == Z_EROFS_COMPRESSION_SHIFTED) {
-		if (rq->inputsize != EROFS_BLKSIZ)
+		/*
+		 * an uncompressed pcluster takes one lcluster, but an inline
+		 * uncompressed tail can be shorter than a block.
+		 */
+		if (rq->inputsize > Z_EROFS_LCLUSTER_MAX_SIZE ||
+		    rq->decodedlength > rq->inputsize)
 			return -EFSCORRUPTED;
 
-		DBG_BUGON(rq->decodedlength > EROFS_BLKSIZ);
 		DBG_BUGON(rq->decodedlength < rq->decodedskip);
 
-		memcpy(rq->out, rq->in + rq->decodedskip,
-		       rq->decodedlength - rq->decodedskip);
+		/* nothing to do if it was read into place */
+		if (!rq->inplace_io)
+			memcpy(rq->out, rq->in + rq->decodedskip,
+			       rq->decodedlength - rq->decodedskip);
 		return 0;
 	}
 
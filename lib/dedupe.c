@@ -0,0 +1,397 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * erofs-utils/lib/dedupe.c
+ *
+ * Compressed data is cut into chunks at content-defined block boundaries.
+ * Each chunk is identified by its SHA-256 digest, and the pclusters written
+ * for it are recorded so that the same data found later refers to them
+ * rather than being written again.
+ *
+ * Pclusters of such chunks cannot cross chunk boundaries, which costs
+ * compression ratio. So the source is scanned ahead to find out which
+ * chunks occur more than once, and only those are cut out of the data.
+ */
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include "erofs/print.h"
+#include "erofs/io.h"
+#include "erofs/exclude.h"
+#include "erofs/dedupe.h"
+#include "sha256.h"
+
+/* chunks end at least this far from their starts */
+#define Z_EROFS_DEDUPE_MIN_CHUNKBLKS	2
+/* one boundary is taken every (1 << bits) blocks on average */
+#define Z_EROFS_DEDUPE_BOUNDARY_BITS	4
+/* bytes right before a block boundary which decide whether to cut there */
+#define Z_EROFS_DEDUPE_WINDOW		64
+
+#define Z_EROFS_DEDUPE_HASHTABLE_BITS	16
+
+static DECLARE_HASHTABLE(z_erofs_dedupe_table, Z_EROFS_DEDUPE_HASHTABLE_BITS);
+static LIST_HEAD(z_erofs_dedupe_items);
+/* chunks after this one are of the current file, which could be revoked */
+static struct list_head *z_erofs_dedupe_committed = &z_erofs_dedupe_items;
+
+/* a chunk found in the source, and how many times it occurs */
+struct z_erofs_dedupe_seen {
+	struct hlist_node node;
+	u8 digest[32];
+	unsigned int length;
+	unsigned int count;
+};
+
+/* the chunks which a source file is cut into */
+struct z_erofs_dedupe_file {
+	struct hlist_node node;
+	dev_t dev;
+	ino_t ino;
+	unsigned int nr;
+	struct z_erofs_dedupe_seen **chunks;
+};
+
+static DECLARE_HASHTABLE(z_erofs_dedupe_seen_table,
+			 Z_EROFS_DEDUPE_HASHTABLE_BITS);
+static DECLARE_HASHTABLE(z_erofs_dedupe_files, Z_EROFS_DEDUPE_HASHTABLE_BITS);
+
+static u64 z_erofs_dedupe_key(const u8 *digest)
+{
+	u64 key;
+
+	memcpy(&key, digest, sizeof(key));
+	return key;
+}
+
+static bool z_erofs_dedupe_is_boundary(const u8 *end)
+{
+	const u8 *p = end - Z_EROFS_DEDUPE_WINDOW;
+	u64 h = 0;
+
+	while (p < end)
+		h = (h + *p++) * GOLDEN_RATIO_64;
+	return !(h >> (64 - Z_EROFS_DEDUPE_BOUNDARY_BITS));
+}
+
+/*
+ * Get the size of the chunk at @data, which should start at a block
+ * boundary of the file. @len bytes are available and @final indicates
+ * that they reach the end of file. Return 0 if more data is needed.
+ *
+ * Whether a block boundary is taken only depends on the bytes right
+ * before it, so that the same data shifted by whole blocks is still cut
+ * into the same chunks.
+ */
+unsigned int z_erofs_dedupe_chunksize(const u8 *data, unsigned int len,
+				      bool final)
+{
+	const unsigned int maxsize =
+		Z_EROFS_DEDUPE_MAX_CHUNKBLKS * EROFS_BLKSIZ;
+	unsigned int pos;
+
+	for (pos = Z_EROFS_DEDUPE_MIN_CHUNKBLKS * EROFS_BLKSIZ;
+	     pos < min(len, maxsize); pos += EROFS_BLKSIZ)
+		if (z_erofs_dedupe_is_boundary(data + pos))
+			return pos;
+
+	if (len >= maxsize)
+		return maxsize;
+	return final ? len : 0;
+}
+
+static struct z_erofs_dedupe_seen *
+z_erofs_dedupe_find_seen(const u8 *digest, unsigned int length)
+{
+	struct z_erofs_dedupe_seen *se;
+
+	hash_for_each_possible(z_erofs_dedupe_seen_table, se, node,
+			       z_erofs_dedupe_key(digest))
+		if (se->length == length &&
+		    !memcmp(se->digest, digest, sizeof(se->digest)))
+			return se;
+	return NULL;
+}
+
+static int z_erofs_dedupe_add_seen(struct z_erofs_dedupe_file *f,
+				   const u8 *data, unsigned int len)
+{
+	struct z_erofs_dedupe_seen *se, **chunks;
+	u8 digest[32];
+
+	erofs_sha256(data, len, digest);
+	se = z_erofs_dedupe_find_seen(digest, len);
+	if (!se) {
+		se = malloc(sizeof(*se));
+		if (!se)
+			return -ENOMEM;
+		memcpy(se->digest, digest, sizeof(se->digest));
+		se->length = len;
+		se->count = 0;
+		hash_add(z_erofs_dedupe_seen_table, &se->node,
+			 z_erofs_dedupe_key(digest));
+	}
+	++se->count;
+
+	chunks = realloc(f->chunks, (f->nr + 1) * sizeof(*chunks));
+	if (!chunks)
+		return -ENOMEM;
+	chunks[f->nr++] = se;
+	f->chunks = chunks;
+	return 0;
+}
+
+static struct z_erofs_dedupe_file *z_erofs_dedupe_find_file(dev_t dev,
+							    ino_t ino)
+{
+	struct z_erofs_dedupe_file *f;
+
+	hash_for_each_possible(z_erofs_dedupe_files, f, node, ino ^ dev)
+		if (f->ino == ino && f->dev == dev)
+			return f;
+	return NULL;
+}
+
+/* cut the file at @path into chunks the way compress.c does */
+static int z_erofs_dedupe_scan_file(const char *path, const struct stat64 *st)
+{
+	const unsigned int maxsize =
+		Z_EROFS_DEDUPE_MAX_CHUNKBLKS * EROFS_BLKSIZ;
+	struct z_erofs_dedupe_file *f;
+	unsigned int head = 0, tail = 0, len;
+	u64 remaining = st->st_size;
+	u8 *buf;
+	int fd, ret;
+
+	/* hard links are written once */
+	if (z_erofs_dedupe_find_file(st->st_dev, st->st_ino))
+		return 0;
+
+	f = calloc(1, sizeof(*f));
+	if (!f)
+		return -ENOMEM;
+	f->dev = st->st_dev;
+	f->ino = st->st_ino;
+	hash_add(z_erofs_dedupe_files, &f->node, f->ino ^ f->dev);
+
+	fd = open(path, O_RDONLY | O_BINARY);
+	if (fd < 0)
+		return -errno;
+
+	buf = malloc(maxsize * 2);
+	if (!buf) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	ret = 0;
+	while (remaining || head < tail) {
+		/* keep a whole chunk of the maximum size ahead if possible */
+		if (remaining && tail - head < maxsize) {
+			const unsigned int readcount =
+				min_t(u64, remaining, maxsize * 2 - tail + head);
+			ssize_t n;
+
+			memmove(buf, buf + head, tail - head);
+			tail -= head;
+			head = 0;
+			n = erofs_read_sparse(fd, buf + tail, readcount);
+			if (n < 0) {
+				ret = n;
+				break;
+			}
+			tail += readcount;
+			remaining -= readcount;
+		}
+
+		len = z_erofs_dedupe_chunksize(buf + head, tail - head,
+					       !remaining);
+		DBG_BUGON(!len);
+		ret = z_erofs_dedupe_add_seen(f, buf + head, len);
+		if (ret)
+			break;
+		head += len;
+	}
+	free(buf);
+out:
+	close(fd);
+	return ret;
+}
+
+/*
+ * Scan all regular files under @path to learn which chunks occur more than
+ * once, so that compress.c only cuts pclusters at the boundaries of those.
+ */
+int z_erofs_dedupe_scan(const char *path)
+{
+	DIR *_dir;
+	int ret;
+
+	_dir = opendir(path);
+	if (!_dir) {
+		erofs_err("failed to opendir at %s: %s",
+			  path, erofs_strerror(errno));
+		return -errno;
+	}
+
+	ret = 0;
+	while (1) {
+		struct dirent *dp;
+		struct stat64 st;
+		char buf[PATH_MAX];
+
+		/*
+		 * set errno to 0 before calling readdir() in order to
+		 * distinguish end of stream and from an error.
+		 */
+		errno = 0;
+		dp = readdir(_dir);
+		if (!dp)
+			break;
+
+		if (is_dot_dotdot(dp->d_name) ||
+		    !strncmp(dp->d_name, "lost+found", strlen("lost+found")) ||
+		    erofs_is_exclude_path(path, dp->d_name))
+			continue;
+
+		ret = snprintf(buf, PATH_MAX, "%s/%s", path, dp->d_name);
+		if (ret < 0 || ret >= PATH_MAX) {
+			ret = -ENAMETOOLONG;
+			goto out;
+		}
+
+		if (lstat64(buf, &st)) {
+			ret = -errno;
+			goto out;
+		}
+
+		ret = 0;
+		if (S_ISDIR(st.st_mode))
+			ret = z_erofs_dedupe_scan(buf);
+		else if (S_ISREG(st.st_mode) && st.st_size)
+			ret = z_erofs_dedupe_scan_file(buf, &st);
+		if (ret) {
+			erofs_err("failed to scan %s for deduplication: %s",
+				  buf, erofs_strerror(ret));
+			goto out;
+		}
+	}
+
+	if (errno)
+		ret = -errno;
+out:
+	closedir(_dir);
+	return ret;
+}
+
+/* whether any chunk of the source file also occurs elsewhere */
+bool z_erofs_dedupe_file_is_shared(dev_t dev, ino_t ino)
+{
+	struct z_erofs_dedupe_file *f = z_erofs_dedupe_find_file(dev, ino);
+	unsigned int i;
+
+	for (i = 0; f && i < f->nr; ++i)
+		if (f->chunks[i]->count > 1)
+			return true;
+	return false;
+}
+
+/* calculate the digest of @chunk and tell if it occurs more than once */
+bool z_erofs_dedupe_chunk_is_shared(struct z_erofs_dedupe_chunk *chunk,
+				    const u8 *data, unsigned int len)
+{
+	struct z_erofs_dedupe_seen *se;
+
+	erofs_sha256(data, len, chunk->digest);
+	chunk->length = len;
+	chunk->nr = -1;
+
+	se = z_erofs_dedupe_find_seen(chunk->digest, len);
+	return se && se->count > 1;
+}
+
+/* look up a recorded chunk with the same data as @chunk */
+const struct z_erofs_dedupe_item *
+z_erofs_dedupe_match(const struct z_erofs_dedupe_chunk *chunk)
+{
+	struct z_erofs_dedupe_item *e;
+
+	hash_for_each_possible(z_erofs_dedupe_table, e, node,
+			       z_erofs_dedupe_key(chunk->digest))
+		if (e->length == chunk->length &&
+		    !memcmp(e->digest, chunk->digest, sizeof(e->digest)))
+			return e;
+	return NULL;
+}
+
+int z_erofs_dedupe_insert(const struct z_erofs_dedupe_chunk *chunk)
+{
+	struct z_erofs_dedupe_item *e;
+
+	DBG_BUGON(chunk->nr <= 0);
+	e = malloc(sizeof(*e) + chunk->nr * sizeof(chunk->pcs[0]));
+	if (!e)
+		return -ENOMEM;
+
+	memcpy(e->digest, chunk->digest, sizeof(e->digest));
+	e->length = chunk->length;
+	e->nr = chunk->nr;
+	memcpy(e->pcs, chunk->pcs, chunk->nr * sizeof(chunk->pcs[0]));
+
+	hash_add(z_erofs_dedupe_table, &e->node,
+		 z_erofs_dedupe_key(e->digest));
+	list_add_tail(&e->list, &z_erofs_dedupe_items);
+	return 0;
+}
+
+/* keep the chunks of the current file, or drop them if its data is revoked */
+void z_erofs_dedupe_commit(bool drop)
+{
+	struct list_head *const head = &z_erofs_dedupe_items;
+
+	while (drop && head->prev != z_erofs_dedupe_committed) {
+		struct z_erofs_dedupe_item *e =
+			list_entry(head->prev, struct z_erofs_dedupe_item, list);
+
+		hash_del(&e->node);
+		list_del(&e->list);
+		free(e);
+	}
+	z_erofs_dedupe_committed = head->prev;
+}
+
+int z_erofs_dedupe_init(void)
+{
+	hash_init(z_erofs_dedupe_table);
+	hash_init(z_erofs_dedupe_seen_table);
+	hash_init(z_erofs_dedupe_files);
+	return 0;
+}
+
+void z_erofs_dedupe_exit(void)
+{
+	struct z_erofs_dedupe_item *e, *n;
+	struct z_erofs_dedupe_seen *se;
+	struct z_erofs_dedupe_file *f;
+	struct hlist_node *tmp;
+	unsigned int bkt;
+
+	hash_for_each_safe(z_erofs_dedupe_files, bkt, tmp, f, node) {
+		hash_del(&f->node);
+		free(f->chunks);
+		free(f);
+	}
+	hash_for_each_safe(z_erofs_dedupe_seen_table, bkt, tmp, se, node) {
+		hash_del(&se->node);
+		free(se);
+	}
+
+	list_for_each_entry_safe(e, n, &z_erofs_dedupe_items, list) {
+		hash_del(&e->node);
+		list_del(&e->list);
+		free(e);
+	}
+	z_erofs_dedupe_committed = &z_erofs_dedupe_items;
+}
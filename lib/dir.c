@@ -0,0 +1,124 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * erofs-utils/lib/dir.c
+ */
+#include <stdlib.h>
+#include <sys/stat.h>
+
+#include "erofs/print.h"
+#include "erofs/dir.h"
+
+/* how many dirent blocks are read at once */
+#define EROFS_DIR_PREFETCH_BLOCKS	16
+
+/* walk the dirents in a dirent block of @maxsize bytes at cookie @blkpos */
+int erofs_iterate_dirents(struct erofs_dir_context *ctx, const void *dblk,
+			  unsigned int maxsize, erofs_off_t blkpos)
+{
+	struct erofs_inode *dir = ctx->dir;
+	const struct erofs_dirent *de = dblk;
+	const struct erofs_dirent *end;
+	unsigned int nameoff, ofs = 0;
+
+	nameoff = le16_to_cpu(de->nameoff);
+	if (nameoff < sizeof(struct erofs_dirent) || nameoff >= maxsize) {
+		erofs_err("invalid de[0].nameoff %u @ nid %llu",
+			  nameoff, dir->nid | 0ULL);
+		return -EFSCORRUPTED;
+	}
+	end = dblk + nameoff;
+
+	/*
+	 * resume from the middle of the first block if asked to. Dirents are
+	 * 12 bytes, so roundup() rather than round_up(), which only works
+	 * for powers of 2.
+	 */
+	if (ctx->pos > blkpos)
+		ofs = roundup(ctx->pos - blkpos, sizeof(struct erofs_dirent));
+
+	for (de = dblk + ofs; de < end; ++de) {
+		const char *de_name;
+		unsigned int de_namelen;
+		int ret;
+
+		nameoff = le16_to_cpu(de->nameoff);
+		if (nameoff >= maxsize)
+			goto bogus;
+		de_name = (const char *)dblk + nameoff;
+
+		/* the last dirent in the block? */
+		if (de + 1 >= end)
+			de_namelen = strnlen(de_name, maxsize - nameoff);
+		else
+			de_namelen = le16_to_cpu(de[1].nameoff) - nameoff;
+
+		/* a corrupted entry is found */
+		if (nameoff + de_namelen > maxsize ||
+		    de_namelen > EROFS_NAME_LEN)
+			goto bogus;
+
+		ctx->de_nid = le64_to_cpu(de->nid);
+		ctx->de_ftype = de->file_type;
+		ctx->dname = de_name;
+		ctx->de_namelen = de_namelen;
+		ctx->pos = blkpos + ((const void *)de - dblk);
+		ctx->next_pos = de + 1 < end ? ctx->pos + sizeof(*de) :
+					       blkpos + erofs_blksiz(dir->sbi);
+		ret = ctx->cb(ctx);
+		if (ret)
+			return ret;
+	}
+	return 0;
+bogus:
+	erofs_err("bogus dirent @ nid %llu", dir->nid | 0ULL);
+	DBG_BUGON(1);
+	return -EFSCORRUPTED;
+}
+
+/*
+ * Walk the dirents of ctx->dir from the cookie ctx->pos on and call
+ * ctx->cb for each of them, reading several dirent blocks at a time.
+ */
+int erofs_iterate_dir(struct erofs_dir_context *ctx)
+{
+	struct erofs_inode *dir = ctx->dir;
+	const unsigned int blksiz = erofs_blksiz(dir->sbi);
+	erofs_off_t pos = round_down(ctx->pos, blksiz);
+	unsigned int bufsize;
+	char *buf;
+	int ret = 0;
+
+	if (!S_ISDIR(dir->i_mode))
+		return -ENOTDIR;
+	if (pos >= dir->i_size)
+		return 0;
+
+	bufsize = min_t(erofs_off_t, dir->i_size - pos,
+			EROFS_DIR_PREFETCH_BLOCKS * blksiz);
+	buf = malloc(bufsize);
+	if (!buf)
+		return -ENOMEM;
+
+	while (pos < dir->i_size) {
+		unsigned int count = min_t(erofs_off_t, dir->i_size - pos,
+					   bufsize);
+		unsigned int i;
+
+		ret = erofs_pread(dir, buf, count, pos);
+		if (ret)
+			goto out;
+
+		for (i = 0; i < count; i += blksiz) {
+			ret = erofs_iterate_dirents(ctx, buf + i,
+					min_t(unsigned int, count - i, blksiz),
+					pos + i);
+			if (ret)
+				goto out;
+		}
+		pos += count;
+	}
+	ctx->pos = pos;
+out:
+	free(buf);
+	return ret;
+}
@@ -0,0 +1,94 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * erofs-utils/lib/fragments.c
+ *
+ * Tails of compressed files are appended to a temporary file, which is
+ * then written as the packed inode after all other files are built.
+ */
+#ifndef _LARGEFILE64_SOURCE
+#define _LARGEFILE64_SOURCE
+#endif
+#include <stdlib.h>
+#include <unistd.h>
+#include "erofs/print.h"
+#include "erofs/inode.h"
+#include "erofs/fragments.h"
+
+static FILE *packedfile;
+static erofs_off_t packedsize;
+
+erofs_off_t z_erofs_fragments_tell(void)
+{
+	return packedsize;
+}
+
+int z_erofs_pack_fragments(struct erofs_inode *inode, void *data,
+			   unsigned int len)
+{
+	ssize_t ret;
+
+	DBG_BUGON(inode->fragment_size);
+	ret = pwrite64(fileno(packedfile), data, len, packedsize);
+	if (ret != len)
+		return ret < 0 ? -errno : -EIO;
+
+	inode->fragmentoff = packedsize;
+	inode->fragment_size = len;
+	packedsize += len;
+	inode->z_advise |= Z_EROFS_ADVISE_FRAGMENT_PCLUSTER;
+
+	erofs_dbg("Recording %u fragment data at %llu of %s", len,
+		  inode->fragmentoff | 0ULL, inode->i_srcpath);
+	return len;
+}
+
+/* revoke the fragment of @inode, which should be the last one packed */
+void z_erofs_drop_fragments(struct erofs_inode *inode)
+{
+	if (!inode->fragment_size)
+		return;
+
+	DBG_BUGON(inode->fragmentoff + inode->fragment_size != packedsize);
+	packedsize = inode->fragmentoff;
+	inode->fragment_size = 0;
+	inode->fragmentoff = 0;
+	inode->z_advise &= ~Z_EROFS_ADVISE_FRAGMENT_PCLUSTER;
+}
+
+/* returns NULL if no fragment is recorded at all */
+struct erofs_inode *erofs_mkfs_build_packed_file(void)
+{
+	struct erofs_inode *inode;
+	int ret, fd = fileno(packedfile);
+
+	if (!packedsize)
+		return NULL;
+
+	ret = ftruncate64(fd, packedsize);
+	if (ret)
+		return ERR_PTR(-errno);
+	if (lseek64(fd, 0, SEEK_SET) < 0)
+		return ERR_PTR(-errno);
+
+	erofs_sb_set_fragments(&g_sbi);
+	inode = erofs_mkfs_build_special_from_fd(fd, EROFS_PACKED_INODE);
+	if (IS_ERR(inode))
+		erofs_sb_clear_fragments(&g_sbi);
+	return inode;
+}
+
+int z_erofs_fragments_init(void)
+{
+	packedfile = tmpfile();
+	if (!packedfile)
+		return -errno;
+	packedsize = 0;
+	return 0;
+}
+
+void z_erofs_fragments_exit(void)
+{
+	if (packedfile)
+		fclose(packedfile);
+	packedfile = NULL;
+}
@@ -19,6 +19,7 @@
 #include "erofs/cache.h"
 #include "erofs/io.h"
 #include "erofs/compress.h"
+#include "erofs/chunk.h"
 #include "erofs/xattr.h"
 #include "erofs/exclude.h"
 
@@ -245,10 +246,10 @@ static void fill_dirblock(char *buf, unsigned int size, unsigned int q,
 static int write_dirblock(unsigned int q, struct erofs_dentry *head,
 			  struct erofs_dentry *end, erofs_blk_t blkaddr)
 {
-	char buf[EROFS_BLKSIZ];
+	char buf[EROFS_MAX_BLOCK_SIZE];
 
 	fill_dirblock(buf, EROFS_BLKSIZ, q, head, end);
-	return blk_write(buf, blkaddr, 1);
+	return blk_write(&g_sbi, buf, blkaddr, 1);
 }
 
 int erofs_write_dir_file(struct erofs_inode *dir)
@@ -310,7 +311,7 @@ int erofs_write_file_from_buffer(struct erofs_inode *inode, char *buf)
 		return ret;
 
 	if (nblocks)
-		blk_write(buf, inode->u.i_blkaddr, nblocks);
+		blk_write(&g_sbi, buf, inode->u.i_blkaddr, nblocks);
 	inode->idata_size = inode->i_size % EROFS_BLKSIZ;
 	if (inode->idata_size) {
 		inode->idata = malloc(inode->idata_size);
@@ -341,7 +342,7 @@ static int write_uncompressed_file_from_fd(struct erofs_inode *inode, int fd)
 		return ret;
 
 	for (i = 0; i < nblocks; ++i) {
-		char buf[EROFS_BLKSIZ];
+		char buf[EROFS_MAX_BLOCK_SIZE];
 
 		ret = read(fd, buf, EROFS_BLKSIZ);
 		if (ret != EROFS_BLKSIZ) {
@@ -350,7 +351,7 @@ static int write_uncompressed_file_from_fd(struct erofs_inode *inode, int fd)
 			return -EAGAIN;
 		}
 
-		ret = blk_write(buf, inode->u.i_blkaddr + i, 1);
+		ret = blk_write(&g_sbi, buf, inode->u.i_blkaddr + i, 1);
 		if (ret)
 			return ret;
 	}
@@ -372,6 +373,27 @@ static int write_uncompressed_file_from_fd(struct erofs_inode *inode, int fd)
 	return 0;
 }
 
+static int erofs_write_file_from_fd(struct erofs_inode *inode, int fd)
+{
+	int ret;
+
+	if (cfg.c_compr_alg_master && erofs_file_is_compressible(inode)) {
+		ret = erofs_write_compressed_file(inode, fd);
+
+		if (!ret || ret != -ENOSPC)
+			return ret;
+
+		/* fallback to all data uncompressed */
+		if (lseek64(fd, 0, SEEK_SET) < 0)
+			return -errno;
+	}
+
+	/* files smaller than a block are still inlined */
+	if (cfg.c_chunkbits && inode->i_size >= EROFS_BLKSIZ)
+		return erofs_write_chunked_file(inode, fd);
+	return write_uncompressed_file_from_fd(inode, fd);
+}
+
 int erofs_write_file(struct erofs_inode *inode)
 {
 	int ret, fd;
@@ -381,19 +403,11 @@ int erofs_write_file(struct erofs_inode *inode)
 		return 0;
 	}
 
-	if (cfg.c_compr_alg_master && erofs_file_is_compressible(inode)) {
-		ret = erofs_write_compressed_file(inode);
-
-		if (!ret || ret != -ENOSPC)
-			return ret;
-	}
-
-	/* fallback to all data uncompressed */
 	fd = open(inode->i_srcpath, O_RDONLY | O_BINARY);
 	if (fd < 0)
 		return -errno;
 
-	ret = write_uncompressed_file_from_fd(inode, fd);
+	ret = erofs_write_file_from_fd(inode, fd);
 	close(fd);
 	return ret;
 }
@@ -434,6 +448,10 @@ static bool erofs_bh_flush_write_inode(struct erofs_buffer_head *bh)
 			if (is_inode_layout_compression(inode))
 				u.dic.i_u.compressed_blocks =
 					cpu_to_le32(inode->u.i_blocks);
+			else if (inode->datalayout ==
+					EROFS_INODE_CHUNK_BASED)
+				u.dic.i_u.c.format =
+					cpu_to_le16(inode->u.chunkformat);
 			else
 				u.dic.i_u.raw_blkaddr =
 					cpu_to_le32(inode->u.i_blkaddr);
@@ -467,6 +485,10 @@ static bool erofs_bh_flush_write_inode(struct erofs_buffer_head *bh)
 			if (is_inode_layout_compression(inode))
 				u.die.i_u.compressed_blocks =
 					cpu_to_le32(inode->u.i_blocks);
+			else if (inode->datalayout ==
+					EROFS_INODE_CHUNK_BASED)
+				u.die.i_u.c.format =
+					cpu_to_le16(inode->u.chunkformat);
 			else
 				u.die.i_u.raw_blkaddr =
 					cpu_to_le32(inode->u.i_blkaddr);
@@ -479,7 +501,7 @@ static bool erofs_bh_flush_write_inode(struct erofs_buffer_head *bh)
 		BUG_ON(1);
 	}
 
-	ret = dev_write(&u, off, inode->inode_isize);
+	ret = dev_write(&g_sbi, &u, off, inode->inode_isize);
 	if (ret)
 		return false;
 	off += inode->inode_isize;
@@ -490,7 +512,7 @@ static bool erofs_bh_flush_write_inode(struct erofs_buffer_head *bh)
 		if (IS_ERR(xattrs))
 			return false;
 
-		ret = dev_write(xattrs, off, inode->xattr_isize);
+		ret = dev_write(&g_sbi, xattrs, off, inode->xattr_isize);
 		free(xattrs);
 		if (ret)
 			return false;
@@ -499,9 +521,13 @@ static bool erofs_bh_flush_write_inode(struct erofs_buffer_head *bh)
 	}
 
 	if (inode->extent_isize) {
-		/* write compression metadata */
-		off = Z_EROFS_VLE_EXTENT_ALIGN(off);
-		ret = dev_write(inode->compressmeta, off, inode->extent_isize);
+		/* write compression metadata or the chunk block map */
+		if (inode->datalayout == EROFS_INODE_CHUNK_BASED)
+			off = round_up(off, EROFS_BLOCK_MAP_ENTRY_SIZE);
+		else
+			off = Z_EROFS_VLE_EXTENT_ALIGN(off);
+		ret = dev_write(&g_sbi, inode->compressmeta, off,
+				inode->extent_isize);
 		if (ret)
 			return false;
 		free(inode->compressmeta);
@@ -557,20 +583,27 @@ int erofs_prepare_inode_buffer(struct erofs_inode *inode)
 		inodesize = Z_EROFS_VLE_EXTENT_ALIGN(inodesize) +
 			    inode->extent_isize;
 
-	if (is_inode_layout_compression(inode))
+	if (is_inode_layout_compression(inode)) {
+		/* the compressor only leaves the tail pclusters that fit in */
+		if (!inode->idata_size)
+			goto noinline;
+	} else if (inode->datalayout == EROFS_INODE_CHUNK_BASED) {
+		/* all data is mapped by chunks */
+		DBG_BUGON(inode->idata_size);
 		goto noinline;
-
-	/*
-	 * if the file size is block-aligned for uncompressed files,
-	 * should use EROFS_INODE_FLAT_PLAIN data mapping mode.
-	 */
-	if (!inode->idata_size)
+	} else if (!inode->idata_size) {
+		/*
+		 * if the file size is block-aligned for uncompressed files,
+		 * should use EROFS_INODE_FLAT_PLAIN data mapping mode.
+		 */
 		inode->datalayout = EROFS_INODE_FLAT_PLAIN;
+	}
 
 	bh = erofs_balloc(INODE, inodesize, 0, inode->idata_size);
 	if (bh == ERR_PTR(-ENOSPC)) {
 		int ret;
 
+		DBG_BUGON(is_inode_layout_compression(inode));
 		inode->datalayout = EROFS_INODE_FLAT_PLAIN;
 noinline:
 		/* expend an extra block for tail-end data */
@@ -584,7 +617,8 @@ noinline:
 	} else if (IS_ERR(bh)) {
 		return PTR_ERR(bh);
 	} else if (inode->idata_size) {
-		inode->datalayout = EROFS_INODE_FLAT_INLINE;
+		if (!is_inode_layout_compression(inode))
+			inode->datalayout = EROFS_INODE_FLAT_INLINE;
 
 		/* allocate inline buffer */
 		ibh = erofs_battach(bh, META, inode->idata_size);
@@ -607,7 +641,7 @@ static bool erofs_bh_flush_write_inline(struct erofs_buffer_head *bh)
 	const erofs_off_t off = erofs_btell(bh, false);
 	int ret;
 
-	ret = dev_write(inode->idata, off, inode->idata_size);
+	ret = dev_write(&g_sbi, inode->idata, off, inode->idata_size);
 	if (ret)
 		return false;
 
@@ -623,6 +657,30 @@ static struct erofs_bhops erofs_write_inline_bhops = {
 	.flush = erofs_bh_flush_write_inline,
 };
 
+/* write tail-end data into the last block of bh_data */
+static int erofs_write_tail_block(struct erofs_inode *inode)
+{
+	struct erofs_buffer_head *const bh = inode->bh_data;
+	erofs_off_t pos;
+	int ret;
+
+	erofs_mapbh(bh->block);
+	pos = erofs_btell(bh, true) - EROFS_BLKSIZ;
+	ret = dev_write(&g_sbi, inode->idata, pos, inode->idata_size);
+	if (ret)
+		return ret;
+	if (inode->idata_size < EROFS_BLKSIZ) {
+		ret = dev_fillzero(&g_sbi, pos + inode->idata_size,
+				   EROFS_BLKSIZ - inode->idata_size, false);
+		if (ret)
+			return ret;
+	}
+	inode->idata_size = 0;
+	free(inode->idata);
+	inode->idata = NULL;
+	return 0;
+}
+
 int erofs_write_tail_end(struct erofs_inode *inode)
 {
 	struct erofs_buffer_head *bh, *ibh;
@@ -639,24 +697,10 @@ int erofs_write_tail_end(struct erofs_inode *inode)
 		ibh->fsprivate = erofs_igrab(inode);
 		ibh->op = &erofs_write_inline_bhops;
 	} else {
-		int ret;
-		erofs_off_t pos;
+		int ret = erofs_write_tail_block(inode);
 
-		erofs_mapbh(bh->block);
-		pos = erofs_btell(bh, true) - EROFS_BLKSIZ;
-		ret = dev_write(inode->idata, pos, inode->idata_size);
 		if (ret)
 			return ret;
-		if (inode->idata_size < EROFS_BLKSIZ) {
-			ret = dev_fillzero(pos + inode->idata_size,
-					   EROFS_BLKSIZ - inode->idata_size,
-					   false);
-			if (ret)
-				return ret;
-		}
-		inode->idata_size = 0;
-		free(inode->idata);
-		inode->idata = NULL;
 	}
 out:
 	/* now bh_data can drop directly */
@@ -769,11 +813,11 @@ int erofs_fill_inode(struct erofs_inode *inode,
 
 	switch (cfg.c_timeinherit) {
 	case TIMESTAMP_CLAMPING:
-		if (st->st_ctime < sbi.build_time)
+		if (st->st_ctime < g_sbi.build_time)
 			break;
 	case TIMESTAMP_FIXED:
-		inode->i_ctime = sbi.build_time;
-		inode->i_ctime_nsec = sbi.build_time_nsec;
+		inode->i_ctime = g_sbi.build_time;
+		inode->i_ctime_nsec = g_sbi.build_time_nsec;
 	default:
 		break;
 	}
@@ -828,6 +872,7 @@ struct erofs_inode *erofs_new_inode(void)
 	if (!inode)
 		return ERR_PTR(-ENOMEM);
 
+	inode->sbi = &g_sbi;
 	inode->i_parent = NULL;	/* also used to indicate a new inode */
 
 	inode->i_ino[0] = counter++;	/* inode serial number */
@@ -842,6 +887,9 @@ struct erofs_inode *erofs_new_inode(void)
 
 	inode->bh = inode->bh_inline = inode->bh_data = NULL;
 	inode->idata = NULL;
+	inode->prebuilt = false;
+	inode->fragmentoff = 0;
+	inode->fragment_size = 0;
 	return inode;
 }
 
@@ -898,7 +946,7 @@ void erofs_fixup_meta_blkaddr(struct erofs_inode *rootdir)
 		meta_offset = round_up(off - rootnid_maxoffset, EROFS_BLKSIZ);
 	else
 		meta_offset = 0;
-	sbi.meta_blkaddr = erofs_blknr(meta_offset);
+	g_sbi.meta_blkaddr = erofs_blknr(meta_offset);
 	rootdir->nid = (off - meta_offset) >> EROFS_ISLOTBITS;
 }
 
@@ -913,7 +961,7 @@ erofs_nid_t erofs_lookupnid(struct erofs_inode *inode)
 	erofs_mapbh(bh->block);
 	off = erofs_btell(bh, false);
 
-	meta_offset = blknr_to_addr(sbi.meta_blkaddr);
+	meta_offset = blknr_to_addr(g_sbi.meta_blkaddr);
 	DBG_BUGON(off < meta_offset);
 	return inode->nid = (off - meta_offset) >> EROFS_ISLOTBITS;
 }
@@ -926,6 +974,351 @@ void erofs_d_invalidate(struct erofs_dentry *d)
 	erofs_iput(inode);
 }
 
+static int erofs_mkfs_build_nondir(struct erofs_inode *inode)
+{
+	int ret;
+
+	/* only the inode is left if the data has been written in advance */
+	if (inode->prebuilt)
+		goto out;
+
+	ret = erofs_prepare_xattr_ibody(inode);
+	if (ret < 0)
+		return ret;
+
+	if (S_ISLNK(inode->i_mode)) {
+		char *const symlink = malloc(inode->i_size);
+
+		if (!symlink)
+			return -ENOMEM;
+		ret = readlink(inode->i_srcpath, symlink, inode->i_size);
+		if (ret < 0) {
+			free(symlink);
+			return -errno;
+		}
+
+		ret = erofs_write_file_from_buffer(inode, symlink);
+		free(symlink);
+		if (ret)
+			return ret;
+	} else {
+		ret = erofs_write_file(inode);
+		if (ret)
+			return ret;
+	}
+out:
+	erofs_prepare_inode_buffer(inode);
+	erofs_write_tail_end(inode);
+	return 0;
+}
+
+static char **sort_list;
+static unsigned int sort_list_size;
+
+/* read the files whose data should be laid out first, one path per line */
+int erofs_load_sort_file(const char *filename)
+{
+	FILE *fp = fopen(filename, "r");
+	char *line = NULL, *s, **list;
+	size_t n = 0;
+	ssize_t len;
+	int ret = 0;
+
+	if (!fp)
+		return -errno;
+
+	while ((len = getline(&line, &n, fp)) >= 0) {
+		while (len && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+			line[--len] = '\0';
+		for (s = line; *s == '/'; ++s)
+			;
+		if (!*s || *s == '#')
+			continue;
+
+		list = realloc(sort_list, (sort_list_size + 1) * sizeof(*list));
+		if (!list) {
+			ret = -ENOMEM;
+			break;
+		}
+		sort_list = list;
+		sort_list[sort_list_size] = strdup(s);
+		if (!sort_list[sort_list_size]) {
+			ret = -ENOMEM;
+			break;
+		}
+		++sort_list_size;
+	}
+	free(line);
+	fclose(fp);
+	return ret;
+}
+
+void erofs_cleanup_sort_file(void)
+{
+	while (sort_list_size)
+		free(sort_list[--sort_list_size]);
+	free(sort_list);
+	sort_list = NULL;
+}
+
+/*
+ * whether @path stays under @srcroot (which is resolved already) once ".."
+ * components and symlinks are resolved, so that no host file outside the
+ * source directory is read.
+ */
+static bool erofs_sort_path_is_valid(const char *path, const char *srcroot)
+{
+	const size_t len = strlen(srcroot);
+	char resolved[PATH_MAX];
+
+	if (!realpath(path, resolved))
+		return false;
+	/* the source directory is "/" */
+	if (len == 1)
+		return true;
+	return !strncmp(resolved, srcroot, len) &&
+		(resolved[len] == '/' || !resolved[len]);
+}
+
+/* inodes whose data has been written in advance, with references held */
+static struct erofs_inode **prebuilt_inodes;
+static unsigned int nr_prebuilt, max_prebuilt;
+
+/*
+ * Write the data of a regular file ahead of the tree walk, which then only
+ * allocates the inode.  If the tail-end data can't be inlined, write the
+ * tail block right now since bh_data can't be expanded once other data
+ * follows.
+ */
+static int erofs_mkfs_prebuild_file(const char *path)
+{
+	struct erofs_inode *inode, **inodes;
+	unsigned int inodesize;
+	int ret;
+
+	inode = erofs_iget_from_path(path, true);
+	if (IS_ERR(inode))
+		return PTR_ERR(inode);
+
+	/* a hardlink which has been handled */
+	if (inode->prebuilt) {
+		erofs_iput(inode);
+		return 0;
+	}
+
+	if (nr_prebuilt >= max_prebuilt) {
+		max_prebuilt = max_prebuilt ? max_prebuilt << 1 : 64;
+		inodes = realloc(prebuilt_inodes,
+				 max_prebuilt * sizeof(*inodes));
+		if (!inodes) {
+			ret = -ENOMEM;
+			goto err_iput;
+		}
+		prebuilt_inodes = inodes;
+	}
+
+	ret = erofs_prepare_xattr_ibody(inode);
+	if (ret < 0)
+		goto err_iput;
+
+	ret = erofs_write_file(inode);
+	if (ret)
+		goto err_iput;
+
+	inodesize = inode->inode_isize + inode->xattr_isize;
+	if (inode->extent_isize)
+		inodesize = Z_EROFS_VLE_EXTENT_ALIGN(inodesize) +
+			    inode->extent_isize;
+	if (inode->idata_size &&
+	    inodesize % EROFS_BLKSIZ + inode->idata_size > EROFS_BLKSIZ) {
+		ret = erofs_prepare_tail_block(inode);
+		if (!ret)
+			ret = erofs_write_tail_block(inode);
+		if (ret)
+			goto err_iput;
+	}
+
+	if (inode->bh_data) {
+		erofs_bdrop(inode->bh_data, false);
+		inode->bh_data = NULL;
+	}
+	inode->prebuilt = true;
+	prebuilt_inodes[nr_prebuilt++] = inode;
+	erofs_dbg("prebuild file %s", inode->i_srcpath);
+	return 0;
+
+err_iput:
+	erofs_iput(inode);
+	return ret;
+}
+
+/* lay out the data of the files listed by --sort-file in the given order */
+static int erofs_mkfs_prebuild_sorted(void)
+{
+	char srcroot[PATH_MAX];
+	unsigned int i;
+
+	if (!sort_list_size)
+		return 0;
+
+	if (!realpath(cfg.c_src_path, srcroot))
+		return -errno;
+
+	for (i = 0; i < sort_list_size; ++i) {
+		struct stat64 st;
+		char buf[PATH_MAX];
+		int ret;
+
+		ret = snprintf(buf, PATH_MAX, "%s/%s",
+			       cfg.c_src_path, sort_list[i]);
+		if (ret < 0 || ret >= PATH_MAX) {
+			erofs_warn("ignore invalid sort-file entry %s",
+				   sort_list[i]);
+			continue;
+		}
+
+		if (erofs_is_exclude_path(NULL, buf))
+			continue;
+
+		if (lstat64(buf, &st)) {
+			erofs_warn("failed to find sort-file entry %s: %s",
+				   sort_list[i], erofs_strerror(-errno));
+			continue;
+		}
+
+		if (!S_ISREG(st.st_mode)) {
+			erofs_warn("ignore non-regular file %s in sort-file",
+				   sort_list[i]);
+			continue;
+		}
+
+		if (!erofs_sort_path_is_valid(buf, srcroot)) {
+			erofs_warn("ignore sort-file entry %s outside the source directory",
+				   sort_list[i]);
+			continue;
+		}
+
+		ret = erofs_mkfs_prebuild_file(buf);
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
+static int comp_name(const void *a, const void *b)
+{
+	return strcmp(*(const char **)a, *(const char **)b);
+}
+
+/* lay out the data of all files under @path in the order of the tree walk */
+static int erofs_mkfs_prebuild_dir(const char *path)
+{
+	DIR *_dir;
+	struct dirent *dp;
+	char **names = NULL, **n;
+	unsigned int nr = 0, i;
+	int ret = 0;
+
+	_dir = opendir(path);
+	if (!_dir) {
+		erofs_err("failed to opendir at %s: %s",
+			  path, erofs_strerror(errno));
+		return -errno;
+	}
+
+	while (1) {
+		errno = 0;
+		dp = readdir(_dir);
+		if (!dp)
+			break;
+
+		if (is_dot_dotdot(dp->d_name) ||
+		    !strncmp(dp->d_name, "lost+found", strlen("lost+found")) ||
+		    erofs_is_exclude_path(path, dp->d_name))
+			continue;
+
+		n = realloc(names, (nr + 1) * sizeof(*names));
+		if (!n) {
+			ret = -ENOMEM;
+			break;
+		}
+		names = n;
+		names[nr] = strdup(dp->d_name);
+		if (!names[nr]) {
+			ret = -ENOMEM;
+			break;
+		}
+		++nr;
+	}
+	if (!ret && errno)
+		ret = -errno;
+	closedir(_dir);
+
+	if (!ret)
+		qsort(names, nr, sizeof(*names), comp_name);
+
+	for (i = 0; i < nr; ++i) {
+		struct stat64 st;
+		char buf[PATH_MAX];
+
+		if (ret)
+			goto next;
+
+		ret = snprintf(buf, PATH_MAX, "%s/%s", path, names[i]);
+		if (ret < 0 || ret >= PATH_MAX) {
+			/* ignore the too long path, just as the tree walk */
+			ret = 0;
+			goto next;
+		}
+
+		ret = lstat64(buf, &st);
+		if (ret) {
+			ret = -errno;
+			goto next;
+		}
+
+		if (S_ISDIR(st.st_mode))
+			ret = erofs_mkfs_prebuild_dir(buf);
+		else if (S_ISREG(st.st_mode))
+			ret = erofs_mkfs_prebuild_file(buf);
+next:
+		free(names[i]);
+	}
+	free(names);
+	return ret;
+}
+
+static int erofs_mkfs_prebuild(void)
+{
+	int ret = erofs_mkfs_prebuild_sorted();
+
+	if (ret || !cfg.c_segregate_meta)
+		return ret;
+	return erofs_mkfs_prebuild_dir(cfg.c_src_path);
+}
+
+/* drop the references of prebuilt inodes, @done if the tree is complete */
+static void erofs_mkfs_put_prebuilt(bool done)
+{
+	unsigned int i;
+
+	for (i = 0; i < nr_prebuilt; ++i) {
+		struct erofs_inode *inode = prebuilt_inodes[i];
+
+		/* not reached by the tree walk (e.g. under an excluded dir) */
+		if (done && !inode->i_parent) {
+			erofs_warn("%s in sort-file isn't included in the image",
+				   inode->i_srcpath);
+			free(inode->idata);
+			inode->idata = NULL;
+		}
+		erofs_iput(inode);
+	}
+	free(prebuilt_inodes);
+	prebuilt_inodes = NULL;
+	nr_prebuilt = max_prebuilt = 0;
+}
+
 struct erofs_inode *erofs_mkfs_build_tree(struct erofs_inode *dir)
 {
 	int ret;
@@ -934,37 +1327,17 @@ struct erofs_inode *erofs_mkfs_build_tree(struct erofs_inode *dir)
 	struct erofs_dentry *d;
 	unsigned int nr_subdirs;
 
-	ret = erofs_prepare_xattr_ibody(dir);
-	if (ret < 0)
-		return ERR_PTR(ret);
-
 	if (!S_ISDIR(dir->i_mode)) {
-		if (S_ISLNK(dir->i_mode)) {
-			char *const symlink = malloc(dir->i_size);
-
-			if (!symlink)
-				return ERR_PTR(-ENOMEM);
-			ret = readlink(dir->i_srcpath, symlink, dir->i_size);
-			if (ret < 0) {
-				free(symlink);
-				return ERR_PTR(-errno);
-			}
-
-			ret = erofs_write_file_from_buffer(dir, symlink);
-			free(symlink);
-			if (ret)
-				return ERR_PTR(ret);
-		} else {
-			ret = erofs_write_file(dir);
-			if (ret)
-				return ERR_PTR(ret);
-		}
-
-		erofs_prepare_inode_buffer(dir);
-		erofs_write_tail_end(dir);
+		ret = erofs_mkfs_build_nondir(dir);
+		if (ret)
+			return ERR_PTR(ret);
 		return dir;
 	}
 
+	ret = erofs_prepare_xattr_ibody(dir);
+	if (ret < 0)
+		return ERR_PTR(ret);
+
 	_dir = opendir(dir->i_srcpath);
 	if (!_dir) {
 		erofs_err("failed to opendir at %s: %s",
@@ -1009,6 +1382,14 @@ struct erofs_inode *erofs_mkfs_build_tree(struct erofs_inode *dir)
 	}
 	closedir(_dir);
 
+	/* write all file data ahead so that metadata is packed after it */
+	if (IS_ROOT(dir) && cfg.c_segregate_meta) {
+		erofs_bseal();
+		ret = erofs_mkfs_prebuild();
+		if (ret)
+			goto err;
+	}
+
 	ret = erofs_prepare_dir_file(dir, nr_subdirs);
 	if (ret)
 		goto err;
@@ -1017,9 +1398,17 @@ struct erofs_inode *erofs_mkfs_build_tree(struct erofs_inode *dir)
 	if (ret)
 		goto err;
 
-	if (IS_ROOT(dir))
+	if (IS_ROOT(dir)) {
 		erofs_fixup_meta_blkaddr(dir);
 
+		/* the root inode has to be placed first for meta_blkaddr */
+		if (!cfg.c_segregate_meta) {
+			ret = erofs_mkfs_prebuild();
+			if (ret)
+				goto err;
+		}
+	}
+
 	list_for_each_entry(d, &dir->i_subdirs, d_child) {
 		char buf[PATH_MAX];
 		unsigned char ftype;
@@ -1054,6 +1443,8 @@ fail:
 			   dir->i_srcpath, d->name, (unsigned long long)d->nid,
 			   d->type);
 	}
+	if (IS_ROOT(dir))
+		erofs_mkfs_put_prebuilt(true);
 	erofs_write_dir_file(dir);
 	erofs_write_tail_end(dir);
 	return dir;
@@ -1061,6 +1452,8 @@ fail:
 err_closedir:
 	closedir(_dir);
 err:
+	if (IS_ROOT(dir))
+		erofs_mkfs_put_prebuilt(false);
 	return ERR_PTR(ret);
 }
 
@@ -1087,3 +1480,54 @@ struct erofs_inode *erofs_mkfs_build_tree_from_path(struct erofs_inode *parent,
 	return erofs_mkfs_build_tree(inode);
 }
 
+
+/* build a regular inode which isn't in the source tree from @fd */
+struct erofs_inode *erofs_mkfs_build_special_from_fd(int fd, const char *name)
+{
+	struct stat64 st;
+	struct erofs_inode *inode;
+	int ret;
+
+	ret = fstat64(fd, &st);
+	if (ret)
+		return ERR_PTR(-errno);
+
+	inode = erofs_new_inode();
+	if (IS_ERR(inode))
+		return inode;
+
+	init_list_head(&inode->i_hash);
+	inode->i_parent = inode;
+	inode->i_mode = S_IFREG | 0000;
+	inode->i_uid = inode->i_gid = 0;
+	inode->i_ctime = g_sbi.build_time;
+	inode->i_ctime_nsec = g_sbi.build_time_nsec;
+	inode->i_nlink = 1;
+	inode->i_size = st.st_size;
+	inode->capabilities = 0;
+	strncpy(inode->i_srcpath, name, sizeof(inode->i_srcpath) - 1);
+	inode->i_srcpath[sizeof(inode->i_srcpath) - 1] = '\0';
+
+	if (erofs_should_use_inode_extended(inode)) {
+		if (cfg.c_force_inodeversion == FORCE_INODE_COMPACT) {
+			erofs_err("file %s cannot be in compact form",
+				  inode->i_srcpath);
+			ret = -EINVAL;
+			goto err_iput;
+		}
+		inode->inode_isize = sizeof(struct erofs_inode_extended);
+	} else {
+		inode->inode_isize = sizeof(struct erofs_inode_compact);
+	}
+
+	ret = erofs_write_file_from_fd(inode, fd);
+	if (ret)
+		goto err_iput;
+	erofs_prepare_inode_buffer(inode);
+	erofs_write_tail_end(inode);
+	return inode;
+
+err_iput:
+	erofs_iput(inode);
+	return ERR_PTR(ret);
+}
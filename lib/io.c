@@ -14,6 +14,7 @@
 #endif
 #include <sys/stat.h>
 #include <sys/ioctl.h>
+#include <sys/uio.h>
 #include "erofs/io.h"
 #ifdef HAVE_LINUX_FS_H
 #include <linux/fs.h>
@@ -25,10 +26,6 @@
 #define pr_fmt(fmt) "EROFS IO: " FUNC_LINE_FMT fmt "\n"
 #include "erofs/print.h"
 
-static const char *erofs_devname;
-static int erofs_devfd = -1;
-static u64 erofs_devsz;
-
 int dev_get_blkdev_size(int fd, u64 *bytes)
 {
 	errno = ENOTSUP;
@@ -49,15 +46,15 @@ int dev_get_blkdev_size(int fd, u64 *bytes)
 	return -errno;
 }
 
-void dev_close(void)
+void dev_close(struct erofs_sb_info *sbi)
 {
-	close(erofs_devfd);
-	erofs_devname = NULL;
-	erofs_devfd   = -1;
-	erofs_devsz   = 0;
+	close(sbi->devfd);
+	sbi->devname = NULL;
+	sbi->devfd   = -1;
+	sbi->devsz   = 0;
 }
 
-int dev_open(const char *dev)
+int dev_open(struct erofs_sb_info *sbi, const char *dev)
 {
 	struct stat st;
 	int fd, ret;
@@ -77,13 +74,13 @@ int dev_open(const char *dev)
 
 	switch (st.st_mode & S_IFMT) {
 	case S_IFBLK:
-		ret = dev_get_blkdev_size(fd, &erofs_devsz);
+		ret = dev_get_blkdev_size(fd, &sbi->devsz);
 		if (ret) {
 			erofs_err("failed to get block device size(%s).", dev);
 			close(fd);
 			return ret;
 		}
-		erofs_devsz = round_down(erofs_devsz, EROFS_BLKSIZ);
+		sbi->devsz = round_down(sbi->devsz, erofs_blksiz(sbi));
 		break;
 	case S_IFREG:
 		ret = ftruncate(fd, 0);
@@ -93,7 +90,7 @@ int dev_open(const char *dev)
 			return -errno;
 		}
 		/* INT64_MAX is the limit of kernel vfs */
-		erofs_devsz = INT64_MAX;
+		sbi->devsz = INT64_MAX;
 		break;
 	default:
 		erofs_err("bad file type (%s, %o).", dev, st.st_mode);
@@ -101,35 +98,66 @@ int dev_open(const char *dev)
 		return -EINVAL;
 	}
 
-	erofs_devname = dev;
-	erofs_devfd = fd;
+	sbi->devname = dev;
+	sbi->devfd = fd;
 
 	erofs_info("successfully to open %s", dev);
 	return 0;
 }
 
 /* XXX: temporary soluation. Disk I/O implementation needs to be refactored. */
-int dev_open_ro(const char *dev)
+int dev_open_ro(struct erofs_sb_info *sbi, const char *dev)
 {
 	int fd = open(dev, O_RDONLY | O_BINARY);
+	struct stat st;
+	int ret;
 
 	if (fd < 0) {
 		erofs_err("failed to open(%s).", dev);
 		return -errno;
 	}
 
-	erofs_devfd = fd;
-	erofs_devname = dev;
-	erofs_devsz = INT64_MAX;
+	if (fstat(fd, &st)) {
+		erofs_err("failed to fstat(%s).", dev);
+		close(fd);
+		return -errno;
+	}
+
+	/* so that out-of-bound offsets of corrupted images are caught */
+	switch (st.st_mode & S_IFMT) {
+	case S_IFBLK:
+		ret = dev_get_blkdev_size(fd, &sbi->devsz);
+		if (ret) {
+			erofs_err("failed to get block device size(%s).", dev);
+			close(fd);
+			return ret;
+		}
+		break;
+	case S_IFREG:
+		sbi->devsz = st.st_size;
+		break;
+	default:
+		sbi->devsz = INT64_MAX;
+		break;
+	}
+
+	sbi->devfd = fd;
+	sbi->devname = dev;
 	return 0;
 }
 
-u64 dev_length(void)
+u64 dev_length(struct erofs_sb_info *sbi)
+{
+	return sbi->devsz;
+}
+
+int dev_fd(struct erofs_sb_info *sbi)
 {
-	return erofs_devsz;
+	return sbi->devfd;
 }
 
-int dev_write(const void *buf, u64 offset, size_t len)
+int dev_write(struct erofs_sb_info *sbi, const void *buf,
+	      u64 offset, size_t len)
 {
 	int ret;
 
@@ -141,56 +169,57 @@ int dev_write(const void *buf, u64 offset, size_t len)
 		return -EINVAL;
 	}
 
-	if (offset >= erofs_devsz || len > erofs_devsz ||
-	    offset > erofs_devsz - len) {
+	if (offset >= sbi->devsz || len > sbi->devsz ||
+	    offset > sbi->devsz - len) {
 		erofs_err("Write posion[%" PRIu64 ", %zd] is too large beyond the end of device(%" PRIu64 ").",
-			  offset, len, erofs_devsz);
+			  offset, len, sbi->devsz);
 		return -EINVAL;
 	}
 
-	ret = pwrite64(erofs_devfd, buf, len, (off64_t)offset);
+	ret = pwrite64(sbi->devfd, buf, len, (off64_t)offset);
 	if (ret != (int)len) {
 		if (ret < 0) {
 			erofs_err("Failed to write data into device - %s:[%" PRIu64 ", %zd].",
-				  erofs_devname, offset, len);
+				  sbi->devname, offset, len);
 			return -errno;
 		}
 
 		erofs_err("Writing data into device - %s:[%" PRIu64 ", %zd] - was truncated.",
-			  erofs_devname, offset, len);
+			  sbi->devname, offset, len);
 		return -ERANGE;
 	}
 	return 0;
 }
 
-int dev_fillzero(u64 offset, size_t len, bool padding)
+int dev_fillzero(struct erofs_sb_info *sbi, u64 offset, size_t len,
+		 bool padding)
 {
-	static const char zero[EROFS_BLKSIZ] = {0};
+	static const char zero[EROFS_MAX_BLOCK_SIZE] = {0};
 	int ret;
 
 	if (cfg.c_dry_run)
 		return 0;
 
 #if defined(HAVE_FALLOCATE) && defined(FALLOC_FL_PUNCH_HOLE)
-	if (!padding && fallocate(erofs_devfd, FALLOC_FL_PUNCH_HOLE |
+	if (!padding && fallocate(sbi->devfd, FALLOC_FL_PUNCH_HOLE |
 				  FALLOC_FL_KEEP_SIZE, offset, len) >= 0)
 		return 0;
 #endif
 	while (len > EROFS_BLKSIZ) {
-		ret = dev_write(zero, offset, EROFS_BLKSIZ);
+		ret = dev_write(sbi, zero, offset, EROFS_BLKSIZ);
 		if (ret)
 			return ret;
 		len -= EROFS_BLKSIZ;
 		offset += EROFS_BLKSIZ;
 	}
-	return dev_write(zero, offset, len);
+	return dev_write(sbi, zero, offset, len);
 }
 
-int dev_fsync(void)
+int dev_fsync(struct erofs_sb_info *sbi)
 {
 	int ret;
 
-	ret = fsync(erofs_devfd);
+	ret = fsync(sbi->devfd);
 	if (ret) {
 		erofs_err("Could not fsync device!!!");
 		return -EIO;
@@ -198,36 +227,36 @@ int dev_fsync(void)
 	return 0;
 }
 
-int dev_resize(unsigned int blocks)
+int dev_resize(struct erofs_sb_info *sbi, unsigned int blocks)
 {
 	int ret;
 	struct stat st;
 	u64 length;
 
-	if (cfg.c_dry_run || erofs_devsz != INT64_MAX)
+	if (cfg.c_dry_run || sbi->devsz != INT64_MAX)
 		return 0;
 
-	ret = fstat(erofs_devfd, &st);
+	ret = fstat(sbi->devfd, &st);
 	if (ret) {
 		erofs_err("failed to fstat.");
 		return -errno;
 	}
 
-	length = (u64)blocks * EROFS_BLKSIZ;
+	length = erofs_sbi_pos(sbi, blocks);
 	if (st.st_size == length)
 		return 0;
 	if (st.st_size > length)
-		return ftruncate(erofs_devfd, length);
+		return ftruncate(sbi->devfd, length);
 
 	length = length - st.st_size;
 #if defined(HAVE_FALLOCATE)
-	if (fallocate(erofs_devfd, 0, st.st_size, length) >= 0)
+	if (fallocate(sbi->devfd, 0, st.st_size, length) >= 0)
 		return 0;
 #endif
-	return dev_fillzero(st.st_size, length, true);
+	return dev_fillzero(sbi, st.st_size, length, true);
 }
 
-int dev_read(void *buf, u64 offset, size_t len)
+int dev_read(struct erofs_sb_info *sbi, void *buf, u64 offset, size_t len)
 {
 	int ret;
 
@@ -238,19 +267,100 @@ int dev_read(void *buf, u64 offset, size_t len)
 		erofs_err("buf is NULL");
 		return -EINVAL;
 	}
-	if (offset >= erofs_devsz || len > erofs_devsz ||
-	    offset > erofs_devsz - len) {
+	if (offset >= sbi->devsz || len > sbi->devsz ||
+	    offset > sbi->devsz - len) {
 		erofs_err("read posion[%" PRIu64 ", %zd] is too large beyond"
 			  "the end of device(%" PRIu64 ").",
-			  offset, len, erofs_devsz);
+			  offset, len, sbi->devsz);
 		return -EINVAL;
 	}
 
-	ret = pread64(erofs_devfd, buf, len, (off64_t)offset);
+	ret = pread64(sbi->devfd, buf, len, (off64_t)offset);
 	if (ret != (int)len) {
 		erofs_err("Failed to read data from device - %s:[%" PRIu64 ", %zd].",
-			  erofs_devname, offset, len);
+			  sbi->devname, offset, len);
+		return -errno;
+	}
+	return 0;
+}
+
+/* read physically contiguous data into several buffers with one I/O */
+int dev_readv(struct erofs_sb_info *sbi, const struct iovec *iov,
+	      int iovcnt, u64 offset)
+{
+	ssize_t ret;
+	size_t len = 0;
+	int i;
+
+	if (cfg.c_dry_run)
+		return 0;
+
+	for (i = 0; i < iovcnt; ++i)
+		len += iov[i].iov_len;
+	if (offset >= sbi->devsz || len > sbi->devsz ||
+	    offset > sbi->devsz - len) {
+		erofs_err("read posion[%" PRIu64 ", %zd] is too large beyond"
+			  "the end of device(%" PRIu64 ").",
+			  offset, len, sbi->devsz);
+		return -EINVAL;
+	}
+
+	ret = preadv64(sbi->devfd, iov, iovcnt, (off64_t)offset);
+	if (ret != (ssize_t)len) {
+		erofs_err("Failed to read data from device - %s:[%" PRIu64 ", %zd].",
+			  sbi->devname, offset, len);
 		return -errno;
 	}
 	return 0;
 }
+
+/*
+ * read @len bytes from the current offset of the source file @fd, and zero
+ * the ranges in holes instead of reading them. Return how many bytes are in
+ * holes, which are all of them if the whole range is a hole.
+ */
+ssize_t erofs_read_sparse(int fd, void *buf, size_t len)
+{
+	char *cur = buf;
+	off64_t pos = lseek64(fd, 0, SEEK_CUR);
+	size_t holes = 0;
+
+	if (pos < 0)
+		return -errno;
+
+	while (len) {
+		off64_t data = pos, end = -1;
+		size_t n = len;
+		ssize_t ret;
+
+#if defined(SEEK_DATA) && defined(SEEK_HOLE)
+		data = lseek64(fd, pos, SEEK_DATA);
+		if (data < 0)
+			/* ENXIO means that only a hole is left */
+			data = errno == ENXIO ? pos + len : pos;
+		else if (data == pos)
+			end = lseek64(fd, pos, SEEK_HOLE);
+#endif
+		if (data > pos) {
+			n = min_t(u64, data - pos, len);
+			memset(cur, 0, n);
+			holes += n;
+		} else {
+			if (end > pos)
+				n = min_t(u64, end - pos, len);
+
+			if (lseek64(fd, pos, SEEK_SET) < 0)
+				return -errno;
+			ret = read(fd, cur, n);
+			if (ret != n)
+				return ret < 0 ? -errno : -EIO;
+		}
+		cur += n;
+		pos += n;
+		len -= n;
+	}
+
+	if (lseek64(fd, pos, SEEK_SET) < 0)
+		return -errno;
+	return holes;
+}
@@ -14,6 +14,7 @@
 
 #include "erofs/print.h"
 #include "erofs/io.h"
+#include "erofs/dir.h"
 
 dev_t erofs_new_decode_dev(u32 dev)
 {
@@ -23,19 +24,17 @@ dev_t erofs_new_decode_dev(u32 dev)
 	return makedev(major, minor);
 }
 
-int erofs_read_inode_from_disk(struct erofs_inode *vi)
+/*
+ * parse the on-disk inode in @buf, which should hold the whole inode, i.e.
+ * also the extended part if erofs_inode_is_extended() says so.
+ */
+int erofs_read_inode_from_buf(struct erofs_inode *vi, const void *buf)
 {
-	int ret, ifmt;
-	char buf[sizeof(struct erofs_inode_extended)];
-	struct erofs_inode_compact *dic;
-	struct erofs_inode_extended *die;
-	const erofs_off_t inode_loc = iloc(vi->nid);
-
-	ret = dev_read(buf, inode_loc, sizeof(*dic));
-	if (ret < 0)
-		return -EIO;
+	int ifmt;
+	const struct erofs_inode_compact *dic = buf;
+	const struct erofs_inode_extended *die;
+	struct erofs_sb_info *sbi = vi->sbi;
 
-	dic = (struct erofs_inode_compact *)buf;
 	ifmt = le16_to_cpu(dic->i_format);
 
 	vi->datalayout = erofs_inode_datalayout(ifmt);
@@ -47,13 +46,7 @@ int erofs_read_inode_from_disk(struct erofs_inode *vi)
 	switch (erofs_inode_version(ifmt)) {
 	case EROFS_INODE_LAYOUT_EXTENDED:
 		vi->inode_isize = sizeof(struct erofs_inode_extended);
-
-		ret = dev_read(buf + sizeof(*dic), inode_loc + sizeof(*dic),
-			       sizeof(*die) - sizeof(*dic));
-		if (ret < 0)
-			return -EIO;
-
-		die = (struct erofs_inode_extended *)buf;
+		die = buf;
 		vi->xattr_isize = erofs_xattr_ibody_size(die->i_xattr_icount);
 		vi->i_mode = le16_to_cpu(die->i_mode);
 
@@ -61,7 +54,12 @@ int erofs_read_inode_from_disk(struct erofs_inode *vi)
 		case S_IFREG:
 		case S_IFDIR:
 		case S_IFLNK:
-			vi->u.i_blkaddr = le32_to_cpu(die->i_u.raw_blkaddr);
+			if (vi->datalayout == EROFS_INODE_CHUNK_BASED)
+				vi->u.chunkformat =
+					le16_to_cpu(die->i_u.c.format);
+			else
+				vi->u.i_blkaddr =
+					le32_to_cpu(die->i_u.raw_blkaddr);
 			break;
 		case S_IFCHR:
 		case S_IFBLK:
@@ -93,7 +91,12 @@ int erofs_read_inode_from_disk(struct erofs_inode *vi)
 		case S_IFREG:
 		case S_IFDIR:
 		case S_IFLNK:
-			vi->u.i_blkaddr = le32_to_cpu(dic->i_u.raw_blkaddr);
+			if (vi->datalayout == EROFS_INODE_CHUNK_BASED)
+				vi->u.chunkformat =
+					le16_to_cpu(dic->i_u.c.format);
+			else
+				vi->u.i_blkaddr =
+					le32_to_cpu(dic->i_u.raw_blkaddr);
 			break;
 		case S_IFCHR:
 		case S_IFBLK:
@@ -112,8 +115,8 @@ int erofs_read_inode_from_disk(struct erofs_inode *vi)
 		vi->i_gid = le16_to_cpu(dic->i_gid);
 		vi->i_nlink = le16_to_cpu(dic->i_nlink);
 
-		vi->i_ctime = sbi.build_time;
-		vi->i_ctime_nsec = sbi.build_time_nsec;
+		vi->i_ctime = sbi->build_time;
+		vi->i_ctime_nsec = sbi->build_time_nsec;
 
 		vi->i_size = le32_to_cpu(dic->i_size);
 		break;
@@ -124,106 +127,91 @@ int erofs_read_inode_from_disk(struct erofs_inode *vi)
 	}
 
 	vi->flags = 0;
-	if (erofs_inode_is_data_compressed(vi->datalayout))
+	if (vi->datalayout == EROFS_INODE_CHUNK_BASED) {
+		if (vi->u.chunkformat & ~EROFS_CHUNK_FORMAT_ALL) {
+			erofs_err("unsupported chunk format %x of nid %llu",
+				  vi->u.chunkformat, vi->nid | 0ULL);
+			return -EOPNOTSUPP;
+		}
+		vi->u.chunkbits = sbi->blkszbits +
+			(vi->u.chunkformat & EROFS_CHUNK_FORMAT_BLKBITS_MASK);
+	} else if (erofs_inode_is_data_compressed(vi->datalayout)) {
 		z_erofs_fill_inode(vi);
+	}
 	return 0;
 bogusimode:
 	erofs_err("bogus i_mode (%o) @ nid %llu", vi->i_mode, vi->nid | 0ULL);
 	return -EFSCORRUPTED;
 }
 
-
-struct erofs_dirent *find_target_dirent(erofs_nid_t pnid,
-					void *dentry_blk,
-					const char *name, unsigned int len,
-					unsigned int nameoff,
-					unsigned int maxsize)
+/* the caller should set up vi->sbi and vi->nid in advance */
+int erofs_read_inode_from_disk(struct erofs_inode *vi)
 {
-	struct erofs_dirent *de = dentry_blk;
-	const struct erofs_dirent *end = dentry_blk + nameoff;
-
-	while (de < end) {
-		const char *de_name;
-		unsigned int de_namelen;
-
-		nameoff = le16_to_cpu(de->nameoff);
-		de_name = (char *)dentry_blk + nameoff;
-
-		/* the last dirent in the block? */
-		if (de + 1 >= end)
-			de_namelen = strnlen(de_name, maxsize - nameoff);
-		else
-			de_namelen = le16_to_cpu(de[1].nameoff) - nameoff;
-
-		/* a corrupted entry is found */
-		if (nameoff + de_namelen > maxsize ||
-		    de_namelen > EROFS_NAME_LEN) {
-			erofs_err("bogus dirent @ nid %llu", pnid | 0ULL);
-			DBG_BUGON(1);
-			return ERR_PTR(-EFSCORRUPTED);
-		}
+	int ret;
+	char buf[sizeof(struct erofs_inode_extended)];
+	struct erofs_inode_compact *dic = (struct erofs_inode_compact *)buf;
+	const erofs_off_t inode_loc = iloc(vi->sbi, vi->nid);
+
+	ret = dev_read(vi->sbi, buf, inode_loc, sizeof(*dic));
+	if (ret < 0)
+		return -EIO;
 
-		if (len == de_namelen && !memcmp(de_name, name, de_namelen))
-			return de;
-		++de;
+	if (erofs_inode_is_extended(buf)) {
+		ret = dev_read(vi->sbi, buf + sizeof(*dic),
+			       inode_loc + sizeof(*dic),
+			       sizeof(struct erofs_inode_extended) -
+			       sizeof(*dic));
+		if (ret < 0)
+			return -EIO;
 	}
-	return NULL;
+	return erofs_read_inode_from_buf(vi, buf);
 }
 
-struct nameidata {
-	erofs_nid_t	nid;
-	unsigned int	ftype;
+
+struct erofs_namei_context {
+	struct erofs_dir_context ctx;
+	const char *name;
+	unsigned int len;
 };
 
+static int erofs_namei_filldir(struct erofs_dir_context *ctx)
+{
+	struct erofs_namei_context *nctx =
+		container_of(ctx, struct erofs_namei_context, ctx);
+
+	return nctx->len == ctx->de_namelen &&
+		!memcmp(ctx->dname, nctx->name, nctx->len);
+}
+
 int erofs_namei(struct nameidata *nd,
 		const char *name, unsigned int len)
 {
-	erofs_nid_t nid = nd->nid;
+	struct erofs_inode vi = { .sbi = nd->sbi, .nid = nd->nid };
+	struct erofs_namei_context nctx = {
+		.ctx.dir = &vi,
+		.ctx.cb = erofs_namei_filldir,
+		.name = name,
+		.len = len,
+	};
 	int ret;
-	char buf[EROFS_BLKSIZ];
-	struct erofs_inode vi = { .nid = nid };
-	erofs_off_t offset;
 
 	ret = erofs_read_inode_from_disk(&vi);
 	if (ret)
 		return ret;
 
-	offset = 0;
-	while (offset < vi.i_size) {
-		erofs_off_t maxsize = min_t(erofs_off_t,
-					    vi.i_size - offset, EROFS_BLKSIZ);
-		struct erofs_dirent *de = (void *)buf;
-		unsigned int nameoff;
-
-		ret = erofs_pread(&vi, buf, maxsize, offset);
-		if (ret)
-			return ret;
-
-		nameoff = le16_to_cpu(de->nameoff);
-		if (nameoff < sizeof(struct erofs_dirent) ||
-		    nameoff >= PAGE_SIZE) {
-			erofs_err("invalid de[0].nameoff %u @ nid %llu",
-				  nameoff, nid | 0ULL);
-			return -EFSCORRUPTED;
-		}
-
-		de = find_target_dirent(nid, buf, name, len,
-					nameoff, maxsize);
-		if (IS_ERR(de))
-			return PTR_ERR(de);
-
-		if (de) {
-			nd->nid = le64_to_cpu(de->nid);
-			return 0;
-		}
-		offset += maxsize;
-	}
-	return -ENOENT;
+	ret = erofs_iterate_dir(&nctx.ctx);
+	if (ret < 0)
+		return ret;
+	if (!ret)
+		return -ENOENT;
+	nd->nid = nctx.ctx.de_nid;
+	nd->ftype = nctx.ctx.de_ftype;
+	return 0;
 }
 
 static int link_path_walk(const char *name, struct nameidata *nd)
 {
-	nd->nid = sbi.root_nid;
+	nd->nid = nd->sbi->root_nid;
 
 	while (*name == '/')
 		name++;
@@ -249,15 +237,17 @@ static int link_path_walk(const char *name, struct nameidata *nd)
 	return 0;
 }
 
-int erofs_ilookup(const char *path, struct erofs_inode *vi)
+int erofs_ilookup(struct erofs_sb_info *sbi, const char *path,
+		  struct erofs_inode *vi)
 {
 	int ret;
-	struct nameidata nd;
+	struct nameidata nd = { .sbi = sbi };
 
 	ret = link_path_walk(path, &nd);
 	if (ret)
 		return ret;
 
+	vi->sbi = sbi;
 	vi->nid = nd.nid;
 	return erofs_read_inode_from_disk(vi);
 }
@@ -0,0 +1,26 @@
+/* SPDX-License-Identifier: GPL-2.0+ */
+/*
+ * erofs-utils/lib/sha256.h
+ */
+#ifndef __EROFS_LIB_SHA256_H
+#define __EROFS_LIB_SHA256_H
+
+#include "erofs/defs.h"
+
+#define EROFS_SHA256_DIGEST_SIZE	32
+
+struct erofs_sha256_state {
+	u64 length;
+	u32 state[8], curlen;
+	u8 buf[64];
+};
+
+void erofs_sha256_init(struct erofs_sha256_state *md);
+void erofs_sha256_process(struct erofs_sha256_state *md,
+			  const u8 *in, unsigned long inlen);
+void erofs_sha256_done(struct erofs_sha256_state *md, u8 *out);
+
+void erofs_sha256(const u8 *in, unsigned long inlen,
+		  u8 out[EROFS_SHA256_DIGEST_SIZE]);
+
+#endif
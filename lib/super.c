@@ -6,10 +6,12 @@
  */
 #include <string.h>
 #include <stdlib.h>
+#include <pthread.h>
 #include <asm-generic/errno-base.h>
 
 #include "erofs/io.h"
 #include "erofs/print.h"
+#include "erofs/xattr.h"
 
 static bool check_layout_compatibility(struct erofs_sb_info *sbi,
 				       struct erofs_super_block *dsb)
@@ -27,14 +29,20 @@ static bool check_layout_compatibility(struct erofs_sb_info *sbi,
 	return true;
 }
 
-int erofs_read_superblock(void)
+int erofs_read_superblock(struct erofs_sb_info *sbi)
 {
-	char data[EROFS_BLKSIZ];
+	char data[EROFS_SUPER_OFFSET + sizeof(struct erofs_super_block)];
 	struct erofs_super_block *dsb;
 	unsigned int blkszbits;
 	int ret;
 
-	ret = blk_read(data, 0, 1);
+	/* extents cached for an image previously opened by @sbi are stale */
+	z_erofs_drop_extent_cache(sbi);
+	free(sbi->packed_inode);
+	sbi->packed_inode = NULL;
+
+	/* the block size is unknown until the superblock is read */
+	ret = dev_read(sbi, data, 0, sizeof(data));
 	if (ret < 0) {
 		erofs_err("cannot read erofs superblock: %d", ret);
 		return -EIO;
@@ -47,30 +55,74 @@ int erofs_read_superblock(void)
 		return ret;
 	}
 
-	sbi.feature_compat = le32_to_cpu(dsb->feature_compat);
+	sbi->feature_compat = le32_to_cpu(dsb->feature_compat);
 
 	blkszbits = dsb->blkszbits;
-	/* 9(512 bytes) + LOG_SECTORS_PER_BLOCK == LOG_BLOCK_SIZE */
-	if (blkszbits != LOG_BLOCK_SIZE) {
-		erofs_err("blksize %u isn't supported on this platform",
-			  1 << blkszbits);
+	if (blkszbits >= 32 || (1U << blkszbits) < EROFS_MIN_BLOCK_SIZE ||
+	    (1U << blkszbits) > EROFS_MAX_BLOCK_SIZE) {
+		erofs_err("blkszbits %u isn't supported", blkszbits);
 		return ret;
 	}
+	sbi->blkszbits = blkszbits;
 
-	if (!check_layout_compatibility(&sbi, dsb))
+	if (!check_layout_compatibility(sbi, dsb))
 		return ret;
 
-	sbi.blocks = le32_to_cpu(dsb->blocks);
-	sbi.meta_blkaddr = le32_to_cpu(dsb->meta_blkaddr);
-	sbi.xattr_blkaddr = le32_to_cpu(dsb->xattr_blkaddr);
-	sbi.islotbits = EROFS_ISLOTBITS;
-	sbi.root_nid = le16_to_cpu(dsb->root_nid);
-	sbi.inos = le64_to_cpu(dsb->inos);
+	sbi->blocks = le32_to_cpu(dsb->blocks);
+	sbi->meta_blkaddr = le32_to_cpu(dsb->meta_blkaddr);
+	sbi->xattr_blkaddr = le32_to_cpu(dsb->xattr_blkaddr);
+	sbi->islotbits = EROFS_ISLOTBITS;
+	sbi->root_nid = le16_to_cpu(dsb->root_nid);
+	sbi->inos = le64_to_cpu(dsb->inos);
+	sbi->packed_nid = le64_to_cpu(dsb->packed_nid);
 
-	sbi.build_time = le64_to_cpu(dsb->build_time);
-	sbi.build_time_nsec = le32_to_cpu(dsb->build_time_nsec);
+	sbi->build_time = le64_to_cpu(dsb->build_time);
+	sbi->build_time_nsec = le32_to_cpu(dsb->build_time_nsec);
 
-	memcpy(&sbi.uuid, dsb->uuid, sizeof(dsb->uuid));
+	memcpy(&sbi->uuid, dsb->uuid, sizeof(dsb->uuid));
 	return 0;
 }
 
+/* release what has been cached for the filesystem */
+void erofs_put_super(struct erofs_sb_info *sbi)
+{
+	z_erofs_drop_extent_cache(sbi);
+	erofs_xattr_drop_cache(sbi);
+	free(sbi->packed_inode);
+	sbi->packed_inode = NULL;
+}
+
+static pthread_mutex_t erofs_packed_inode_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* get the packed inode, which is read on first use */
+struct erofs_inode *erofs_packed_inode(struct erofs_sb_info *sbi)
+{
+	struct erofs_inode *vi;
+	int ret;
+
+	if (!erofs_sb_has_fragments(sbi))
+		return ERR_PTR(-EFSCORRUPTED);
+
+	pthread_mutex_lock(&erofs_packed_inode_lock);
+	vi = sbi->packed_inode;
+	if (vi)
+		goto out;
+
+	vi = calloc(1, sizeof(*vi));
+	if (!vi) {
+		vi = ERR_PTR(-ENOMEM);
+		goto out;
+	}
+	vi->sbi = sbi;
+	vi->nid = sbi->packed_nid;
+	ret = erofs_read_inode_from_disk(vi);
+	if (ret) {
+		free(vi);
+		vi = ERR_PTR(ret);
+		goto out;
+	}
+	sbi->packed_inode = vi;
+out:
+	pthread_mutex_unlock(&erofs_packed_inode_lock);
+	return vi;
+}
@@ -0,0 +1,87 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * erofs-utils/lib/workqueue.c
+ *
+ * A minimal thread pool which runs queued works in FIFO order.
+ */
+#include <stdlib.h>
+#include <errno.h>
+#include "erofs/workqueue.h"
+#include "erofs/print.h"
+
+static void *erofs_worker(void *arg)
+{
+	struct erofs_workqueue *wq = arg;
+	struct erofs_work *work;
+
+	while (1) {
+		pthread_mutex_lock(&wq->lock);
+		while (list_empty(&wq->head) && !wq->shutdown)
+			pthread_cond_wait(&wq->cond, &wq->lock);
+
+		if (list_empty(&wq->head)) {
+			pthread_mutex_unlock(&wq->lock);
+			break;
+		}
+		work = list_first_entry(&wq->head, struct erofs_work, list);
+		list_del(&work->list);
+		pthread_mutex_unlock(&wq->lock);
+
+		work->fn(work);
+	}
+	return NULL;
+}
+
+int erofs_workqueue_init(struct erofs_workqueue *wq, unsigned int nworkers)
+{
+	unsigned int i;
+	int ret;
+
+	init_list_head(&wq->head);
+	pthread_mutex_init(&wq->lock, NULL);
+	pthread_cond_init(&wq->cond, NULL);
+	wq->shutdown = false;
+	wq->nworkers = 0;
+
+	wq->workers = calloc(nworkers, sizeof(pthread_t));
+	if (!wq->workers)
+		return -ENOMEM;
+
+	for (i = 0; i < nworkers; ++i) {
+		ret = pthread_create(&wq->workers[i], NULL, erofs_worker, wq);
+		if (ret) {
+			erofs_err("failed to create worker %u: %d", i, ret);
+			erofs_workqueue_shutdown(wq);
+			return -ret;
+		}
+		++wq->nworkers;
+	}
+	return 0;
+}
+
+void erofs_workqueue_add(struct erofs_workqueue *wq, struct erofs_work *work)
+{
+	pthread_mutex_lock(&wq->lock);
+	list_add_tail(&work->list, &wq->head);
+	pthread_cond_signal(&wq->cond);
+	pthread_mutex_unlock(&wq->lock);
+}
+
+/* wait for all queued works to finish and then stop all workers */
+void erofs_workqueue_shutdown(struct erofs_workqueue *wq)
+{
+	unsigned int i;
+
+	pthread_mutex_lock(&wq->lock);
+	wq->shutdown = true;
+	pthread_cond_broadcast(&wq->cond);
+	pthread_mutex_unlock(&wq->lock);
+
+	for (i = 0; i < wq->nworkers; ++i)
+		pthread_join(wq->workers[i], NULL);
+	free(wq->workers);
+	wq->workers = NULL;
+	wq->nworkers = 0;
+	pthread_cond_destroy(&wq->cond);
+	pthread_mutex_destroy(&wq->lock);
+}
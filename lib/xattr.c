@@ -14,6 +14,7 @@
 #endif
 #include <sys/stat.h>
 #include <dirent.h>
+#include <pthread.h>
 #include "erofs/print.h"
 #include "erofs/hashtable.h"
 #include "erofs/xattr.h"
@@ -526,7 +527,7 @@ static void erofs_cleanxattrs(bool sharedxattrs)
 static bool erofs_bh_flush_write_shared_xattrs(struct erofs_buffer_head *bh)
 {
 	void *buf = bh->fsprivate;
-	int err = dev_write(buf, erofs_btell(bh, false), shared_xattrs_size);
+	int err = dev_write(&g_sbi, buf, erofs_btell(bh, false), shared_xattrs_size);
 
 	if (err)
 		return false;
@@ -578,7 +579,7 @@ int erofs_build_shared_xattrs_from_path(const char *path)
 	erofs_mapbh(bh->block);
 	off = erofs_btell(bh, false);
 
-	sbi.xattr_blkaddr = off / EROFS_BLKSIZ;
+	g_sbi.xattr_blkaddr = off / EROFS_BLKSIZ;
 	off %= EROFS_BLKSIZ;
 	p = 0;
 
@@ -662,3 +663,396 @@ char *erofs_export_xattr_ibody(struct list_head *ixattrs, unsigned int size)
 	return buf;
 }
 
+
+/*
+ * Reading xattrs back from an image.  Inline xattr bodies are cached per
+ * inode and shared xattrs are decoded once per filesystem, so that xattrs
+ * asked again and again (e.g. security.* on each access) only cost hash
+ * lookups.  Cached entries never change, so they can be used without
+ * holding the lock.  Shared xattrs are only freed when the filesystem goes
+ * away, whereas the least recently used inline xattr bodies are dropped
+ * once the cache is full unless they are still referenced.
+ */
+struct erofs_xattr_ibody_cache {
+	struct hlist_node node;
+	struct list_head lru;
+	struct erofs_sb_info *sbi;
+	erofs_nid_t nid;
+	unsigned int refcount;
+	unsigned int size;
+	char ibody[];
+};
+
+struct erofs_shared_xattr {
+	struct hlist_node node;
+	struct erofs_sb_info *sbi;
+	u32 id;
+	u8 index, name_len;
+	u16 value_size;
+	/* the name followed by the value */
+	char kvbuf[];
+};
+
+#define EROFS_XATTR_IBODY_CACHE_BITS	14
+#define EROFS_SHARED_XATTR_CACHE_BITS	10
+/* inline xattr bodies kept at most, unless all of them are in use */
+#define EROFS_XATTR_IBODY_CACHE_MAX	(1 << EROFS_XATTR_IBODY_CACHE_BITS)
+
+static DECLARE_HASHTABLE(erofs_xattr_ibody_cache,
+			 EROFS_XATTR_IBODY_CACHE_BITS);
+static DECLARE_HASHTABLE(erofs_shared_xattr_cache,
+			 EROFS_SHARED_XATTR_CACHE_BITS);
+static LIST_HEAD(erofs_xattr_ibody_lru);
+static unsigned int erofs_xattr_ibody_count;
+static pthread_mutex_t erofs_xattr_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct erofs_xattr_ibody_cache *
+erofs_find_xattr_ibody(struct erofs_sb_info *sbi, erofs_nid_t nid)
+{
+	struct erofs_xattr_ibody_cache *ic;
+
+	hash_for_each_possible(erofs_xattr_ibody_cache, ic, node, nid)
+		if (ic->nid == nid && ic->sbi == sbi)
+			return ic;
+	return NULL;
+}
+
+static struct erofs_shared_xattr *
+erofs_find_shared_xattr(struct erofs_sb_info *sbi, u32 id)
+{
+	struct erofs_shared_xattr *sx;
+
+	hash_for_each_possible(erofs_shared_xattr_cache, sx, node, id)
+		if (sx->id == id && sx->sbi == sbi)
+			return sx;
+	return NULL;
+}
+
+static struct erofs_xattr_ibody_cache *
+erofs_get_xattr_ibody(struct erofs_inode *vi)
+{
+	struct erofs_sb_info *sbi = vi->sbi;
+	struct erofs_xattr_ibody_cache *ic, *cached;
+	struct erofs_xattr_ibody_header *ih;
+	int ret;
+
+	pthread_mutex_lock(&erofs_xattr_cache_lock);
+	ic = erofs_find_xattr_ibody(sbi, vi->nid);
+	if (ic) {
+		++ic->refcount;
+		list_del(&ic->lru);
+		list_add_tail(&ic->lru, &erofs_xattr_ibody_lru);
+	}
+	pthread_mutex_unlock(&erofs_xattr_cache_lock);
+	if (ic)
+		return ic;
+
+	if (vi->xattr_isize < sizeof(*ih))
+		return ERR_PTR(-EFSCORRUPTED);
+
+	ic = malloc(sizeof(*ic) + vi->xattr_isize);
+	if (!ic)
+		return ERR_PTR(-ENOMEM);
+
+	ret = dev_read(sbi, ic->ibody, iloc(sbi, vi->nid) + vi->inode_isize,
+		       vi->xattr_isize);
+	if (ret < 0) {
+		free(ic);
+		return ERR_PTR(-EIO);
+	}
+
+	ih = (struct erofs_xattr_ibody_header *)ic->ibody;
+	if (sizeof(*ih) + ih->h_shared_count * sizeof(u32) > vi->xattr_isize) {
+		erofs_err("bogus xattr ibody @ nid %llu", vi->nid | 0ULL);
+		free(ic);
+		return ERR_PTR(-EFSCORRUPTED);
+	}
+	ic->sbi = sbi;
+	ic->nid = vi->nid;
+	ic->refcount = 1;
+	ic->size = vi->xattr_isize;
+
+	pthread_mutex_lock(&erofs_xattr_cache_lock);
+	/* someone else may have cached it in the meantime */
+	cached = erofs_find_xattr_ibody(sbi, vi->nid);
+	if (cached) {
+		++cached->refcount;
+	} else {
+		hash_add(erofs_xattr_ibody_cache, &ic->node, ic->nid);
+		list_add_tail(&ic->lru, &erofs_xattr_ibody_lru);
+		++erofs_xattr_ibody_count;
+	}
+	pthread_mutex_unlock(&erofs_xattr_cache_lock);
+	if (cached) {
+		free(ic);
+		return cached;
+	}
+	return ic;
+}
+
+/* drop the reference and shrink the cache if it's too large */
+static void erofs_put_xattr_ibody(struct erofs_xattr_ibody_cache *ic)
+{
+	struct erofs_xattr_ibody_cache *n;
+
+	pthread_mutex_lock(&erofs_xattr_cache_lock);
+	--ic->refcount;
+	list_for_each_entry_safe(ic, n, &erofs_xattr_ibody_lru, lru) {
+		if (erofs_xattr_ibody_count <= EROFS_XATTR_IBODY_CACHE_MAX)
+			break;
+		if (ic->refcount)
+			continue;
+		hash_del(&ic->node);
+		list_del(&ic->lru);
+		--erofs_xattr_ibody_count;
+		free(ic);
+	}
+	pthread_mutex_unlock(&erofs_xattr_cache_lock);
+}
+
+static struct erofs_shared_xattr *
+erofs_get_shared_xattr(struct erofs_sb_info *sbi, u32 id)
+{
+	erofs_off_t pos = erofs_sbi_pos(sbi, sbi->xattr_blkaddr) +
+		(erofs_off_t)id * sizeof(u32);
+	struct erofs_shared_xattr *sx, *cached;
+	struct erofs_xattr_entry entry;
+	unsigned int len;
+	int ret;
+
+	pthread_mutex_lock(&erofs_xattr_cache_lock);
+	sx = erofs_find_shared_xattr(sbi, id);
+	pthread_mutex_unlock(&erofs_xattr_cache_lock);
+	if (sx)
+		return sx;
+
+	ret = dev_read(sbi, &entry, pos, sizeof(entry));
+	if (ret < 0)
+		return ERR_PTR(-EIO);
+
+	/*
+	 * shared xattrs are packed one after another by mkfs, so they can
+	 * span blocks, but never the end of the image.
+	 */
+	len = entry.e_name_len + le16_to_cpu(entry.e_value_size);
+	if (pos + sizeof(entry) + len > dev_length(sbi)) {
+		erofs_err("bogus shared xattr %u", id);
+		return ERR_PTR(-EFSCORRUPTED);
+	}
+	sx = malloc(sizeof(*sx) + len);
+	if (!sx)
+		return ERR_PTR(-ENOMEM);
+
+	ret = dev_read(sbi, sx->kvbuf, pos + sizeof(entry), len);
+	if (ret < 0) {
+		free(sx);
+		return ERR_PTR(-EIO);
+	}
+	sx->sbi = sbi;
+	sx->id = id;
+	sx->index = entry.e_name_index;
+	sx->name_len = entry.e_name_len;
+	sx->value_size = le16_to_cpu(entry.e_value_size);
+
+	pthread_mutex_lock(&erofs_xattr_cache_lock);
+	cached = erofs_find_shared_xattr(sbi, id);
+	if (!cached)
+		hash_add(erofs_shared_xattr_cache, &sx->node, sx->id);
+	pthread_mutex_unlock(&erofs_xattr_cache_lock);
+	if (cached) {
+		free(sx);
+		return cached;
+	}
+	return sx;
+}
+
+struct erofs_xattr_iter {
+	/* called for each xattr, returns 0 to go on */
+	int (*fn)(struct erofs_xattr_iter *it, u8 index, const char *name,
+		  unsigned int name_len, const char *value,
+		  unsigned int value_size);
+	char *buffer;
+	size_t buffer_size, ofs;
+};
+
+/* walk inline xattrs of the inode first and then its shared xattrs */
+static int erofs_xattr_iterate(struct erofs_inode *vi,
+			       struct erofs_xattr_iter *it)
+{
+	struct erofs_xattr_ibody_cache *ic;
+	struct erofs_xattr_ibody_header *ih;
+	unsigned int p, i;
+	int ret = 0;
+
+	if (!vi->xattr_isize)
+		return 0;
+
+	ic = erofs_get_xattr_ibody(vi);
+	if (IS_ERR(ic))
+		return PTR_ERR(ic);
+
+	ih = (struct erofs_xattr_ibody_header *)ic->ibody;
+	p = sizeof(*ih) + ih->h_shared_count * sizeof(u32);
+	while (p < ic->size) {
+		struct erofs_xattr_entry *e =
+			(struct erofs_xattr_entry *)(ic->ibody + p);
+
+		if (p + sizeof(*e) > ic->size ||
+		    p + sizeof(*e) + e->e_name_len +
+		    le16_to_cpu(e->e_value_size) > ic->size) {
+			erofs_err("bogus inline xattr @ nid %llu",
+				  vi->nid | 0ULL);
+			ret = -EFSCORRUPTED;
+			goto out;
+		}
+
+		ret = it->fn(it, e->e_name_index, e->e_name, e->e_name_len,
+			     e->e_name + e->e_name_len,
+			     le16_to_cpu(e->e_value_size));
+		if (ret)
+			goto out;
+		p += erofs_xattr_entry_size(e);
+	}
+
+	for (i = 0; i < ih->h_shared_count; ++i) {
+		struct erofs_shared_xattr *sx;
+
+		sx = erofs_get_shared_xattr(vi->sbi,
+				le32_to_cpu(ih->h_shared_xattrs[i]));
+		if (IS_ERR(sx)) {
+			ret = PTR_ERR(sx);
+			goto out;
+		}
+
+		ret = it->fn(it, sx->index, sx->kvbuf, sx->name_len,
+			     sx->kvbuf + sx->name_len, sx->value_size);
+		if (ret)
+			goto out;
+	}
+out:
+	erofs_put_xattr_ibody(ic);
+	return ret;
+}
+
+struct erofs_getxattr_iter {
+	struct erofs_xattr_iter it;
+	u8 index;
+	const char *name;
+	unsigned int len;
+};
+
+static int erofs_getxattr_fn(struct erofs_xattr_iter *it, u8 index,
+			     const char *name, unsigned int name_len,
+			     const char *value, unsigned int value_size)
+{
+	struct erofs_getxattr_iter *git =
+		container_of(it, struct erofs_getxattr_iter, it);
+
+	if (index != git->index || name_len != git->len ||
+	    memcmp(name, git->name, name_len))
+		return 0;
+
+	if (it->buffer) {
+		if (value_size > it->buffer_size)
+			return -ERANGE;
+		memcpy(it->buffer, value, value_size);
+	}
+	/* return the value size plus one to stop, 0 means going on */
+	return value_size + 1;
+}
+
+/*
+ * get the value of the xattr @name into @buffer or only its size if
+ * @buffer is NULL, returns the size of the value or a negative errno.
+ */
+int erofs_getxattr(struct erofs_inode *vi, const char *name, char *buffer,
+		   size_t buffer_size)
+{
+	struct erofs_getxattr_iter git = {
+		.it.fn = erofs_getxattr_fn,
+		.it.buffer = buffer,
+		.it.buffer_size = buffer_size,
+	};
+	u16 prefix_len;
+	int ret;
+
+	if (!match_prefix(name, &git.index, &prefix_len))
+		return -ENODATA;
+	git.name = name + prefix_len;
+	git.len = strlen(git.name);
+
+	ret = erofs_xattr_iterate(vi, &git.it);
+	if (ret <= 0)
+		return ret ? ret : -ENODATA;
+	return ret - 1;
+}
+
+static int erofs_listxattr_fn(struct erofs_xattr_iter *it, u8 index,
+			      const char *name, unsigned int name_len,
+			      const char *value, unsigned int value_size)
+{
+	const struct xattr_prefix *p;
+	unsigned int len;
+
+	/* skip unknown namespaces as the kernel does */
+	if (index >= ARRAY_SIZE(xattr_types) || !xattr_types[index].prefix)
+		return 0;
+	p = &xattr_types[index];
+
+	len = p->prefix_len + name_len + 1;
+	if (it->buffer) {
+		if (it->ofs + len > it->buffer_size)
+			return -ERANGE;
+		memcpy(it->buffer + it->ofs, p->prefix, p->prefix_len);
+		memcpy(it->buffer + it->ofs + p->prefix_len, name, name_len);
+		it->buffer[it->ofs + len - 1] = '\0';
+	}
+	it->ofs += len;
+	return 0;
+}
+
+/*
+ * list the xattr names of the inode into @buffer or only get the size of
+ * the list if @buffer is NULL, returns the size or a negative errno.
+ */
+int erofs_listxattr(struct erofs_inode *vi, char *buffer, size_t buffer_size)
+{
+	struct erofs_xattr_iter it = {
+		.fn = erofs_listxattr_fn,
+		.buffer = buffer,
+		.buffer_size = buffer_size,
+	};
+	int ret;
+
+	ret = erofs_xattr_iterate(vi, &it);
+	if (ret)
+		return ret;
+	return it.ofs;
+}
+
+/* release the xattrs cached for the filesystem */
+void erofs_xattr_drop_cache(struct erofs_sb_info *sbi)
+{
+	struct erofs_xattr_ibody_cache *ic;
+	struct erofs_shared_xattr *sx;
+	struct hlist_node *n;
+	int bkt;
+
+	pthread_mutex_lock(&erofs_xattr_cache_lock);
+	hash_for_each_safe(erofs_xattr_ibody_cache, bkt, n, ic, node) {
+		if (ic->sbi != sbi)
+			continue;
+		DBG_BUGON(ic->refcount);
+		hash_del(&ic->node);
+		list_del(&ic->lru);
+		--erofs_xattr_ibody_count;
+		free(ic);
+	}
+	hash_for_each_safe(erofs_shared_xattr_cache, bkt, n, sx, node) {
+		if (sx->sbi != sbi)
+			continue;
+		hash_del(&sx->node);
+		free(sx);
+	}
+	pthread_mutex_unlock(&erofs_xattr_cache_lock);
+}
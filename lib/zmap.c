@@ -9,23 +9,226 @@
  * Created by Gao Xiang <gaoxiang25@huawei.com>
  * Modified by Huang Jianan <huangjianan@oppo.com>
  */
+#include <stdlib.h>
+#include <pthread.h>
 #include "erofs/io.h"
 #include "erofs/print.h"
+#include "erofs/hashtable.h"
+
+/*
+ * Mapping an extent may walk back through many NONHEAD lclusters and reload
+ * index blocks, so keep the extents mapped so far in a sorted table per
+ * inode and look them up by binary search later. Tables of all filesystems
+ * live in one cache, keyed by their superblocks and nids.
+ */
+struct z_erofs_extent {
+	erofs_off_t la, pa;
+	u64 llen, plen;
+	unsigned int flags;
+};
+
+struct z_erofs_extent_table {
+	struct hlist_node node;
+	struct list_head lru;
+	struct erofs_sb_info *sbi;
+	erofs_nid_t nid;
+
+	struct z_erofs_extent *extents;
+	unsigned int nr, max;
+};
+
+#define Z_EROFS_EXTENT_HASHTABLE_BITS	10
+
+/* h_advise bits which are understood here, the others can't be mapped */
+#define Z_EROFS_ADVISE_SUPPORTED	(Z_EROFS_ADVISE_COMPACTED_2B | \
+					 Z_EROFS_ADVISE_BIG_PCLUSTER_1 | \
+					 Z_EROFS_ADVISE_BIG_PCLUSTER_2 | \
+					 Z_EROFS_ADVISE_INLINE_PCLUSTER | \
+					 Z_EROFS_ADVISE_FRAGMENT_PCLUSTER)
+/* cache up to 256Ki extents (about 10MiB) for all inodes in total */
+#define Z_EROFS_EXTENT_CACHE_MAX	(256 * 1024)
+
+static DECLARE_HASHTABLE(z_erofs_extent_tables, Z_EROFS_EXTENT_HASHTABLE_BITS);
+static LIST_HEAD(z_erofs_extent_lru);
+static unsigned int z_erofs_nr_cached_extents;
+static pthread_mutex_t z_erofs_extent_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct z_erofs_extent_table *
+z_erofs_find_extent_table(struct erofs_sb_info *sbi, erofs_nid_t nid)
+{
+	struct z_erofs_extent_table *t;
+
+	hash_for_each_possible(z_erofs_extent_tables, t, node, nid)
+		if (t->nid == nid && t->sbi == sbi)
+			return t;
+	return NULL;
+}
+
+static void z_erofs_free_extent_table(struct z_erofs_extent_table *t)
+{
+	hash_del(&t->node);
+	list_del(&t->lru);
+	z_erofs_nr_cached_extents -= t->nr;
+	free(t->extents);
+	free(t);
+}
+
+/* return the index of the last extent starting at or before @la, or -1 */
+static int z_erofs_extent_bsearch(struct z_erofs_extent_table *t,
+				  erofs_off_t la)
+{
+	int lo = 0, hi = (int)t->nr - 1, ret = -1;
+
+	while (lo <= hi) {
+		int mid = lo + (hi - lo) / 2;
+
+		if (t->extents[mid].la <= la) {
+			ret = mid;
+			lo = mid + 1;
+		} else {
+			hi = mid - 1;
+		}
+	}
+	return ret;
+}
+
+static bool z_erofs_extent_cache_lookup(struct erofs_inode *vi,
+					struct erofs_map_blocks *map,
+					int flags)
+{
+	struct z_erofs_extent_table *t;
+	struct z_erofs_extent *e;
+	bool hit = false;
+	int i;
+
+	pthread_mutex_lock(&z_erofs_extent_lock);
+	t = z_erofs_find_extent_table(vi->sbi, vi->nid);
+	if (!t)
+		goto out;
+
+	i = z_erofs_extent_bsearch(t, map->m_la);
+	if (i < 0)
+		goto out;
+	e = &t->extents[i];
+	if (map->m_la >= e->la + e->llen)
+		goto out;
+	/* the whole extent is asked for, but only part of it is known */
+	if ((flags & EROFS_GET_BLOCKS_FIEMAP) &&
+	    !(e->flags & EROFS_MAP_FULL_MAPPED))
+		goto out;
+
+	map->m_la = e->la;
+	map->m_llen = e->llen;
+	map->m_pa = e->pa;
+	map->m_plen = e->plen;
+	map->m_flags = e->flags;
+	list_del(&t->lru);
+	list_add_tail(&t->lru, &z_erofs_extent_lru);
+	hit = true;
+out:
+	pthread_mutex_unlock(&z_erofs_extent_lock);
+	return hit;
+}
+
+static void z_erofs_extent_cache_insert(struct erofs_inode *vi,
+					struct erofs_map_blocks *map)
+{
+	struct z_erofs_extent_table *t;
+	struct z_erofs_extent *e;
+	int i;
+
+	pthread_mutex_lock(&z_erofs_extent_lock);
+	t = z_erofs_find_extent_table(vi->sbi, vi->nid);
+	if (!t) {
+		t = calloc(1, sizeof(*t));
+		if (!t)
+			goto out;
+		t->sbi = vi->sbi;
+		t->nid = vi->nid;
+		hash_add(z_erofs_extent_tables, &t->node, t->nid);
+		list_add_tail(&t->lru, &z_erofs_extent_lru);
+	}
+
+	i = z_erofs_extent_bsearch(t, map->m_la);
+	if (i >= 0 && t->extents[i].la == map->m_la) {
+		/* the same extent, but maybe mapped further this time */
+		e = &t->extents[i];
+		if (map->m_llen > e->llen) {
+			e->llen = map->m_llen;
+			e->flags = map->m_flags;
+		} else if (map->m_llen == e->llen) {
+			e->flags |= map->m_flags & EROFS_MAP_FULL_MAPPED;
+		}
+		goto out;
+	}
+
+	if (t->nr >= t->max) {
+		unsigned int max = t->max ? t->max * 2 : 16;
+
+		e = realloc(t->extents, max * sizeof(*e));
+		if (!e)
+			goto out;
+		t->extents = e;
+		t->max = max;
+	}
+
+	e = &t->extents[++i];
+	memmove(e + 1, e, (t->nr - i) * sizeof(*e));
+	*e = (struct z_erofs_extent) {
+		.la = map->m_la,
+		.pa = map->m_pa,
+		.llen = map->m_llen,
+		.plen = map->m_plen,
+		.flags = map->m_flags,
+	};
+	++t->nr;
+	++z_erofs_nr_cached_extents;
+
+	/* drop the least recently used tables if there are too many extents */
+	while (z_erofs_nr_cached_extents > Z_EROFS_EXTENT_CACHE_MAX) {
+		struct z_erofs_extent_table *victim =
+			list_first_entry(&z_erofs_extent_lru,
+					 struct z_erofs_extent_table, lru);
+
+		if (victim == t)
+			break;
+		z_erofs_free_extent_table(victim);
+	}
+out:
+	pthread_mutex_unlock(&z_erofs_extent_lock);
+}
+
+void z_erofs_drop_extent_cache(struct erofs_sb_info *sbi)
+{
+	struct z_erofs_extent_table *t, *n;
+
+	pthread_mutex_lock(&z_erofs_extent_lock);
+	list_for_each_entry_safe(t, n, &z_erofs_extent_lru, lru)
+		if (t->sbi == sbi)
+			z_erofs_free_extent_table(t);
+	pthread_mutex_unlock(&z_erofs_extent_lock);
+}
 
 int z_erofs_fill_inode(struct erofs_inode *vi)
 {
-	if (!erofs_sb_has_big_pcluster() &&
+	if (!erofs_sb_has_big_pcluster(vi->sbi) &&
+	    !erofs_sb_has_ztailpacking(vi->sbi) &&
+	    !erofs_sb_has_fragments(vi->sbi) &&
 	    vi->datalayout == EROFS_INODE_FLAT_COMPRESSION_LEGACY) {
 		vi->z_advise = 0;
 		vi->z_algorithmtype[0] = 0;
 		vi->z_algorithmtype[1] = 0;
-		vi->z_logical_clusterbits = LOG_BLOCK_SIZE;
+		vi->z_logical_clusterbits = vi->sbi->blkszbits;
 
 		vi->flags |= EROFS_I_Z_INITED;
 	}
 	return 0;
 }
 
+static int z_erofs_do_map_blocks(struct erofs_inode *vi,
+				 struct erofs_map_blocks *map,
+				 int flags);
+
 static int z_erofs_fill_inode_lazy(struct erofs_inode *vi)
 {
 	int ret;
@@ -36,16 +239,35 @@ static int z_erofs_fill_inode_lazy(struct erofs_inode *vi)
 	if (vi->flags & EROFS_I_Z_INITED)
 		return 0;
 
-	DBG_BUGON(!erofs_sb_has_big_pcluster() &&
+	DBG_BUGON(!erofs_sb_has_big_pcluster(vi->sbi) &&
+		  !erofs_sb_has_ztailpacking(vi->sbi) &&
+		  !erofs_sb_has_fragments(vi->sbi) &&
 		  vi->datalayout == EROFS_INODE_FLAT_COMPRESSION_LEGACY);
-	pos = round_up(iloc(vi->nid) + vi->inode_isize + vi->xattr_isize, 8);
+	pos = round_up(iloc(vi->sbi, vi->nid) + vi->inode_isize +
+		       vi->xattr_isize, 8);
 
-	ret = dev_read(buf, pos, sizeof(buf));
+	ret = dev_read(vi->sbi, buf, pos, sizeof(buf));
 	if (ret < 0)
 		return -EIO;
 
 	h = (struct z_erofs_map_header *)buf;
+	/*
+	 * if the highest bit of the 8-byte map header is set, the whole file
+	 * is stored in the packed inode. The rest bits keeps z_fragmentoff.
+	 */
+	if (h->h_clusterbits >> Z_EROFS_FRAGMENT_INODE_BIT) {
+		vi->z_advise = Z_EROFS_ADVISE_FRAGMENT_PCLUSTER;
+		vi->z_fragmentoff = get_unaligned_le64((u8 *)buf) ^ (1ULL << 63);
+		vi->z_tailextent_headlcn = 0;
+		goto done;
+	}
 	vi->z_advise = le16_to_cpu(h->h_advise);
+	if (vi->z_advise & ~Z_EROFS_ADVISE_SUPPORTED) {
+		erofs_err("unsupported advise %#x for nid %llu",
+			  vi->z_advise & ~Z_EROFS_ADVISE_SUPPORTED,
+			  (unsigned long long)vi->nid);
+		return -EOPNOTSUPP;
+	}
 	vi->z_algorithmtype[0] = h->h_algorithmtype & 15;
 	vi->z_algorithmtype[1] = h->h_algorithmtype >> 4;
 
@@ -55,7 +277,7 @@ static int z_erofs_fill_inode_lazy(struct erofs_inode *vi)
 		return -EOPNOTSUPP;
 	}
 
-	vi->z_logical_clusterbits = LOG_BLOCK_SIZE + (h->h_clusterbits & 7);
+	vi->z_logical_clusterbits = vi->sbi->blkszbits + (h->h_clusterbits & 7);
 	if (vi->datalayout == EROFS_INODE_FLAT_COMPRESSION &&
 	    !(vi->z_advise & Z_EROFS_ADVISE_BIG_PCLUSTER_1) ^
 	    !(vi->z_advise & Z_EROFS_ADVISE_BIG_PCLUSTER_2)) {
@@ -64,6 +286,42 @@ static int z_erofs_fill_inode_lazy(struct erofs_inode *vi)
 			  vi->nid * 1ULL);
 		return -EFSCORRUPTED;
 	}
+
+	if (vi->z_advise & Z_EROFS_ADVISE_INLINE_PCLUSTER) {
+		struct erofs_map_blocks map = {
+			.index = UINT_MAX,
+			.m_la = vi->i_size - 1,
+		};
+
+		/* look up where the tail pcluster starts and is inlined */
+		vi->z_idata_size = le16_to_cpu(h->h_idata_size);
+		ret = z_erofs_do_map_blocks(vi, &map,
+					    EROFS_GET_BLOCKS_FINDTAIL);
+		if (ret)
+			return ret;
+		if (!map.m_plen ||
+		    erofs_sbi_blkoff(vi->sbi, map.m_pa) + map.m_plen >
+		    erofs_blksiz(vi->sbi)) {
+			erofs_err("invalid tail-packing pclustersize %llu @ nid %llu",
+				  map.m_plen | 0ULL, vi->nid | 0ULL);
+			return -EFSCORRUPTED;
+		}
+	}
+
+	if (vi->z_advise & Z_EROFS_ADVISE_FRAGMENT_PCLUSTER) {
+		struct erofs_map_blocks map = {
+			.index = UINT_MAX,
+			.m_la = vi->i_size - 1,
+		};
+
+		/* look up where the tail extent which is a fragment starts */
+		vi->z_fragmentoff = le32_to_cpu(h->h_fragmentoff);
+		ret = z_erofs_do_map_blocks(vi, &map,
+					    EROFS_GET_BLOCKS_FINDTAIL);
+		if (ret)
+			return ret;
+	}
+done:
 	vi->flags |= EROFS_I_Z_INITED;
 	return 0;
 }
@@ -79,22 +337,92 @@ struct z_erofs_maprecorder {
 	u16 clusterofs;
 	u16 delta[2];
 	erofs_blk_t pblk, compressedlcs;
+	/* where the index pack of this lcluster ends */
+	erofs_off_t nextpackoff;
+};
+
+/*
+ * Each thread reads index blocks into one buffer of the largest block size
+ * it has met, which all its maps share. The buffer remembers which map read
+ * it last, so a map only reuses its cached block if no other map of the
+ * same thread has overwritten it since.
+ */
+struct z_erofs_mpage {
+	const struct erofs_map_blocks *map;
+	unsigned int size;
+	char *page;
 };
 
+static pthread_key_t z_erofs_mpage_key;
+static pthread_once_t z_erofs_mpage_once = PTHREAD_ONCE_INIT;
+
+static void z_erofs_free_mpage(void *ptr)
+{
+	struct z_erofs_mpage *mp = ptr;
+
+	free(mp->page);
+	free(mp);
+}
+
+static void z_erofs_init_mpage_key(void)
+{
+	if (pthread_key_create(&z_erofs_mpage_key, z_erofs_free_mpage))
+		abort();
+}
+
+static struct z_erofs_mpage *z_erofs_get_mpage(unsigned int size)
+{
+	struct z_erofs_mpage *mp;
+	char *page;
+
+	pthread_once(&z_erofs_mpage_once, z_erofs_init_mpage_key);
+	mp = pthread_getspecific(z_erofs_mpage_key);
+	if (!mp) {
+		mp = calloc(1, sizeof(*mp));
+		if (!mp)
+			return NULL;
+		if (pthread_setspecific(z_erofs_mpage_key, mp)) {
+			free(mp);
+			return NULL;
+		}
+	}
+
+	if (size <= mp->size)
+		return mp;
+
+	page = malloc(size);
+	if (!page)
+		return NULL;
+	free(mp->page);
+	mp->page = page;
+	mp->size = size;
+	mp->map = NULL;
+	return mp;
+}
+
 static int z_erofs_reload_indexes(struct z_erofs_maprecorder *m,
 				  erofs_blk_t eblk)
 {
-	int ret;
+	struct erofs_sb_info *sbi = m->inode->sbi;
 	struct erofs_map_blocks *const map = m->map;
-	char *mpage = map->mpage;
+	struct z_erofs_mpage *mp;
+	int ret;
 
-	if (map->index == eblk)
+	mp = z_erofs_get_mpage(erofs_blksiz(sbi));
+	if (!mp)
+		return -ENOMEM;
+	m->kaddr = mp->page;
+
+	if (mp->map == map && map->index == eblk)
 		return 0;
 
-	ret = blk_read(mpage, eblk, 1);
-	if (ret < 0)
+	ret = blk_read(sbi, mp->page, eblk, 1);
+	if (ret < 0) {
+		mp->map = NULL;
 		return -EIO;
+	}
 
+	mp->map = map;
 	map->index = eblk;
 
 	return 0;
@@ -104,7 +432,7 @@ static int legacy_load_cluster_from_disk(struct z_erofs_maprecorder *m,
 					 unsigned long lcn)
 {
 	struct erofs_inode *const vi = m->inode;
-	const erofs_off_t ibase = iloc(vi->nid);
+	const erofs_off_t ibase = iloc(vi->sbi, vi->nid);
 	const erofs_off_t pos =
 		Z_EROFS_VLE_LEGACY_INDEX_ALIGN(ibase + vi->inode_isize +
 					       vi->xattr_isize) +
@@ -113,12 +441,13 @@ static int legacy_load_cluster_from_disk(struct z_erofs_maprecorder *m,
 	unsigned int advise, type;
 	int err;
 
-	err = z_erofs_reload_indexes(m, erofs_blknr(pos));
+	err = z_erofs_reload_indexes(m, erofs_sbi_blknr(vi->sbi, pos));
 	if (err)
 		return err;
 
 	m->lcn = lcn;
-	di = m->kaddr + erofs_blkoff(pos);
+	m->nextpackoff = pos + sizeof(struct z_erofs_vle_decompressed_index);
+	di = m->kaddr + erofs_sbi_blkoff(vi->sbi, pos);
 
 	advise = le16_to_cpu(di->di_advise);
 	type = (advise >> Z_EROFS_VLE_DI_CLUSTER_TYPE_BIT) &
@@ -162,25 +491,54 @@ static unsigned int decode_compactedbits(unsigned int lobits,
 	return lo;
 }
 
+static int get_compacted_la_distance(unsigned int lclusterbits,
+				     unsigned int encodebits,
+				     unsigned int vcnt, u8 *in, int i)
+{
+	const unsigned int lomask = (1 << lclusterbits) - 1;
+	unsigned int lo, d1 = 0;
+	u8 type;
+
+	DBG_BUGON(i >= vcnt);
+
+	do {
+		lo = decode_compactedbits(lclusterbits, lomask,
+					  in, encodebits * i, &type);
+
+		if (type != Z_EROFS_VLE_CLUSTER_TYPE_NONHEAD)
+			return d1;
+		++d1;
+	} while (++i < vcnt);
+
+	/* vcnt - 1 (Z_EROFS_VLE_CLUSTER_TYPE_NONHEAD) item */
+	if (!(lo & Z_EROFS_VLE_DI_D0_CBLKCNT))
+		d1 += lo - 1;
+	return d1;
+}
+
 static int unpack_compacted_index(struct z_erofs_maprecorder *m,
 				  unsigned int amortizedshift,
-				  unsigned int eofs)
+				  erofs_off_t pos, bool lookahead)
 {
 	struct erofs_inode *const vi = m->inode;
 	const unsigned int lclusterbits = vi->z_logical_clusterbits;
 	const unsigned int lomask = (1 << lclusterbits) - 1;
+	const unsigned int eofs = erofs_sbi_blkoff(vi->sbi, pos);
 	unsigned int vcnt, base, lo, encodebits, nblk;
 	int i;
 	u8 *in, type;
 	bool big_pcluster;
 
-	if (1 << amortizedshift == 4)
+	/* 2 bits are taken for the lcluster type among each encodebits */
+	if (1 << amortizedshift == 4 && lclusterbits <= 14)
 		vcnt = 2;
 	else if (1 << amortizedshift == 2 && lclusterbits == 12)
 		vcnt = 16;
 	else
 		return -EOPNOTSUPP;
 
+	m->nextpackoff = round_down(pos, vcnt << amortizedshift) +
+			 (vcnt << amortizedshift);
 	big_pcluster = vi->z_advise & Z_EROFS_ADVISE_BIG_PCLUSTER_1;
 	encodebits = ((vcnt << amortizedshift) - sizeof(__le32)) * 8 / vcnt;
 	base = round_down(eofs, vcnt << amortizedshift);
@@ -193,6 +551,11 @@ static int unpack_compacted_index(struct z_erofs_maprecorder *m,
 	m->type = type;
 	if (type == Z_EROFS_VLE_CLUSTER_TYPE_NONHEAD) {
 		m->clusterofs = 1 << lclusterbits;
+
+		/* figure out lookahead_distance: delta[1] if needed */
+		if (lookahead)
+			m->delta[1] = get_compacted_la_distance(lclusterbits,
+						encodebits, vcnt, in, i);
 		if (lo & Z_EROFS_VLE_DI_D0_CBLKCNT) {
 			if (!big_pcluster) {
 				DBG_BUGON(1);
@@ -258,25 +621,29 @@ static int unpack_compacted_index(struct z_erofs_maprecorder *m,
 		}
 	}
 	in += (vcnt << amortizedshift) - sizeof(__le32);
-	m->pblk = le32_to_cpu(*(__le32 *)in) + nblk;
+	/* pclusters are counted in lclusters */
+	m->pblk = le32_to_cpu(*(__le32 *)in) +
+		(nblk << (lclusterbits - vi->sbi->blkszbits));
 	return 0;
 }
 
 static int compacted_load_cluster_from_disk(struct z_erofs_maprecorder *m,
-					    unsigned long lcn)
+					    unsigned long lcn, bool lookahead)
 {
 	struct erofs_inode *const vi = m->inode;
 	const unsigned int lclusterbits = vi->z_logical_clusterbits;
-	const erofs_off_t ebase = round_up(iloc(vi->nid) + vi->inode_isize +
+	const erofs_off_t ebase = round_up(iloc(vi->sbi, vi->nid) +
+					   vi->inode_isize +
 					   vi->xattr_isize, 8) +
 		sizeof(struct z_erofs_map_header);
-	const unsigned int totalidx = DIV_ROUND_UP(vi->i_size, EROFS_BLKSIZ);
+	const unsigned int totalidx = DIV_ROUND_UP(vi->i_size,
+						   1 << lclusterbits);
 	unsigned int compacted_4b_initial, compacted_2b;
 	unsigned int amortizedshift;
 	erofs_off_t pos;
 	int err;
 
-	if (lclusterbits != 12)
+	if (lclusterbits > 14)
 		return -EOPNOTSUPP;
 
 	if (lcn >= totalidx)
@@ -310,14 +677,14 @@ static int compacted_load_cluster_from_disk(struct z_erofs_maprecorder *m,
 	amortizedshift = 2;
 out:
 	pos += lcn * (1 << amortizedshift);
-	err = z_erofs_reload_indexes(m, erofs_blknr(pos));
+	err = z_erofs_reload_indexes(m, erofs_sbi_blknr(vi->sbi, pos));
 	if (err)
 		return err;
-	return unpack_compacted_index(m, amortizedshift, erofs_blkoff(pos));
+	return unpack_compacted_index(m, amortizedshift, pos, lookahead);
 }
 
 static int z_erofs_load_cluster_from_disk(struct z_erofs_maprecorder *m,
-					  unsigned int lcn)
+					  unsigned int lcn, bool lookahead)
 {
 	const unsigned int datamode = m->inode->datalayout;
 
@@ -325,7 +692,7 @@ static int z_erofs_load_cluster_from_disk(struct z_erofs_maprecorder *m,
 		return legacy_load_cluster_from_disk(m, lcn);
 
 	if (datamode == EROFS_INODE_FLAT_COMPRESSION)
-		return compacted_load_cluster_from_disk(m, lcn);
+		return compacted_load_cluster_from_disk(m, lcn, lookahead);
 
 	return -EINVAL;
 }
@@ -348,7 +715,7 @@ static int z_erofs_extent_lookback(struct z_erofs_maprecorder *m,
 
 	/* load extent head logical cluster if needed */
 	lcn -= lookback_distance;
-	err = z_erofs_load_cluster_from_disk(m, lcn);
+	err = z_erofs_load_cluster_from_disk(m, lcn, false);
 	if (err)
 		return err;
 
@@ -396,7 +763,7 @@ static int z_erofs_get_extent_compressedlen(struct z_erofs_maprecorder *m,
 	if (m->compressedlcs)
 		goto out;
 
-	err = z_erofs_load_cluster_from_disk(m, lcn);
+	err = z_erofs_load_cluster_from_disk(m, lcn, false);
 	if (err)
 		return err;
 
@@ -442,39 +809,72 @@ err_bonus_cblkcnt:
 	return -EFSCORRUPTED;
 }
 
-int z_erofs_map_blocks_iter(struct erofs_inode *vi,
-			    struct erofs_map_blocks *map)
+static int z_erofs_get_extent_decompressedlen(struct z_erofs_maprecorder *m)
+{
+	struct erofs_inode *const vi = m->inode;
+	struct erofs_map_blocks *const map = m->map;
+	const unsigned int lclusterbits = vi->z_logical_clusterbits;
+	u64 lcn = m->lcn, headlcn = map->m_la >> lclusterbits;
+	int err;
+
+	do {
+		/* handle the last EOF pcluster (no next HEAD lcluster) */
+		if ((lcn << lclusterbits) >= vi->i_size) {
+			map->m_llen = vi->i_size - map->m_la;
+			return 0;
+		}
+
+		err = z_erofs_load_cluster_from_disk(m, lcn, true);
+		if (err)
+			return err;
+
+		if (m->type == Z_EROFS_VLE_CLUSTER_TYPE_NONHEAD) {
+			DBG_BUGON(!m->delta[1] &&
+				  m->clusterofs != 1 << lclusterbits);
+		} else if (m->type == Z_EROFS_VLE_CLUSTER_TYPE_PLAIN ||
+			   m->type == Z_EROFS_VLE_CLUSTER_TYPE_HEAD) {
+			/* go on until the next HEAD lcluster */
+			if (lcn != headlcn)
+				break;
+			m->delta[1] = 1;
+		} else {
+			erofs_err("unknown type %u @ lcn %llu of nid %llu",
+				  m->type, lcn | 0ULL, vi->nid | 0ULL);
+			DBG_BUGON(1);
+			return -EOPNOTSUPP;
+		}
+		lcn += m->delta[1];
+	} while (m->delta[1]);
+
+	map->m_llen = (lcn << lclusterbits) + m->clusterofs - map->m_la;
+	return 0;
+}
+
+static int z_erofs_do_map_blocks(struct erofs_inode *vi,
+				 struct erofs_map_blocks *map,
+				 int flags)
 {
 	struct z_erofs_maprecorder m = {
 		.inode = vi,
 		.map = map,
-		.kaddr = map->mpage,
 	};
-	int err = 0;
-	unsigned int lclusterbits, endoff;
-	unsigned long initial_lcn;
-	unsigned long long ofs, end;
-
-	/* when trying to read beyond EOF, leave it unmapped */
-	if (map->m_la >= vi->i_size) {
-		map->m_llen = map->m_la + 1 - vi->i_size;
-		map->m_la = vi->i_size;
-		map->m_flags = 0;
-		goto out;
-	}
+	const bool ztailpacking =
+		vi->z_advise & Z_EROFS_ADVISE_INLINE_PCLUSTER;
+	const bool fragment = vi->z_advise & Z_EROFS_ADVISE_FRAGMENT_PCLUSTER;
+	const unsigned int lclusterbits = vi->z_logical_clusterbits;
+	const unsigned long long ofs = map->m_la;
+	const unsigned long initial_lcn = ofs >> lclusterbits;
+	const unsigned int endoff = ofs & ((1 << lclusterbits) - 1);
+	unsigned long long end;
+	int err;
 
-	err = z_erofs_fill_inode_lazy(vi);
+	err = z_erofs_load_cluster_from_disk(&m, initial_lcn, false);
 	if (err)
-		goto out;
+		return err;
 
-	lclusterbits = vi->z_logical_clusterbits;
-	ofs = map->m_la;
-	initial_lcn = ofs >> lclusterbits;
-	endoff = ofs & ((1 << lclusterbits) - 1);
-
-	err = z_erofs_load_cluster_from_disk(&m, initial_lcn);
-	if (err)
-		goto out;
+	/* the inline pcluster follows the index pack of the last lcluster */
+	if (ztailpacking && (flags & EROFS_GET_BLOCKS_FINDTAIL))
+		vi->z_idataoff = m.nextpackoff;
 
 	map->m_flags = EROFS_MAP_ZIPPED;	/* by default, compressed */
 	end = (m.lcn + 1ULL) << lclusterbits;
@@ -491,8 +891,7 @@ int z_erofs_map_blocks_iter(struct erofs_inode *vi,
 		if (!m.lcn) {
 			erofs_err("invalid logical cluster 0 at nid %llu",
 				  (unsigned long long)vi->nid);
-			err = -EFSCORRUPTED;
-			goto out;
+			return -EFSCORRUPTED;
 		}
 		end = (m.lcn << lclusterbits) | m.clusterofs;
 		map->m_flags |= EROFS_MAP_FULL_MAPPED;
@@ -501,23 +900,86 @@ int z_erofs_map_blocks_iter(struct erofs_inode *vi,
 		/* get the correspoinding first chunk */
 		err = z_erofs_extent_lookback(&m, m.delta[0]);
 		if (err)
-			goto out;
+			return err;
 		break;
 	default:
 		erofs_err("unknown type %u @ offset %llu of nid %llu",
 			  m.type, ofs, (unsigned long long)vi->nid);
-		err = -EOPNOTSUPP;
-		goto out;
+		return -EOPNOTSUPP;
 	}
 
 	map->m_llen = end - map->m_la;
-	map->m_pa = blknr_to_addr(m.pblk);
+	if (flags & EROFS_GET_BLOCKS_FINDTAIL) {
+		vi->z_tailextent_headlcn = m.lcn;
+		/* for non-compact indexes, fragmentoff is 64 bits */
+		if (fragment &&
+		    vi->datalayout == EROFS_INODE_FLAT_COMPRESSION_LEGACY)
+			vi->z_fragmentoff |= (u64)m.pblk << 32;
+	}
+
+	if (ztailpacking && m.lcn == vi->z_tailextent_headlcn) {
+		map->m_flags |= EROFS_MAP_META;
+		map->m_pa = vi->z_idataoff;
+		map->m_plen = vi->z_idata_size;
+	} else if (fragment && m.lcn == vi->z_tailextent_headlcn) {
+		map->m_flags |= EROFS_MAP_FRAGMENT;
+		map->m_pa = 0;
+		map->m_plen = 0;
+	} else {
+		map->m_pa = erofs_sbi_pos(vi->sbi, m.pblk);
+		err = z_erofs_get_extent_compressedlen(&m, initial_lcn);
+		if (err)
+			return err;
+	}
+
+	if ((flags & EROFS_GET_BLOCKS_FIEMAP) &&
+	    !(map->m_flags & EROFS_MAP_FULL_MAPPED)) {
+		err = z_erofs_get_extent_decompressedlen(&m);
+		if (err)
+			return err;
+		map->m_flags |= EROFS_MAP_FULL_MAPPED;
+	}
+	map->m_flags |= EROFS_MAP_MAPPED;
+	return 0;
+}
+
+int z_erofs_map_blocks_iter(struct erofs_inode *vi,
+			    struct erofs_map_blocks *map,
+			    int flags)
+{
+	int err = 0;
+
+	/* when trying to read beyond EOF, leave it unmapped */
+	if (map->m_la >= vi->i_size) {
+		map->m_llen = map->m_la + 1 - vi->i_size;
+		map->m_la = vi->i_size;
+		map->m_flags = 0;
+		goto out;
+	}
 
-	err = z_erofs_get_extent_compressedlen(&m, initial_lcn);
+	/* cached extents are per nid, but each inode needs its map header */
+	err = z_erofs_fill_inode_lazy(vi);
 	if (err)
 		goto out;
-	map->m_flags |= EROFS_MAP_MAPPED;
 
+	if (z_erofs_extent_cache_lookup(vi, map, flags))
+		goto out;
+
+	/* the whole file is a fragment, which has no indexes */
+	if ((vi->z_advise & Z_EROFS_ADVISE_FRAGMENT_PCLUSTER) &&
+	    !vi->z_tailextent_headlcn) {
+		map->m_la = 0;
+		map->m_llen = vi->i_size;
+		map->m_pa = 0;
+		map->m_plen = 0;
+		map->m_flags = EROFS_MAP_MAPPED | EROFS_MAP_FULL_MAPPED |
+				EROFS_MAP_FRAGMENT;
+		goto out;
+	}
+
+	err = z_erofs_do_map_blocks(vi, map, flags);
+	if (!err)
+		z_erofs_extent_cache_insert(vi, map);
 out:
 	erofs_dbg("m_la %" PRIu64 " m_pa %" PRIu64 " m_llen %" PRIu64 " m_plen %" PRIu64 " m_flags 0%o",
 		  map->m_la, map->m_pa,
@@ -22,6 +22,9 @@
 #include "erofs/compress.h"
 #include "erofs/xattr.h"
 #include "erofs/exclude.h"
+#include "erofs/fragments.h"
+#include "erofs/dedupe.h"
+#include "erofs/chunk.h"
 
 #ifdef HAVE_LIBUUID
 #include <uuid.h>
@@ -48,6 +51,11 @@ static struct option long_options[] = {
 	{"product-out", required_argument, NULL, 11},
 	{"fs-config-file", required_argument, NULL, 12},
 #endif
+	{"sort-file", required_argument, NULL, 13},
+	{"chunksize", required_argument, NULL, 14},
+	{"lcluster-size", required_argument, NULL, 15},
+	{"fixed-input-size", required_argument, NULL, 16},
+	{"pcluster-align", required_argument, NULL, 17},
 	{0, 0, 0, 0},
 };
 
@@ -69,6 +77,7 @@ static void usage(void)
 	fputs("usage: [options] FILE DIRECTORY\n\n"
 	      "Generate erofs image from DIRECTORY to FILE, and [options] are:\n"
 	      " -zX[,Y]               X=compressor (Y=compression level, optional)\n"
+	      " -b#                   set block size to # (# = 512 to 65536, default 4096)\n"
 	      " -C#                   specify the size of compress physical cluster in bytes\n"
 	      " -d#                   set output message level to # (maximum 9)\n"
 	      " -x#                   set xattr tolerance to # (< 0, disable xattrs; default 2)\n"
@@ -82,11 +91,16 @@ static void usage(void)
 #ifdef HAVE_LIBSELINUX
 	      " --file-contexts=X     specify a file contexts file to setup selinux labels\n"
 #endif
+	      " --fixed-input-size=#  compress #-byte windows of files independently\n"
 	      " --force-uid=#         set all file uids to # (# = UID)\n"
 	      " --force-gid=#         set all file gids to # (# = GID)\n"
 	      " --all-root            make all files owned by root\n"
+	      " --chunksize=#         generate chunk-based uncompressed files with #-byte chunks\n"
 	      " --help                display this help and exit\n"
+	      " --lcluster-size=#     set the logical cluster size of compressed files to #\n"
 	      " --max-extent-bytes=#  set maximum decompressed extent size # in bytes\n"
+	      " --pcluster-align=#    keep pclusters from crossing #-byte boundaries of the image\n"
+	      " --sort-file=X         lay out data of the files listed in X first, in order\n"
 #ifndef NDEBUG
 	      " --random-pclusterblks randomize pclusterblks for big pcluster (debugging only)\n"
 #endif
@@ -138,7 +152,7 @@ static int parse_extended_opts(const char *opts)
 				return -EINVAL;
 			/* disable compacted indexes and 0padding */
 			cfg.c_legacy_compress = true;
-			erofs_sb_clear_lz4_0padding();
+			erofs_sb_clear_lz4_0padding(&g_sbi);
 		}
 
 		if (MATCH_EXTENTED_OPT("force-inode-compact", token, keylen)) {
@@ -153,10 +167,34 @@ static int parse_extended_opts(const char *opts)
 			cfg.c_force_inodeversion = FORCE_INODE_EXTENDED;
 		}
 
+		if (MATCH_EXTENTED_OPT("segregate-meta", token, keylen)) {
+			if (vallen)
+				return -EINVAL;
+			cfg.c_segregate_meta = true;
+		}
+
+		if (MATCH_EXTENTED_OPT("ztailpacking", token, keylen)) {
+			if (vallen)
+				return -EINVAL;
+			cfg.c_ztailpacking = true;
+		}
+
+		if (MATCH_EXTENTED_OPT("fragments", token, keylen)) {
+			if (vallen)
+				return -EINVAL;
+			cfg.c_fragments = true;
+		}
+
+		if (MATCH_EXTENTED_OPT("dedupe", token, keylen)) {
+			if (vallen)
+				return -EINVAL;
+			cfg.c_dedupe = true;
+		}
+
 		if (MATCH_EXTENTED_OPT("nosbcrc", token, keylen)) {
 			if (vallen)
 				return -EINVAL;
-			erofs_sb_clear_sb_chksum();
+			erofs_sb_clear_sb_chksum(&g_sbi);
 		}
 	}
 	return 0;
@@ -166,8 +204,10 @@ static int mkfs_parse_options_cfg(int argc, char *argv[])
 {
 	char *endptr;
 	int opt, i;
+	/* -C is checked after the block size is known */
+	unsigned int pclustersize = 0, pclusteralign = 0;
 
-	while((opt = getopt_long(argc, argv, "d:x:z:E:T:U:C:",
+	while((opt = getopt_long(argc, argv, "d:x:z:E:T:U:C:b:",
 				 long_options, NULL)) != -1) {
 		switch (opt) {
 		case 'z':
@@ -220,7 +260,7 @@ static int mkfs_parse_options_cfg(int argc, char *argv[])
 			break;
 #ifdef HAVE_LIBUUID
 		case 'U':
-			if (uuid_parse(optarg, sbi.uuid)) {
+			if (uuid_parse(optarg, g_sbi.uuid)) {
 				erofs_err("invalid UUID %s", optarg);
 				return -EINVAL;
 			}
@@ -294,15 +334,67 @@ static int mkfs_parse_options_cfg(int argc, char *argv[])
 			cfg.fs_config_file = optarg;
 			break;
 #endif
+		case 13:
+			opt = erofs_load_sort_file(optarg);
+			if (opt) {
+				erofs_err("failed to load sort file %s: %s",
+					  optarg, erofs_strerror(opt));
+				return opt;
+			}
+			break;
+		case 14:
+			i = strtoull(optarg, &endptr, 0);
+			if (*endptr != '\0' || i < EROFS_MIN_BLOCK_SIZE ||
+			    i > (1U << EROFS_CHUNK_MAX_BITS) || (i & (i - 1))) {
+				erofs_err("invalid chunksize %s", optarg);
+				return -EINVAL;
+			}
+			cfg.c_chunkbits = ilog2(i);
+			break;
+		case 15:
+			i = strtoull(optarg, &endptr, 0);
+			if (*endptr != '\0' || i < EROFS_MIN_BLOCK_SIZE ||
+			    i > Z_EROFS_LCLUSTER_MAX_SIZE || (i & (i - 1))) {
+				erofs_err("invalid lcluster size %s", optarg);
+				return -EINVAL;
+			}
+			cfg.c_lclusterbits = ilog2(i);
+			break;
+		case 16:
+			i = strtoull(optarg, &endptr, 0);
+			if (*endptr != '\0' || i <= 0 ||
+			    i > Z_EROFS_PCLUSTER_MAX_SIZE) {
+				erofs_err("invalid fixed input size %s", optarg);
+				return -EINVAL;
+			}
+			cfg.c_fixed_inputsize = i;
+			break;
+		case 17:
+			i = strtoull(optarg, &endptr, 0);
+			if (*endptr != '\0' || i <= 0) {
+				erofs_err("invalid pcluster alignment %s",
+					  optarg);
+				return -EINVAL;
+			}
+			pclusteralign = i;
+			break;
 		case 'C':
 			i = strtoull(optarg, &endptr, 0);
-			if (*endptr != '\0' ||
-			    i < EROFS_BLKSIZ || i % EROFS_BLKSIZ) {
+			if (*endptr != '\0' || i <= 0) {
 				erofs_err("invalid physical clustersize %s",
 					  optarg);
 				return -EINVAL;
 			}
-			cfg.c_physical_clusterblks = i / EROFS_BLKSIZ;
+			pclustersize = i;
+			break;
+		case 'b':
+			i = strtoull(optarg, &endptr, 0);
+			if (*endptr != '\0' || i < EROFS_MIN_BLOCK_SIZE ||
+			    i > EROFS_MAX_BLOCK_SIZE || (i & (i - 1))) {
+				erofs_err("invalid block size %s", optarg);
+				return -EINVAL;
+			}
+			g_sbi.blkszbits = ilog2(i);
 			break;
 
 		case 1:
@@ -314,6 +406,72 @@ static int mkfs_parse_options_cfg(int argc, char *argv[])
 		}
 	}
 
+	if (pclustersize) {
+		if (pclustersize < EROFS_BLKSIZ || pclustersize % EROFS_BLKSIZ) {
+			erofs_err("physical clustersize %u isn't a multiple of block size %u",
+				  pclustersize, EROFS_BLKSIZ);
+			return -EINVAL;
+		}
+		cfg.c_physical_clusterblks = pclustersize / EROFS_BLKSIZ;
+	}
+
+	if (cfg.c_chunkbits && cfg.c_chunkbits < LOG_BLOCK_SIZE) {
+		erofs_err("chunksize %u is smaller than block size %u",
+			  1U << cfg.c_chunkbits, EROFS_BLKSIZ);
+		return -EINVAL;
+	}
+
+	if (!cfg.c_lclusterbits) {
+		cfg.c_lclusterbits = LOG_BLOCK_SIZE;
+	} else if (cfg.c_lclusterbits < LOG_BLOCK_SIZE) {
+		erofs_err("lcluster size %u is smaller than block size %u",
+			  1U << cfg.c_lclusterbits, EROFS_BLKSIZ);
+		return -EINVAL;
+	} else if (cfg.c_lclusterbits > LOG_BLOCK_SIZE) {
+		const unsigned int lclusterblks =
+			1U << (cfg.c_lclusterbits - LOG_BLOCK_SIZE);
+
+		/* a pcluster takes at least one lcluster */
+		if (cfg.c_physical_clusterblks == 1)
+			cfg.c_physical_clusterblks = lclusterblks;
+		if (cfg.c_physical_clusterblks % lclusterblks) {
+			erofs_err("physical clustersize should be a multiple of lcluster size %u",
+				  lclusterblks * EROFS_BLKSIZ);
+			return -EINVAL;
+		}
+		if (cfg.c_dedupe) {
+			erofs_err("-Ededupe is unsupported with lclusters larger than a block");
+			return -EINVAL;
+		}
+	}
+
+	if (cfg.c_fixed_inputsize) {
+		if (cfg.c_fixed_inputsize % (1U << cfg.c_lclusterbits)) {
+			erofs_err("fixed input size should be a multiple of lcluster size %u",
+				  1U << cfg.c_lclusterbits);
+			return -EINVAL;
+		}
+		if (cfg.c_dedupe) {
+			erofs_err("-Ededupe is unsupported with fixed input size");
+			return -EINVAL;
+		}
+		/* a window could be compressed into blocks up to its size */
+		if (!pclustersize)
+			cfg.c_physical_clusterblks =
+				cfg.c_fixed_inputsize / EROFS_BLKSIZ;
+	}
+
+	if (pclusteralign) {
+		/* so that any pcluster fits in between two boundaries */
+		if (pclusteralign %
+		    (cfg.c_physical_clusterblks * EROFS_BLKSIZ)) {
+			erofs_err("pcluster alignment should be a multiple of physical clustersize %u",
+				  cfg.c_physical_clusterblks * EROFS_BLKSIZ);
+			return -EINVAL;
+		}
+		cfg.c_pcluster_alignblks = pclusteralign / EROFS_BLKSIZ;
+	}
+
 	if (optind >= argc)
 		return -EINVAL;
 
@@ -348,13 +506,14 @@ int erofs_mkfs_update_super_block(struct erofs_buffer_head *bh,
 		.magic     = cpu_to_le32(EROFS_SUPER_MAGIC_V1),
 		.blkszbits = LOG_BLOCK_SIZE,
 		.inos   = 0,
-		.build_time = cpu_to_le64(sbi.build_time),
-		.build_time_nsec = cpu_to_le32(sbi.build_time_nsec),
+		.build_time = cpu_to_le64(g_sbi.build_time),
+		.build_time_nsec = cpu_to_le32(g_sbi.build_time_nsec),
 		.blocks = 0,
-		.meta_blkaddr  = sbi.meta_blkaddr,
-		.xattr_blkaddr = sbi.xattr_blkaddr,
-		.feature_incompat = cpu_to_le32(sbi.feature_incompat),
-		.feature_compat = cpu_to_le32(sbi.feature_compat &
+		.meta_blkaddr  = g_sbi.meta_blkaddr,
+		.xattr_blkaddr = g_sbi.xattr_blkaddr,
+		.packed_nid = cpu_to_le64(g_sbi.packed_nid),
+		.feature_incompat = cpu_to_le32(g_sbi.feature_incompat),
+		.feature_compat = cpu_to_le32(g_sbi.feature_compat &
 					      ~EROFS_FEATURE_COMPAT_SB_CHKSUM),
 	};
 	const unsigned int sb_blksize =
@@ -364,12 +523,12 @@ int erofs_mkfs_update_super_block(struct erofs_buffer_head *bh,
 	*blocks         = erofs_mapbh(NULL);
 	sb.blocks       = cpu_to_le32(*blocks);
 	sb.root_nid     = cpu_to_le16(root_nid);
-	memcpy(sb.uuid, sbi.uuid, sizeof(sb.uuid));
+	memcpy(sb.uuid, g_sbi.uuid, sizeof(sb.uuid));
 
-	if (erofs_sb_has_compr_cfgs())
-		sb.u1.available_compr_algs = sbi.available_compr_algs;
+	if (erofs_sb_has_compr_cfgs(&g_sbi))
+		sb.u1.available_compr_algs = g_sbi.available_compr_algs;
 	else
-		sb.u1.lz4_max_distance = cpu_to_le16(sbi.lz4_max_distance);
+		sb.u1.lz4_max_distance = cpu_to_le16(g_sbi.lz4_max_distance);
 
 	buf = calloc(sb_blksize, 1);
 	if (!buf) {
@@ -399,12 +558,15 @@ static inline u32 crc32c(u32 crc, const u8 *in, size_t len)
 
 static int erofs_mkfs_superblock_csum_set(void)
 {
+	/* the checksum covers a block size of bytes from the superblock on */
+	const unsigned int len = EROFS_BLKSIZ > EROFS_SUPER_OFFSET ?
+		EROFS_BLKSIZ - EROFS_SUPER_OFFSET : EROFS_BLKSIZ;
 	int ret;
-	u8 buf[EROFS_BLKSIZ];
+	u8 buf[EROFS_SUPER_OFFSET + EROFS_MAX_BLOCK_SIZE];
 	u32 crc;
 	struct erofs_super_block *sb;
 
-	ret = blk_read(buf, 0, 1);
+	ret = dev_read(&g_sbi, buf, 0, EROFS_SUPER_OFFSET + len);
 	if (ret) {
 		erofs_err("failed to read superblock to set checksum: %s",
 			  erofs_strerror(ret));
@@ -425,12 +587,12 @@ static int erofs_mkfs_superblock_csum_set(void)
 	/* turn on checksum feature */
 	sb->feature_compat = cpu_to_le32(le32_to_cpu(sb->feature_compat) |
 					 EROFS_FEATURE_COMPAT_SB_CHKSUM);
-	crc = crc32c(~0, (u8 *)sb, EROFS_BLKSIZ - EROFS_SUPER_OFFSET);
+	crc = crc32c(~0, (u8 *)sb, len);
 
 	/* set up checksum field to erofs_super_block */
 	sb->checksum = cpu_to_le32(crc);
 
-	ret = blk_write(buf, 0, 1);
+	ret = dev_write(&g_sbi, buf, 0, EROFS_SUPER_OFFSET + len);
 	if (ret) {
 		erofs_err("failed to write checksummed superblock: %s",
 			  erofs_strerror(ret));
@@ -444,14 +606,14 @@ static int erofs_mkfs_superblock_csum_set(void)
 static void erofs_mkfs_default_options(void)
 {
 	cfg.c_legacy_compress = false;
-	sbi.feature_incompat = EROFS_FEATURE_INCOMPAT_LZ4_0PADDING;
-	sbi.feature_compat = EROFS_FEATURE_COMPAT_SB_CHKSUM;
+	g_sbi.feature_incompat = EROFS_FEATURE_INCOMPAT_LZ4_0PADDING;
+	g_sbi.feature_compat = EROFS_FEATURE_COMPAT_SB_CHKSUM;
 
 	/* generate a default uuid first */
 #ifdef HAVE_LIBUUID
 	do {
-		uuid_generate(sbi.uuid);
-	} while (uuid_is_null(sbi.uuid));
+		uuid_generate(g_sbi.uuid);
+	} while (uuid_is_null(g_sbi.uuid));
 #endif
 }
 
@@ -486,7 +648,7 @@ int main(int argc, char **argv)
 {
 	int err = 0;
 	struct erofs_buffer_head *sb_bh;
-	struct erofs_inode *root_inode;
+	struct erofs_inode *root_inode, *packed_inode;
 	erofs_nid_t root_nid;
 	struct stat64 st;
 	erofs_blk_t nblocks;
@@ -522,14 +684,14 @@ int main(int argc, char **argv)
 	}
 
 	if (cfg.c_unix_timestamp != -1) {
-		sbi.build_time      = cfg.c_unix_timestamp;
-		sbi.build_time_nsec = 0;
+		g_sbi.build_time      = cfg.c_unix_timestamp;
+		g_sbi.build_time_nsec = 0;
 	} else if (!gettimeofday(&t, NULL)) {
-		sbi.build_time      = t.tv_sec;
-		sbi.build_time_nsec = t.tv_usec;
+		g_sbi.build_time      = t.tv_sec;
+		g_sbi.build_time_nsec = t.tv_usec;
 	}
 
-	err = dev_open(cfg.c_img_path);
+	err = dev_open(&g_sbi, cfg.c_img_path);
 	if (err) {
 		usage();
 		return 1;
@@ -570,8 +732,37 @@ int main(int argc, char **argv)
 		goto exit;
 	}
 
+	if (cfg.c_fragments) {
+		err = z_erofs_fragments_init();
+		if (err) {
+			erofs_err("Failed to initialize fragments: %s",
+				  erofs_strerror(err));
+			goto exit;
+		}
+	}
+
+	if (cfg.c_chunkbits) {
+		err = erofs_chunk_init();
+		if (err) {
+			erofs_err("Failed to initialize chunks: %s",
+				  erofs_strerror(err));
+			goto exit;
+		}
+	}
+
+	if (cfg.c_dedupe) {
+		err = z_erofs_dedupe_init();
+		if (!err)
+			err = z_erofs_dedupe_scan(cfg.c_src_path);
+		if (err) {
+			erofs_err("Failed to initialize deduplication: %s",
+				  erofs_strerror(err));
+			goto exit;
+		}
+	}
+
 #ifdef HAVE_LIBUUID
-	uuid_unparse_lower(sbi.uuid, uuid_str);
+	uuid_unparse_lower(g_sbi.uuid, uuid_str);
 #endif
 	erofs_info("filesystem UUID: %s", uuid_str);
 
@@ -593,6 +784,20 @@ int main(int argc, char **argv)
 	root_nid = erofs_lookupnid(root_inode);
 	erofs_iput(root_inode);
 
+	if (cfg.c_fragments) {
+		packed_inode = erofs_mkfs_build_packed_file();
+		if (IS_ERR(packed_inode)) {
+			err = PTR_ERR(packed_inode);
+			erofs_err("Failed to build the packed inode: %s",
+				  erofs_strerror(err));
+			goto exit;
+		}
+		if (packed_inode) {
+			g_sbi.packed_nid = erofs_lookupnid(packed_inode);
+			erofs_iput(packed_inode);
+		}
+	}
+
 	err = erofs_mkfs_update_super_block(sb_bh, root_nid, &nblocks);
 	if (err)
 		goto exit;
@@ -601,14 +806,19 @@ int main(int argc, char **argv)
 	if (!erofs_bflush(NULL))
 		err = -EIO;
 	else
-		err = dev_resize(nblocks);
+		err = dev_resize(&g_sbi, nblocks);
 
-	if (!err && erofs_sb_has_sb_chksum())
+	if (!err && erofs_sb_has_sb_chksum(&g_sbi))
 		err = erofs_mkfs_superblock_csum_set();
 exit:
 	z_erofs_compress_exit();
-	dev_close();
+	z_erofs_fragments_exit();
+	z_erofs_dedupe_exit();
+	erofs_chunk_exit();
+	erofs_buffer_exit();
+	dev_close(&g_sbi);
 	erofs_cleanup_exclude_rules();
+	erofs_cleanup_sort_file();
 	erofs_exit_configure();
 
 	if (err) {